@@ -0,0 +1,119 @@
+#ifndef BENCH_UTIL_H
+#define BENCH_UTIL_H
+
+#include "pch.h"
+#include <climits>
+#include <cmath>
+
+// tinybench和tinyreplay共用的计时、延迟直方图和响应解析
+
+inline long long now_ns() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+/**
+ * HDR风格的延迟直方图，单位ns
+ * 小于2^SUB_BITS的值精确记录，更大的值按2的幂分段，每段再线性分成2^(SUB_BITS-1)份，相对误差小于1%
+ * 每个线程一个，结束后合并，记录时不需要同步
+ */
+class LatencyHistogram {
+public:
+    static constexpr int SUB_BITS = 7;
+    static constexpr int SUB_COUNT = 1 << SUB_BITS;
+    static constexpr int HALF_COUNT = SUB_COUNT / 2;
+    static constexpr int MAX_SHIFT = 40;
+
+    LatencyHistogram() : counts_(SUB_COUNT + MAX_SHIFT * HALF_COUNT, 0), count_(0), sum_(0), min_(LLONG_MAX), max_(0) { }
+
+    void record(long long value) {
+        value = std::max(value, 0LL);
+        counts_[index_of(value)]++;
+        count_++;
+        sum_ += value;
+        min_ = std::min(min_, value);
+        max_ = std::max(max_, value);
+    }
+
+    void merge(const LatencyHistogram& other) {
+        for (size_t i = 0; i < counts_.size(); i++)
+            counts_[i] += other.counts_[i];
+        count_ += other.count_;
+        sum_ += other.sum_;
+        min_ = std::min(min_, other.min_);
+        max_ = std::max(max_, other.max_);
+    }
+
+    // 分位数，返回所在格子的上界，p取值0~1
+    long long percentile(double p) const {
+        if (count_ == 0)
+            return 0;
+        long long target = (long long) ceil(p * count_);
+        long long seen = 0;
+        for (size_t i = 0; i < counts_.size(); i++) {
+            seen += counts_[i];
+            if (seen >= target)
+                return std::min(upper_of(i), max_);
+        }
+        return max_;
+    }
+
+    long long count() const { return count_; }
+    double mean() const { return count_ == 0 ? 0 : (double) sum_ / count_; }
+    long long min_value() const { return count_ == 0 ? 0 : min_; }
+    long long max_value() const { return max_; }
+
+private:
+    static int index_of(long long value) {
+        if (value < SUB_COUNT)
+            return value;
+        int shift = std::min(63 - __builtin_clzll(value) - (SUB_BITS - 1), MAX_SHIFT);
+        long long sub = std::min(value >> shift, (long long) SUB_COUNT - 1);
+        return SUB_COUNT + (shift - 1) * HALF_COUNT + (sub - HALF_COUNT);
+    }
+
+    static long long upper_of(size_t index) {
+        if (index < SUB_COUNT)
+            return index;
+        int shift = (index - SUB_COUNT) / HALF_COUNT + 1;
+        long long sub = (index - SUB_COUNT) % HALF_COUNT + HALF_COUNT;
+        return ((sub + 1) << shift) - 1;
+    }
+
+    std::vector<long long> counts_;
+    long long count_;
+    long long sum_;
+    long long min_;
+    long long max_;
+};
+
+// 解析in开头的一个完整响应，成功返回响应长度并设置状态码，数据不够返回0，格式错误返回-1
+// 没有Content-Length的响应读到连接关闭为止，eof为true时把剩余数据都算作响应体
+inline long long parse_response(std::string_view in, bool eof, int* status) {
+    size_t end = in.find("\r\n\r\n");
+    if (end == std::string_view::npos)
+        return eof && !in.empty() ? -1 : 0;
+    if (in.substr(0, 5) != "HTTP/")
+        return -1;
+    size_t space = in.find(' ');
+    if (space == std::string_view::npos || space > end)
+        return -1;
+    *status = atoi(in.data() + space + 1);
+
+    long long length = -1;
+    size_t pos = in.find("\r\n") + 2;
+    while (pos < end) {
+        size_t line_end = in.find("\r\n", pos);
+        // 头部以空行结尾，这里的strtoll不会越过缓冲区
+        if (strncasecmp(in.data() + pos, "Content-Length:", 15) == 0)
+            length = strtoll(in.data() + pos + 15, nullptr, 10);
+        pos = line_end + 2;
+    }
+    long long header = end + 4;
+    if (length < 0)
+        return eof ? (long long) in.size() : 0;
+    return (long long) in.size() >= header + length ? header + length : 0;
+}
+
+#endif
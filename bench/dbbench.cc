@@ -0,0 +1,320 @@
+#include "pch.h"
+#include <thread>
+
+#include "async_db.h"
+#include "bench_util.h"
+#include "config.h"
+#include "executor.h"
+#include "mysql_conn.h"
+#include "register_batcher.h"
+#include "task.h"
+#include "user_store.h"
+
+using namespace std;
+
+/**
+ * dbbench：用户数据写入和查询的基准
+ * 每个用例共执行ops次操作，报告每秒操作数、失败数和单次操作的延迟分位数，每个用例输出一行JSON
+ *   insert.text      转义后拼接INSERT语句，mysql_real_query执行，每行一次自动提交，即预处理语句缓存之前的写法
+ *   insert.prepared  ConnPool::execute执行连接上缓存的预处理语句，每行一次自动提交
+ *   insert.batched   clients个协程同时通过RegisterBatcher注册，攒批后一个事务提交一批，即注册请求的写法
+ *   store.find.mysql clients个协程同时通过MysqlUserStore查询，经过AsyncDb的共享连接，即登录请求未命中缓存时的写法
+ *   store.find.local 同样的查询换成临时文件上的LocalUserStore，和上一个用例直接比较存储后端的延迟
+ * 需要一个有user表的数据库，用户名带进程号，不会和已有用户重复，结束后不删除；连不上数据库时只运行store.find.local
+ */
+
+struct DbBenchOptions {
+    const char* host = "localhost";
+    int port = 3306;
+    const char* user = "root";
+    const char* password = "root";
+    const char* db = "TinyWebServerDB";
+    int threads = 8;
+    int clients = 64;
+    long long ops = 20000;
+    const char* filter = "";
+};
+
+static DbBenchOptions options;
+
+constexpr char SQL_INSERT_USER[] = "INSERT INTO user(username, passwd) VALUES(?, ?)";
+// store.find用例预先注册的用户数，查询依次轮转
+constexpr int FIND_USERS = 1000;
+
+// concurrency为同时在途的操作数
+static void report(const char* name, int concurrency, long long ops, long long errors, long long elapsed_ns,
+    const LatencyHistogram& latency) {
+    printf("{\"name\":\"%s\",\"concurrency\":%d,\"ops\":%lld,\"errors\":%lld,\"ops_per_s\":%.1f,"
+        "\"latency_us\":{\"mean\":%.1f,\"p50\":%.1f,\"p99\":%.1f,\"max\":%.1f}}\n",
+        name, concurrency, ops, errors, ops * 1e9 / elapsed_ns,
+        latency.mean() / 1000.0, latency.percentile(0.5) / 1000.0, latency.percentile(0.99) / 1000.0,
+        latency.max_value() / 1000.0);
+    fflush(stdout);
+}
+
+// 用户名带进程号、用例名和线程号，每次运行都是新用户
+static void user_name(char* name, int size, const char* tag, int thread_id, long long i) {
+    snprintf(name, size, "db%d_%s_%d_%lld", (int) getpid(), tag, thread_id, i);
+}
+
+// threads个线程各执行ops/threads次op，op的参数为线程号和序号，返回false计为失败
+static void run_case(const char* name, const function<bool(int, long long)>& op) {
+    if (strstr(name, options.filter) == nullptr)
+        return;
+
+    long long per_thread = options.ops / options.threads;
+    vector<LatencyHistogram> latency(options.threads);
+    vector<long long> errors(options.threads, 0);
+    vector<thread> workers;
+    long long start = now_ns();
+    for (int t = 0; t < options.threads; t++) {
+        workers.emplace_back([&, t] {
+            for (long long i = 0; i < per_thread; i++) {
+                long long begin = now_ns();
+                if (!op(t, i))
+                    errors[t]++;
+                latency[t].record(now_ns() - begin);
+            }
+        });
+    }
+    for (thread& worker : workers)
+        worker.join();
+    long long elapsed = now_ns() - start;
+
+    long long total_errors = 0;
+    for (int t = 1; t < options.threads; t++)
+        latency[0].merge(latency[t]);
+    for (long long count : errors)
+        total_errors += count;
+    report(name, options.threads, per_thread * options.threads, total_errors, elapsed, latency[0]);
+}
+
+// 每个线程固定使用一条连接，两种写法只差在语句的准备方式上
+static void bench_insert(ConnPool* conn_pool, const vector<MYSQL*>& conns) {
+    run_case("insert.text", [&](int t, long long i) {
+        char name[64];
+        char escaped[sizeof(name) * 2 + 1];
+        char sql[256];
+        user_name(name, sizeof(name), "text", t, i);
+        mysql_real_escape_string_quote(conns[t], escaped, name, strlen(name), '\'');
+        int len = snprintf(sql, sizeof(sql), "INSERT INTO user(username, passwd) VALUES('%s', '%s')", escaped, escaped);
+        return mysql_real_query(conns[t], sql, len) == 0;
+    });
+
+    run_case("insert.prepared", [&](int t, long long i) {
+        char name[64];
+        user_name(name, sizeof(name), "prepared", t, i);
+        const char* params[2] = { name, name };
+        return conn_pool->execute(conns[t], SQL_INSERT_USER, params, 2) == 0;
+    });
+}
+
+// 一个不断提交操作的协程，记录每次操作的延迟和失败数
+struct Client {
+    LatencyHistogram latency;
+    long long errors = 0;
+    Task<> task;
+};
+
+static Task<> register_loop(Client* client, int id, long long count, atomic<int>* running) {
+    RegisterBatcher* batcher = RegisterBatcher::get_instance();
+    for (long long i = 0; i < count; i++) {
+        char name[64];
+        user_name(name, sizeof(name), "batched", id, i);
+        long long begin = now_ns();
+        RegisterBatcher::Status status = co_await batcher->submit(name, name);
+        client->latency.record(now_ns() - begin);
+        if (status != RegisterBatcher::REGISTERED)
+            client->errors++;
+    }
+    running->fetch_sub(1);
+}
+
+// 没有绑定线程池，提交者在批量线程上直接恢复，立即提交下一条，同时在途的注册数固定为clients
+static void bench_batched() {
+    const char* name = "insert.batched";
+    if (strstr(name, options.filter) == nullptr)
+        return;
+
+    long long per_client = options.ops / options.clients;
+    vector<Client> clients(options.clients);
+    atomic<int> running(options.clients);
+    long long start = now_ns();
+    for (int i = 0; i < options.clients; i++) {
+        clients[i].task = register_loop(&clients[i], i, per_client, &running);
+        clients[i].task.resume();
+    }
+    while (running.load() > 0)
+        this_thread::sleep_for(chrono::milliseconds(1));
+    long long elapsed = now_ns() - start;
+
+    long long errors = 0;
+    for (int i = 0; i < options.clients; i++) {
+        errors += clients[i].errors;
+        if (i > 0)
+            clients[0].latency.merge(clients[i].latency);
+    }
+    report(name, options.clients, per_client * options.clients, errors, elapsed, clients[0].latency);
+}
+
+// 就绪的查询协程，AsyncDb和执行器都在主线程上提交，由主线程上的事件循环恢复
+static deque<coroutine_handle<>> ready;
+
+// 运行事件循环，直到所有查询协程结束
+static void run_loop(int epollfd, const atomic<int>& running) {
+    Executor* executor = Executor::get_instance();
+    epoll_event events[16];
+    while (true) {
+        while (!ready.empty()) {
+            coroutine_handle<> handle = ready.front();
+            ready.pop_front();
+            handle.resume();
+        }
+        if (running.load() == 0)
+            return;
+        int number = epoll_wait(epollfd, events, 16, executor->next_timeout());
+        for (int i = 0; i < number; i++)
+            executor->dispatch(events[i].data.fd);
+        executor->run_timers();
+    }
+}
+
+// 一个不断查询已注册用户的协程，密码和用户名相同，查不到或者密码不对计为失败
+static Task<> find_loop(UserStore* store, Client* client, int id, long long count, atomic<int>* running) {
+    for (long long i = 0; i < count; i++) {
+        char name[64];
+        char password[64];
+        user_name(name, sizeof(name), "find", 0, (id + i * options.clients) % FIND_USERS);
+        long long begin = now_ns();
+        UserStore::Status status = co_await store->find(name, password, sizeof(password));
+        client->latency.record(now_ns() - begin);
+        if (status != UserStore::OK || strcmp(password, name) != 0)
+            client->errors++;
+    }
+    running->fetch_sub(1);
+}
+
+static void bench_find(const char* name, UserStore* store, int epollfd) {
+    long long per_client = options.ops / options.clients;
+    vector<Client> clients(options.clients);
+    atomic<int> running(options.clients);
+    long long start = now_ns();
+    for (int i = 0; i < options.clients; i++) {
+        clients[i].task = find_loop(store, &clients[i], i, per_client, &running);
+        clients[i].task.resume();
+    }
+    run_loop(epollfd, running);
+    long long elapsed = now_ns() - start;
+
+    long long errors = 0;
+    for (int i = 0; i < options.clients; i++) {
+        errors += clients[i].errors;
+        if (i > 0)
+            clients[0].latency.merge(clients[i].latency);
+    }
+    report(name, options.clients, per_client * options.clients, errors, elapsed, clients[0].latency);
+}
+
+// 两个后端先各自注册FIND_USERS个用户，再用clients个协程同时查询
+// 本地存储的查询不挂起，每个协程依次跑完，报告的是单次查询本身的开销
+static void bench_store(ConnPool* conn_pool, bool mysql) {
+    bool run_mysql = mysql && strstr("store.find.mysql", options.filter) != nullptr;
+    bool run_local = strstr("store.find.local", options.filter) != nullptr;
+    if (!run_mysql && !run_local)
+        return;
+
+    // 批量写入线程已经空闲，之后只有主线程向执行器提交协程
+    int epollfd = epoll_create(5);
+    Executor::get_instance()->init(epollfd, [](coroutine_handle<> handle) {
+        ready.push_back(handle);
+    });
+
+    char name[64];
+    if (run_mysql) {
+        MYSQL* conn = nullptr;
+        {
+            ConnRaii mysql_conn(&conn, conn_pool);
+            for (int i = 0; i < FIND_USERS && conn != nullptr; i++) {
+                user_name(name, sizeof(name), "find", 0, i);
+                const char* params[2] = { name, name };
+                conn_pool->execute(conn, SQL_INSERT_USER, params, 2);
+            }
+        }
+        // 共享连接数、合并深度和超时与服务端相同
+        AsyncDb::get_instance()->init(conn_pool, 2, 8, 500);
+        MysqlUserStore store;
+        bench_find("store.find.mysql", &store, epollfd);
+    }
+
+    if (run_local) {
+        char path[] = "/tmp/dbbench.XXXXXX";
+        int fd = mkstemp(path);
+        if (fd == -1) {
+            STDERR_FUNC_LINE();
+            return;
+        }
+        close(fd);
+        LocalUserStore store;
+        if (store.open(path)) {
+            for (int i = 0; i < FIND_USERS; i++) {
+                user_name(name, sizeof(name), "find", 0, i);
+                // 本地注册不挂起，resume返回时已经完成
+                Task<UserStore::Status> task = store.add(name, name);
+                task.resume();
+            }
+            bench_find("store.find.local", &store, epollfd);
+        }
+        unlink(path);
+    }
+}
+
+static void usage(const char* name) {
+    fprintf(stderr, "usage: %s [-a host] [-p port] [-u user] [-w password] [-D database] [-t threads] [-c clients] [-n ops] [-f filter]\n", name);
+}
+
+int main(int argc, char* argv[]) {
+    int opt = 0;
+    while ((opt = getopt(argc, argv, "a:p:u:w:D:t:c:n:f:")) != -1) {
+        if (opt == 'a') options.host = optarg;
+        else if (opt == 'p') options.port = atoi(optarg);
+        else if (opt == 'u') options.user = optarg;
+        else if (opt == 'w') options.password = optarg;
+        else if (opt == 'D') options.db = optarg;
+        else if (opt == 't') options.threads = max(1, atoi(optarg));
+        else if (opt == 'c') options.clients = max(1, atoi(optarg));
+        else if (opt == 'n') options.ops = max(1LL, atoll(optarg));
+        else if (opt == 'f') options.filter = optarg;
+        else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    // 不初始化运行日志
+    Config::close_log_ = true;
+
+    ConnPool* conn_pool = ConnPool::get_instance();
+    // 每个线程一条连接，另外一条给批量写入线程
+    conn_pool->init(options.host, options.user, options.password, options.db, options.port,
+        options.threads + 1, options.threads + 1, true, 5000);
+    vector<MYSQL*> conns(options.threads, nullptr);
+    bool mysql = true;
+    for (MYSQL*& conn : conns) {
+        conn = conn_pool->get_conn();
+        if (conn == nullptr) {
+            fprintf(stderr, "dbbench: cannot connect to MySQL at %s:%d, run local cases only\n", options.host, options.port);
+            mysql = false;
+            break;
+        }
+    }
+
+    if (mysql) {
+        bench_insert(conn_pool, conns);
+        RegisterBatcher::get_instance()->init(conn_pool);
+        bench_batched();
+    }
+    for (MYSQL* conn : conns)
+        conn_pool->rel_conn(conn);
+
+    bench_store(conn_pool, mysql);
+    return 0;
+}
@@ -0,0 +1,22 @@
+#!/bin/sh
+# 服务端分别用1、2、4、8个工作线程启动，用tinybench压测并发登录，每种线程数输出一行JSON
+# 登录使用未注册的新用户名，不命中用户缓存，每个请求都在协程里等待一次存储后端
+# 在TinyWebServer和tinybench所在目录运行，参数原样传给tinybench：
+#     sh ../bench/login_scaling.sh -t 4 -c 1024 -d 10
+# 默认使用MySQL后端，BACKEND=1改用本地用户存储，THREADS指定要测的线程数
+
+PORT=${PORT:-9006}
+SERVER=${SERVER:-./TinyWebServer}
+BENCH=${BENCH:-./tinybench}
+BACKEND=${BACKEND:-0}
+THREADS=${THREADS:-"1 2 4 8"}
+
+for threads in $THREADS; do
+    $SERVER -p $PORT -t $threads -b $BACKEND -l 1 -r 0 > /dev/null 2>&1 &
+    pid=$!
+    sleep 1
+    result=$($BENCH -p $PORT -m 0,100,0 -u 0 "$@" | tr -d '\n')
+    kill $pid
+    wait $pid 2> /dev/null
+    echo "{\"server_threads\":$threads,\"backend\":$BACKEND,\"result\":$result}"
+done
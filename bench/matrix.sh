@@ -0,0 +1,21 @@
+#!/bin/sh
+# 连接的触发模式(LT/ET)和并发模型(Proactor/Reactor)四种组合各压测一次，每种组合输出一行JSON
+# 在TinyWebServer和tinybench所在目录运行，参数原样传给tinybench：
+#     sh ../bench/matrix.sh -t 2 -c 64 -d 10
+# 服务端使用本地用户存储，关闭运行日志和访问日志，不需要数据库
+
+PORT=${PORT:-9006}
+SERVER=${SERVER:-./TinyWebServer}
+BENCH=${BENCH:-./tinybench}
+
+for actor in 0 1; do
+    for trig in 0 1; do
+        $SERVER -p $PORT -m $trig -a $actor -b 1 -l 1 -r 0 > /dev/null 2>&1 &
+        pid=$!
+        sleep 1
+        result=$($BENCH -p $PORT "$@" | tr -d '\n')
+        kill $pid
+        wait $pid 2> /dev/null
+        echo "{\"trig_mode\":$trig,\"actor_pattern\":$actor,\"result\":$result}"
+    done
+done
@@ -0,0 +1,652 @@
+#include "pch.h"
+#include <filesystem>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <thread>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "blocking_queue.h"
+#include "http_conn.h"
+#include "log.h"
+#include "rate_limiter.h"
+#include "thread_pool.h"
+#include "timer.h"
+
+using namespace std;
+
+/**
+ * microbench：核心数据结构的微基准
+ * 每个用例先完整跑一遍预热，再重复reps次，每次执行ops次操作，报告每次操作的墙上时间中位数、最小值和最大值
+ * 同时报告进程CPU时间、CPU周期数和堆分配次数，多线程用例的周期数只包括调用线程和之后创建的线程
+ * 每个用例输出一行JSON，可以直接和另一个提交的结果逐行比较
+ */
+
+// 统计堆分配的次数和字节数，替换malloc、calloc和realloc，转发给glibc的实现
+// operator new和C函数内部的分配都经过这里，用例的allocs_per_op为0表示这条路径上没有任何堆分配
+static atomic<long long> alloc_count(0);
+static atomic<long long> alloc_bytes(0);
+
+extern "C" {
+
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t count, size_t size);
+void* __libc_realloc(void* p, size_t size);
+
+void* malloc(size_t size) {
+    alloc_count.fetch_add(1, memory_order_relaxed);
+    alloc_bytes.fetch_add(size, memory_order_relaxed);
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t count, size_t size) {
+    alloc_count.fetch_add(1, memory_order_relaxed);
+    alloc_bytes.fetch_add(count * size, memory_order_relaxed);
+    return __libc_calloc(count, size);
+}
+
+void* realloc(void* p, size_t size) {
+    alloc_count.fetch_add(1, memory_order_relaxed);
+    alloc_bytes.fetch_add(size, memory_order_relaxed);
+    return __libc_realloc(p, size);
+}
+
+}
+
+static long long clock_ns(clockid_t clock) {
+    struct timespec t;
+    clock_gettime(clock, &t);
+    return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+/**
+ * @brief CPU周期计数
+ * 优先使用perf_event的硬件周期计数，不可用时退回到时间戳计数器，都没有时返回-1
+ */
+class CycleCounter {
+public:
+    CycleCounter() : fd_(-1), start_(0) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = PERF_COUNT_HW_CPU_CYCLES;
+        attr.disabled = 1;
+        attr.inherit = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fd_ = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+
+    ~CycleCounter() {
+        if (fd_ != -1)
+            close(fd_);
+    }
+
+    const char* source() const {
+        if (fd_ != -1)
+            return "perf";
+#if defined(__x86_64__) || defined(__i386__)
+        return "tsc";
+#else
+        return "none";
+#endif
+    }
+
+    void start() {
+        if (fd_ != -1) {
+            ioctl(fd_, PERF_EVENT_IOC_RESET, 0);
+            ioctl(fd_, PERF_EVENT_IOC_ENABLE, 0);
+            return;
+        }
+#if defined(__x86_64__) || defined(__i386__)
+        start_ = __rdtsc();
+#endif
+    }
+
+    long long stop() {
+        if (fd_ != -1) {
+            ioctl(fd_, PERF_EVENT_IOC_DISABLE, 0);
+            long long count = 0;
+            if (read(fd_, &count, sizeof(count)) != sizeof(count))
+                return -1;
+            return count;
+        }
+#if defined(__x86_64__) || defined(__i386__)
+        return __rdtsc() - start_;
+#else
+        return -1;
+#endif
+    }
+
+private:
+    int fd_;
+    unsigned long long start_;
+};
+
+struct BenchOptions {
+    const char* filter = "";        // 只运行名字包含该子串的用例
+    int reps = 5;
+};
+
+static BenchOptions options;
+
+/**
+ * @brief 运行一个用例
+ * setup在每次重复前调用，不计时；body执行ops次操作
+ * @return 计时的几轮中堆分配的总次数，用例被过滤掉时返回0
+ */
+static long long measure(const char* name, const string& params, int threads, long long ops,
+    const function<void()>& setup, const function<void(long long)>& body) {
+    if (strstr(name, options.filter) == nullptr)
+        return 0;
+
+    // 预热，让缓存、分支预测和内存分配器进入稳定状态
+    if (setup)
+        setup();
+    body(ops);
+
+    CycleCounter counter;
+    vector<double> ns(options.reps);
+    long long cpu_ns = 0;
+    long long cycles = 0;
+    long long allocs = 0;
+    long long bytes = 0;
+    for (int i = 0; i < options.reps; i++) {
+        if (setup)
+            setup();
+        long long alloc_start = alloc_count.load();
+        long long bytes_start = alloc_bytes.load();
+        long long cpu_start = clock_ns(CLOCK_PROCESS_CPUTIME_ID);
+        long long start = clock_ns(CLOCK_MONOTONIC);
+        counter.start();
+        body(ops);
+        long long cycle = counter.stop();
+        long long end = clock_ns(CLOCK_MONOTONIC);
+        cpu_ns += clock_ns(CLOCK_PROCESS_CPUTIME_ID) - cpu_start;
+        allocs += alloc_count.load() - alloc_start;
+        bytes += alloc_bytes.load() - bytes_start;
+        cycles = cycle < 0 || cycles < 0 ? -1 : cycles + cycle;
+        ns[i] = (double) (end - start) / ops;
+    }
+    sort(ns.begin(), ns.end());
+
+    double total = (double) ops * options.reps;
+    printf("{\"name\":\"%s\",\"params\":%s,\"threads\":%d,\"reps\":%d,\"ops\":%lld,"
+        "\"ns_per_op\":{\"median\":%.2f,\"min\":%.2f,\"max\":%.2f},\"cpu_ns_per_op\":%.2f,"
+        "\"cycles_per_op\":%.2f,\"cycle_source\":\"%s\",\"allocs_per_op\":%.3f,\"alloc_bytes_per_op\":%.1f}\n",
+        name, params.c_str(), threads, options.reps, ops,
+        ns[ns.size() / 2], ns.front(), ns.back(), cpu_ns / total,
+        cycles < 0 ? -1.0 : cycles / total, counter.source(), allocs / total, bytes / total);
+    fflush(stdout);
+    return allocs;
+}
+
+// 要求用例全程没有堆分配，否则终止，避免回归只体现在输出的数字里
+static void expect_no_alloc(const char* name, long long allocs) {
+    if (allocs != 0) {
+        fprintf(stderr, "%s: %lld heap allocations, expected 0\n", name, allocs);
+        abort();
+    }
+}
+
+static string param(const char* key, long long value) {
+    return string("{\"") + key + "\":" + to_string(value) + "}";
+}
+
+static string param(const char* key1, long long value1, const char* key2, long long value2) {
+    return string("{\"") + key1 + "\":" + to_string(value1) + ",\"" + key2 + "\":" + to_string(value2) + "}";
+}
+
+static void empty_callback(ClientData*) { }
+
+// 服务端的用法：新连接在链表尾部加入，收到数据时延后超时，超时后由tick批量删除
+static void bench_timer() {
+    for (int n : { 1000, 10000 }) {
+        TimerList* list = nullptr;
+        vector<TimerUtil*> timers;
+        ClientData data;
+        uint64_t seed = 12345;
+        time_t base = time(nullptr) + 3600;
+
+        auto fill = [&](time_t expire_base) {
+            delete list;
+            list = new TimerList();
+            timers.clear();
+            for (int i = 0; i < n; i++) {
+                TimerUtil* timer = new TimerUtil();
+                timer->expire = expire_base + i / 100;
+                timer->callback = empty_callback;
+                timer->user_data = &data;
+                list->add_timer(timer);
+                timers.push_back(timer);
+            }
+        };
+
+        measure("timer.add", param("timers", n), 1, n,
+            [&] { delete list; list = new TimerList(); },
+            [&](long long ops) {
+                for (long long i = 0; i < ops; i++) {
+                    TimerUtil* timer = new TimerUtil();
+                    timer->expire = base + i / 100;
+                    timer->callback = empty_callback;
+                    timer->user_data = &data;
+                    list->add_timer(timer);
+                }
+            });
+
+        // 随机挑一个连接延后到最晚，和delay_timer一样需要从原位置向后遍历
+        measure("timer.modify", param("timers", n), 1, 10000,
+            [&] { fill(base); },
+            [&](long long ops) {
+                time_t latest = base + n;
+                for (long long i = 0; i < ops; i++) {
+                    seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+                    TimerUtil* timer = timers[(seed >> 33) % n];
+                    timer->expire = ++latest;
+                    list->modify_timer(timer);
+                }
+            });
+
+        measure("timer.tick", param("timers", n), 1, n,
+            [&] { fill(time(nullptr) - 3600); },
+            [&](long long) { list->tick(); });
+
+        delete list;
+    }
+}
+
+static void bench_blocking_queue() {
+    BlockingQueue<long long> single(1000);
+    measure("blocking_queue.push_pop", param("producers", 1, "consumers", 0), 1, 1000000, nullptr,
+        [&](long long ops) {
+            long long value;
+            for (long long i = 0; i < ops; i++) {
+                single.push(i);
+                single.pop(value);
+            }
+        });
+
+    // 多个生产者和消费者，队列满时生产者让出CPU后重试
+    for (int threads : { 1, 2, 4 }) {
+        BlockingQueue<long long> queue(1000);
+        measure("blocking_queue.mpmc", param("producers", threads, "consumers", threads), threads * 2, 400000, nullptr,
+            [&](long long ops) {
+                long long per_thread = ops / threads;
+                vector<thread> workers;
+                for (int t = 0; t < threads; t++) {
+                    workers.emplace_back([&, t] {
+                        for (long long i = 0; i < per_thread; i++) {
+                            while (!queue.push(i))
+                                sched_yield();
+                        }
+                    });
+                    workers.emplace_back([&] {
+                        long long value;
+                        for (long long i = 0; i < per_thread; i++)
+                            queue.pop(value);
+                    });
+                }
+                for (thread& worker : workers)
+                    worker.join();
+            });
+    }
+}
+
+// 线程池只调用请求的这几个成员
+struct FakeRequest {
+    template <typename Trigger>
+    void process() {
+        done->fetch_add(1, memory_order_relaxed);
+    }
+    template <typename Trigger>
+    bool read_once() {
+        return true;
+    }
+    template <typename Trigger>
+    bool write() {
+        return true;
+    }
+    template <typename Trigger>
+    void expire() { }
+    uint32_t get_generation() const {
+        return 0;
+    }
+    void pin() { }
+    void unpin() { }
+
+    bool state_ = false;
+    bool improve_ = false;
+    bool timer_flag_ = false;
+    atomic<long long>* done = nullptr;
+};
+
+// 主线程逐个放入请求，等工作线程全部处理完，测的是入队、信号量唤醒和出队的开销
+static void bench_thread_pool() {
+    for (int threads : { 1, 4, 8 }) {
+        // 线程池的线程是分离的，不会退出，每种线程数只创建一次
+        ThreadPool<FakeRequest>* pool = new ThreadPool<FakeRequest>(nullptr, threads, 100000);
+        pool->start<LevelTrigger, Proactor>();
+        atomic<long long> done(0);
+        vector<FakeRequest> requests(1024);
+        for (FakeRequest& request : requests)
+            request.done = &done;
+
+        measure("thread_pool.append", param("threads", threads), threads + 1, 200000,
+            [&] { done.store(0); },
+            [&](long long ops) {
+                for (long long i = 0; i < ops; i++) {
+                    while (!pool->append(&requests[i % requests.size()]))
+                        sched_yield();
+                }
+                while (done.load(memory_order_relaxed) < ops)
+                    sched_yield();
+            });
+    }
+}
+
+/**
+ * @brief 改造前的异步日志写法，作为log.write_log.async的对照
+ * 每行加锁格式化到共享缓冲区，复制成string放入阻塞队列，写线程取出后加锁fputs，LOG_*宏每行之后再加锁fflush
+ */
+class LockedLog {
+public:
+    explicit LockedLog(const char* path) : fp_(fopen(path, "a")), count_(0), queue_(800000) {
+        writer_ = thread([this] {
+            string line;
+            while (queue_.pop(line) && !line.empty()) {
+                mutex_.lock();
+                fputs(line.c_str(), fp_);
+                mutex_.unlock();
+            }
+        });
+    }
+
+    ~LockedLog() {
+        // 空行通知写线程退出，日志行至少有一个换行符
+        while (!queue_.push(string()))
+            sched_yield();
+        writer_.join();
+        fclose(fp_);
+    }
+
+    void write(const char* format, ...) {
+        struct timeval now = { 0, 0 };
+        gettimeofday(&now, nullptr);
+        struct tm tm;
+        localtime_r(&now.tv_sec, &tm);
+
+        // 原来在这里判断是否需要按日期和行数切换文件
+        mutex_.lock();
+        count_++;
+        mutex_.unlock();
+
+        va_list args;
+        va_start(args, format);
+        mutex_.lock();
+        int n = snprintf(buf_, 48, "%d-%02d-%02d %02d:%02d:%02d.%06ld %s ", tm.tm_year + 1900, tm.tm_mon + 1,
+            tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec, (long) now.tv_usec, "[info]:");
+        int m = min(vsnprintf(buf_ + n, sizeof(buf_) - n - 1, format, args), (int) sizeof(buf_) - n - 2);
+        buf_[n + m] = '\n';
+        buf_[n + m + 1] = '\0';
+        string line = buf_;
+        mutex_.unlock();
+        va_end(args);
+
+        // 队列满时退化为同步写
+        if (!queue_.push(line)) {
+            mutex_.lock();
+            fputs(line.c_str(), fp_);
+            mutex_.unlock();
+        }
+        mutex_.lock();
+        fflush(fp_);
+        mutex_.unlock();
+    }
+
+private:
+    FILE* fp_;
+    long long count_;
+    char buf_[2000];
+    Mutex mutex_;
+    BlockingQueue<string> queue_;
+    thread writer_;
+};
+
+// 写日志的调用线程开销，包括没有打开的级别，并和改造前的加锁写法对照
+static void bench_log(const char* dir) {
+    measure("log.write_log.filtered", param("threads", 1), 1, 1000000, nullptr,
+        [](long long ops) {
+            for (long long i = 0; i < ops; i++)
+                LOG_DEBUG("Process read: %s.", "GET /index.html HTTP/1.1");
+        });
+
+    LockedLog locked((string(dir) + "/LockedLog").c_str());
+    for (int threads : { 1, 8, 32 }) {
+        measure("log.write_log.async", param("threads", threads), threads, 400000, nullptr,
+            [threads](long long ops) {
+                long long per_thread = ops / threads;
+                vector<thread> workers;
+                for (int t = 0; t < threads; t++) {
+                    workers.emplace_back([per_thread] {
+                        for (long long i = 0; i < per_thread; i++)
+                            LOG_INFO("Deal with the client(%s) request %lld, status %d.", "192.168.100.200", i, 200);
+                    });
+                }
+                for (thread& worker : workers)
+                    worker.join();
+            });
+
+        measure("log.write_log.locked", param("threads", threads), threads, 400000, nullptr,
+            [threads, &locked](long long ops) {
+                long long per_thread = ops / threads;
+                vector<thread> workers;
+                for (int t = 0; t < threads; t++) {
+                    workers.emplace_back([per_thread, &locked] {
+                        for (long long i = 0; i < per_thread; i++)
+                            locked.write("Deal with the client(%s) request %lld, status %d.", "192.168.100.200", i, 200);
+                    });
+                }
+                for (thread& worker : workers)
+                    worker.join();
+            });
+    }
+}
+
+// 每次操作是一个新IP的连接：接受连接、处理一个请求、关闭连接，100万个IP远超跟踪容量，几乎每次都要淘汰
+// 时钟每次操作前进1us，令牌桶按模拟时间补充
+static void bench_rate_limiter() {
+    RateLimiter* limiter = RateLimiter::get_instance();
+    limiter->init(100, 64);
+    for (int threads : { 1, 4 }) {
+        measure("rate_limiter.million_sources", param("threads", threads), threads, 1000000, nullptr,
+            [&](long long ops) {
+                long long per_thread = ops / threads;
+                vector<thread> workers;
+                for (int t = 0; t < threads; t++) {
+                    workers.emplace_back([&, t] {
+                        for (long long i = 0; i < per_thread; i++) {
+                            uint32_t addr = htonl(0x0A000000 + t * per_thread + i);
+                            if (limiter->acquire(addr, i) == RateLimiter::ALLOW) {
+                                limiter->admit(addr, false, i);
+                                limiter->release(addr);
+                            }
+                        }
+                    });
+                }
+                for (thread& worker : workers)
+                    worker.join();
+            });
+    }
+
+    // 同一个IP的长连接上连续请求，条目一直在访问链表头部
+    uint32_t addr = htonl(0x7F000001);
+    measure("rate_limiter.admit_hot", param("threads", 1), 1, 1000000, nullptr,
+        [&](long long ops) {
+            for (long long i = 0; i < ops; i++)
+                limiter->admit(addr, false, i * 1000);
+        });
+
+    // 关闭限流，后面的HttpConn用例不受影响
+    limiter->init(0, 0);
+}
+
+/**
+ * @brief 直接调用HttpConn的私有解析和响应生成函数
+ * 读缓冲区由用例填入，不经过套接字
+ */
+struct HttpConnBench {
+    static constexpr char REQUEST[] =
+        "GET /index.html HTTP/1.1\r\n"
+        "Host: 127.0.0.1:81\r\n"
+        "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/120.0 Safari/537.36\r\n"
+        "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+        "Accept-Encoding: gzip, deflate, br\r\n"
+        "Accept-Language: zh-CN,zh;q=0.9,en;q=0.8\r\n"
+        "Cache-Control: max-age=0\r\n"
+        "Connection: keep-alive\r\n"
+        "\r\n";
+
+    static void load(HttpConn* conn) {
+        conn->init();
+        // 上一次的协程帧已经销毁
+        conn->arena_.reset();
+        memcpy(conn->read_buf_, REQUEST, sizeof(REQUEST) - 1);
+        conn->read_idx_ = sizeof(REQUEST) - 1;
+    }
+
+    static int parse_lines(HttpConn* conn) {
+        int lines = 0;
+        while (conn->parse_line() == HttpConn::LINE_STATE_OK) {
+            conn->start_line_ = conn->checked_idx_;
+            lines++;
+        }
+        return lines;
+    }
+
+    static constexpr char LOGIN[] =
+        "POST /2CGISQL.cgi HTTP/1.1\r\n"
+        "Host: 127.0.0.1:81\r\n"
+        "Content-Type: application/x-www-form-urlencoded\r\n"
+        "Content-Length: 25\r\n"
+        "Connection: keep-alive\r\n"
+        "\r\n"
+        "user=bench&password=bench";
+
+    static Task<> drive(HttpConn* conn, HttpConn::HttpCode* ret) {
+        *ret = co_await conn->process_read();
+    }
+
+    // 一个完整的请求：启动处理协程、把响应写到socketpair再读掉，和工作线程处理长连接上的一个请求相同
+    static void serve(HttpConn* conn, int peer, const char* request, int len) {
+        conn->init();
+        memcpy(conn->read_buf_, request, len);
+        conn->read_idx_ = len;
+        conn->process<LevelTrigger>();
+        if (conn->status_ != 200 || !conn->write<LevelTrigger>())
+            abort();
+        char buf[8192];
+        while (recv(peer, buf, sizeof(buf), MSG_DONTWAIT) > 0) { }
+    }
+
+    static void run(const char* root_dir) {
+        HttpConn* conn = new HttpConn();
+        int fds[2];
+        socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+        conn->init(fds[0], sockaddr_in(), root_dir, false, false, "", "", "");
+
+        measure("http.parse_line", param("request_bytes", sizeof(REQUEST) - 1), 1, 500000, nullptr,
+            [conn](long long ops) {
+                for (long long i = 0; i < ops; i++) {
+                    load(conn);
+                    if (parse_lines(conn) != 9)
+                        abort();
+                }
+            });
+
+        // 完整解析一个GET请求，包括stat和mmap请求的文件
+        measure("http.process_read", param("request_bytes", sizeof(REQUEST) - 1), 1, 200000, nullptr,
+            [conn](long long ops) {
+                for (long long i = 0; i < ops; i++) {
+                    load(conn);
+                    HttpConn::HttpCode ret = HttpConn::NO_REQUEST;
+                    Task<> task = drive(conn, &ret);
+                    task.resume();
+                    if (ret != HttpConn::FILE_REQUEST)
+                        abort();
+                    conn->unmap();
+                }
+            });
+
+        // 静态文件和缓存命中的登录，allocs_per_op必须为0
+        expect_no_alloc("http.request_static",
+            measure("http.request_static", param("request_bytes", sizeof(REQUEST) - 1), 1, 20000, nullptr,
+                [conn, fds](long long ops) {
+                    for (long long i = 0; i < ops; i++)
+                        serve(conn, fds[1], REQUEST, sizeof(REQUEST) - 1);
+                }));
+
+        UserCache::get_instance()->init(1 << 10, 4);
+        UserCache::get_instance()->insert("bench", "bench");
+        expect_no_alloc("http.request_login",
+            measure("http.request_login", param("request_bytes", sizeof(LOGIN) - 1), 1, 20000, nullptr,
+                [conn, fds](long long ops) {
+                    for (long long i = 0; i < ops; i++)
+                        serve(conn, fds[1], LOGIN, sizeof(LOGIN) - 1);
+                }));
+
+        measure("http.add_response", param("header_lines", 4), 1, 1000000, nullptr,
+            [conn](long long ops) {
+                for (long long i = 0; i < ops; i++) {
+                    conn->write_idx_ = 0;
+                    conn->linger_ = true;
+                    conn->add_status_line(200, "OK");
+                    conn->add_headers(4096);
+                }
+            });
+
+        conn->close_conn();
+        close(fds[1]);
+        delete conn;
+    }
+};
+
+static void usage(const char* name) {
+    fprintf(stderr, "usage: %s [-f filter] [-r reps]\n", name);
+}
+
+int main(int argc, char* argv[]) {
+    int opt = 0;
+    while ((opt = getopt(argc, argv, "f:r:")) != -1) {
+        if (opt == 'f') options.filter = optarg;
+        else if (opt == 'r') options.reps = max(1, atoi(optarg));
+        else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    // 日志和静态文件放在临时目录，结束后删除
+    char dir[] = "/tmp/microbench.XXXXXX";
+    if (mkdtemp(dir) == nullptr) {
+        STDERR_FUNC_LINE();
+        return 1;
+    }
+    string root_dir = string(dir) + "/root";
+    mkdir(root_dir.c_str(), 0755);
+    ofstream(root_dir + "/index.html") << string(4096, 'x');
+    ofstream(root_dir + "/welcome.html") << string(4096, 'x');
+    Log::get_instance()->init((string(dir) + "/ServerLog").c_str(), false, 2000, 800000, true);
+
+    bench_timer();
+    bench_blocking_queue();
+    bench_thread_pool();
+    bench_log(dir);
+    bench_rate_limiter();
+    HttpConnBench::run(root_dir.c_str());
+
+    filesystem::remove_all(dir);
+    return 0;
+}
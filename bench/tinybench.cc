@@ -0,0 +1,533 @@
+#include "pch.h"
+#include "bench_util.h"
+#include <deque>
+#include <netinet/tcp.h>
+
+using namespace std;
+
+/**
+ * tinybench：HTTP/1.1压测工具
+ * 每个线程一个epoll，负责一部分连接
+ * 闭环模式下每个连接收到响应后立即发下一个请求，延迟从实际发送时刻算起
+ * 开环模式下按固定速率产生请求，延迟从计划发送时刻算起，服务端变慢时排队时间也计入延迟，不会低估尾延迟
+ * 结果以JSON输出到stdout，方便和基线比较
+ */
+
+// 请求类型
+enum RequestKind {
+    REQ_GET = 0,
+    REQ_LOGIN,
+    REQ_REGISTER,
+    REQ_KINDS
+};
+
+struct Options {
+    const char* host = "127.0.0.1";
+    int port = 81;
+    int threads = 4;
+    int connections = 64;
+    int duration = 10;              // 计时时长，单位s
+    int warm_up = 2;                // 预热时长，不计入结果，单位s
+    long long rate = 0;             // 开环模式的总请求速率，0为闭环模式
+    bool keep_alive = true;
+    int pipeline = 1;               // 每个连接同时在途的请求数
+    int weights[REQ_KINDS] = { 100, 0, 0 };
+    vector<string> files = { "judge.html", "log.html", "register.html", "welcome.html", "picture.html" };
+    int users = 1000;               // 登录请求使用的用户数，开始前预先注册，0表示每次使用未注册的新用户名
+    int timeout = 2000;             // 单个请求超时，超时后重连，单位ms
+};
+
+static Options options;
+
+// 单个线程的统计，结束后合并
+struct Stats {
+    LatencyHistogram latency;
+    long long requests = 0;
+    long long bytes = 0;
+    long long status[6] = { 0 };    // 按状态码首位计数，0表示无法解析
+    long long kinds[REQ_KINDS] = { 0 };
+    long long connects = 0;
+    long long errors = 0;           // 连接失败、被重置或者响应格式错误
+    long long timeouts = 0;
+
+    void merge(const Stats& other) {
+        latency.merge(other.latency);
+        requests += other.requests;
+        bytes += other.bytes;
+        for (int i = 0; i < 6; i++)
+            status[i] += other.status[i];
+        for (int i = 0; i < REQ_KINDS; i++)
+            kinds[i] += other.kinds[i];
+        connects += other.connects;
+        errors += other.errors;
+        timeouts += other.timeouts;
+    }
+};
+
+// 一个在途请求
+struct InFlight {
+    long long start;                // 计算延迟的起点，开环模式下为计划发送时刻
+    long long sent;                 // 实际发送时刻，用于判断超时
+    int kind;
+};
+
+struct Conn {
+    int fd = -1;
+    bool connected = false;
+    string out;                     // 待发送的请求
+    size_t out_pos = 0;
+    string in;                      // 已接收、还没解析完的响应
+    deque<InFlight> inflight;
+    bool want_write = false;
+};
+
+class Worker {
+public:
+    Worker(int id, int connections, long long rate)
+        : id_(id), conns_(connections), interval_(rate > 0 ? 1000000000LL / rate : 0),
+        next_due_(0), next_conn_(0), seed_(0x9E3779B97F4A7C15ULL * (id + 1)), counter_(0) { }
+
+    static void* run_thread(void* arg) {
+        ((Worker*) arg)->run();
+        return nullptr;
+    }
+
+    const Stats& stats() const {
+        return stats_;
+    }
+
+    long long warm_up_end_ = 0;
+    long long end_ = 0;
+
+private:
+    void run();
+    void open_conn(Conn* c);
+    void close_conn(Conn* c, bool error);
+    void fill(Conn* c, long long now);
+    void send_request(Conn* c, long long start, long long now);
+    void flush(Conn* c);
+    void on_readable(Conn* c, long long now);
+    void dispatch(long long now);
+    void check_timeouts(long long now);
+    void build_request(string* out, int kind);
+    int pick_kind();
+    uint64_t next_random() {
+        seed_ ^= seed_ << 13;
+        seed_ ^= seed_ >> 7;
+        seed_ ^= seed_ << 17;
+        return seed_;
+    }
+
+    int id_;
+    int epollfd_;
+    sockaddr_in addr_;
+    vector<Conn> conns_;
+    long long interval_;            // 开环模式下两个请求之间的间隔，单位ns
+    long long next_due_;            // 下一个请求的计划发送时刻
+    deque<InFlight> backlog_;       // 开环模式下已到时间但没有空闲连接的请求
+    size_t next_conn_;
+    uint64_t seed_;
+    long long counter_;
+    Stats stats_;
+};
+
+int Worker::pick_kind() {
+    int total = options.weights[REQ_GET] + options.weights[REQ_LOGIN] + options.weights[REQ_REGISTER];
+    int r = next_random() % total;
+    for (int i = 0; i < REQ_KINDS; i++) {
+        if (r < options.weights[i])
+            return i;
+        r -= options.weights[i];
+    }
+    return REQ_GET;
+}
+
+void Worker::build_request(string* out, int kind) {
+    const char* connection = options.keep_alive ? "keep-alive" : "close";
+    char buf[512];
+    if (kind == REQ_GET) {
+        const string& file = options.files[next_random() % options.files.size()];
+        snprintf(buf, sizeof(buf), "GET /%s HTTP/1.1\r\nHost: %s\r\nConnection: %s\r\n\r\n",
+            file.c_str(), options.host, connection);
+        out->append(buf);
+        return;
+    }
+
+    // 登录使用预先注册的用户，注册每次使用新用户名
+    // 不预先注册时登录也使用新用户名，每次都越过用户缓存查询存储后端
+    char body[128];
+    const char* url;
+    if (kind == REQ_LOGIN && options.users == 0) {
+        snprintf(body, sizeof(body), "user=tl%d_%d_%lld&password=bench", (int) getpid(), id_, counter_++);
+        url = "/2CGISQL.cgi";
+    } else if (kind == REQ_LOGIN) {
+        int user = next_random() % options.users;
+        snprintf(body, sizeof(body), "user=bench%d&password=bench%d", user, user);
+        url = "/2CGISQL.cgi";
+    } else {
+        snprintf(body, sizeof(body), "user=tb%d_%d_%lld&password=bench", (int) getpid(), id_, counter_++);
+        url = "/3CGISQL.cgi";
+    }
+    snprintf(buf, sizeof(buf), "POST %s HTTP/1.1\r\nHost: %s\r\nConnection: %s\r\nContent-Length: %d\r\n\r\n%s",
+        url, options.host, connection, (int) strlen(body), body);
+    out->append(buf);
+}
+
+void Worker::open_conn(Conn* c) {
+    c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (c->fd == -1) {
+        stats_.errors++;
+        return;
+    }
+    int flag = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+    c->connected = false;
+    c->want_write = true;
+    stats_.connects++;
+    if (connect(c->fd, (sockaddr*) &addr_, sizeof(addr_)) == -1 && errno != EINPROGRESS) {
+        close(c->fd);
+        c->fd = -1;
+        stats_.errors++;
+        return;
+    }
+    epoll_event event;
+    event.data.ptr = c;
+    event.events = EPOLLIN | EPOLLOUT;
+    epoll_ctl(epollfd_, EPOLL_CTL_ADD, c->fd, &event);
+}
+
+// 关闭连接，在途请求作废，开环模式下重新排队
+void Worker::close_conn(Conn* c, bool error) {
+    if (c->fd != -1) {
+        epoll_ctl(epollfd_, EPOLL_CTL_DEL, c->fd, nullptr);
+        close(c->fd);
+        c->fd = -1;
+    }
+    if (error)
+        stats_.errors += max((size_t) 1, c->inflight.size());
+    c->connected = false;
+    c->out.clear();
+    c->out_pos = 0;
+    c->in.clear();
+    c->inflight.clear();
+}
+
+void Worker::send_request(Conn* c, long long start, long long now) {
+    int kind = pick_kind();
+    build_request(&c->out, kind);
+    c->inflight.push_back(InFlight{ start, now, kind });
+}
+
+// 补满连接的在途请求，开环模式下只从积压队列中取
+void Worker::fill(Conn* c, long long now) {
+    if (!c->connected)
+        return;
+    while ((int) c->inflight.size() < options.pipeline) {
+        if (interval_ > 0) {
+            if (backlog_.empty())
+                break;
+            send_request(c, backlog_.front().start, now);
+            backlog_.pop_front();
+        } else {
+            send_request(c, now, now);
+        }
+    }
+    flush(c);
+}
+
+void Worker::flush(Conn* c) {
+    while (c->out_pos < c->out.size()) {
+        ssize_t n = send(c->fd, c->out.data() + c->out_pos, c->out.size() - c->out_pos, MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno == EAGAIN)
+                break;
+            close_conn(c, true);
+            return;
+        }
+        c->out_pos += n;
+    }
+    if (c->out_pos == c->out.size()) {
+        c->out.clear();
+        c->out_pos = 0;
+    }
+    // 发不完时才关注写事件
+    bool want_write = !c->out.empty();
+    if (want_write != c->want_write) {
+        c->want_write = want_write;
+        epoll_event event;
+        event.data.ptr = c;
+        event.events = EPOLLIN | (want_write ? (uint32_t) EPOLLOUT : 0);
+        epoll_ctl(epollfd_, EPOLL_CTL_MOD, c->fd, &event);
+    }
+}
+
+void Worker::on_readable(Conn* c, long long now) {
+    char buf[65536];
+    bool eof = false;
+    while (true) {
+        ssize_t n = recv(c->fd, buf, sizeof(buf), 0);
+        if (n > 0) {
+            c->in.append(buf, n);
+            continue;
+        }
+        if (n == 0)
+            eof = true;
+        else if (errno != EAGAIN)
+            eof = true;
+        break;
+    }
+
+    // 一次可能收到多个流水线响应
+    size_t pos = 0;
+    while (!c->inflight.empty()) {
+        int status = 0;
+        long long length = parse_response(string_view(c->in).substr(pos), eof, &status);
+        if (length <= 0) {
+            if (length < 0) {
+                close_conn(c, true);
+                return;
+            }
+            break;
+        }
+        pos += length;
+        InFlight request = c->inflight.front();
+        c->inflight.pop_front();
+        if (now >= warm_up_end_) {
+            stats_.latency.record(now - request.start);
+            stats_.requests++;
+            stats_.bytes += length;
+            stats_.status[status >= 100 && status < 600 ? status / 100 : 0]++;
+            stats_.kinds[request.kind]++;
+        }
+    }
+    c->in.erase(0, pos);
+
+    // 服务端关闭连接，或者短连接收完一个响应，重新连接
+    if (eof || (!options.keep_alive && c->inflight.empty())) {
+        close_conn(c, eof && !c->inflight.empty());
+        open_conn(c);
+        return;
+    }
+    fill(c, now);
+}
+
+void Worker::dispatch(long long now) {
+    while (next_due_ <= now) {
+        backlog_.push_back(InFlight{ next_due_, 0, REQ_GET });
+        next_due_ += interval_;
+    }
+    // 轮流分给有空位的连接
+    for (size_t i = 0; i < conns_.size() && !backlog_.empty(); i++) {
+        Conn* c = &conns_[(next_conn_ + i) % conns_.size()];
+        if (c->connected && (int) c->inflight.size() < options.pipeline)
+            fill(c, now);
+    }
+    next_conn_++;
+}
+
+void Worker::check_timeouts(long long now) {
+    for (Conn& c : conns_) {
+        // 开环模式下计划时刻可能早于发送时刻，超时按实际发送时刻计算
+        bool expired = !c.inflight.empty() && now - c.inflight.front().sent > options.timeout * 1000000LL;
+        if (expired) {
+            stats_.timeouts += c.inflight.size();
+            close_conn(&c, false);
+            open_conn(&c);
+        } else if (c.fd == -1) {
+            open_conn(&c);
+        }
+    }
+}
+
+void Worker::run() {
+    epollfd_ = epoll_create(5);
+    bzero(&addr_, sizeof(addr_));
+    addr_.sin_family = AF_INET;
+    addr_.sin_port = htons(options.port);
+    inet_pton(AF_INET, options.host, &addr_.sin_addr);
+
+    for (Conn& c : conns_)
+        open_conn(&c);
+
+    long long start = now_ns();
+    next_due_ = start;
+    long long last_check = start;
+    vector<epoll_event> events(conns_.size() + 1);
+    while (true) {
+        long long now = now_ns();
+        if (now >= end_)
+            break;
+        if (interval_ > 0)
+            dispatch(now);
+
+        int wait = 10;
+        if (interval_ > 0)
+            wait = max(0LL, min(10LL, (next_due_ - now) / 1000000));
+        int n = epoll_wait(epollfd_, events.data(), events.size(), wait);
+        now = now_ns();
+        for (int i = 0; i < n; i++) {
+            Conn* c = (Conn*) events[i].data.ptr;
+            if (c->fd == -1)
+                continue;
+            if (!c->connected) {
+                // 可写或者出错说明连接已经有结果
+                if (!(events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+                    continue;
+                int err = 0;
+                socklen_t len = sizeof(err);
+                getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+                if (err != 0 || (events[i].events & (EPOLLERR | EPOLLHUP))) {
+                    close_conn(c, true);
+                    continue;
+                }
+                c->connected = true;
+                fill(c, now);
+                if (c->fd == -1)
+                    continue;
+            }
+            if (events[i].events & EPOLLOUT)
+                flush(c);
+            if (c->fd != -1 && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+                on_readable(c, now);
+        }
+
+        if (now - last_check >= 100000000LL) {
+            check_timeouts(now);
+            last_check = now;
+        }
+    }
+
+    for (Conn& c : conns_)
+        close_conn(&c, false);
+    close(epollfd_);
+}
+
+// 预先注册登录请求使用的用户，已存在的用户返回注册失败页面，可以忽略
+static bool register_users() {
+    sockaddr_in addr;
+    bzero(&addr, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(options.port);
+    inet_pton(AF_INET, options.host, &addr.sin_addr);
+
+    for (int i = 0; i < options.users; i++) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (connect(fd, (sockaddr*) &addr, sizeof(addr)) == -1) {
+            close(fd);
+            return false;
+        }
+        char body[128];
+        char request[512];
+        snprintf(body, sizeof(body), "user=bench%d&password=bench%d", i, i);
+        int len = snprintf(request, sizeof(request),
+            "POST /3CGISQL.cgi HTTP/1.1\r\nHost: %s\r\nConnection: close\r\nContent-Length: %d\r\n\r\n%s",
+            options.host, (int) strlen(body), body);
+        send(fd, request, len, MSG_NOSIGNAL);
+        // 读到服务端关闭连接为止
+        char buf[4096];
+        while (recv(fd, buf, sizeof(buf), 0) > 0) { }
+        close(fd);
+    }
+    return true;
+}
+
+static void split(const char* text, vector<string>* parts) {
+    parts->clear();
+    string item;
+    for (const char* p = text; ; p++) {
+        if (*p == ',' || *p == '\0') {
+            if (!item.empty())
+                parts->push_back(item);
+            item.clear();
+            if (*p == '\0')
+                break;
+        } else {
+            item += *p;
+        }
+    }
+}
+
+static void usage(const char* name) {
+    fprintf(stderr, "usage: %s [-a host] [-p port] [-t threads] [-c connections] [-d duration] [-w warm_up]"
+        " [-r rate] [-k keep_alive] [-P pipeline] [-m get,login,register] [-f file,...] [-u users] [-T timeout_ms]\n", name);
+}
+
+int main(int argc, char* argv[]) {
+    int opt = 0;
+    vector<string> parts;
+    while ((opt = getopt(argc, argv, "a:p:t:c:d:w:r:k:P:m:f:u:T:")) != -1) {
+        if (opt == 'a') options.host = optarg;
+        else if (opt == 'p') options.port = atoi(optarg);
+        else if (opt == 't') options.threads = max(1, atoi(optarg));
+        else if (opt == 'c') options.connections = max(1, atoi(optarg));
+        else if (opt == 'd') options.duration = max(1, atoi(optarg));
+        else if (opt == 'w') options.warm_up = max(0, atoi(optarg));
+        else if (opt == 'r') options.rate = atoll(optarg);
+        else if (opt == 'k') options.keep_alive = atoi(optarg);
+        else if (opt == 'P') options.pipeline = max(1, atoi(optarg));
+        else if (opt == 'm') {
+            split(optarg, &parts);
+            for (int i = 0; i < REQ_KINDS; i++)
+                options.weights[i] = i < (int) parts.size() ? max(0, atoi(parts[i].c_str())) : 0;
+        }
+        else if (opt == 'f') split(optarg, &options.files);
+        else if (opt == 'u') options.users = max(0, atoi(optarg));
+        else if (opt == 'T') options.timeout = max(1, atoi(optarg));
+        else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (options.weights[REQ_GET] + options.weights[REQ_LOGIN] + options.weights[REQ_REGISTER] == 0 || options.files.empty()) {
+        usage(argv[0]);
+        return 1;
+    }
+    // 短连接上不能流水线
+    if (!options.keep_alive)
+        options.pipeline = 1;
+    options.threads = min(options.threads, options.connections);
+    signal(SIGPIPE, SIG_IGN);
+
+    if (options.weights[REQ_LOGIN] > 0 && options.users > 0 && !register_users()) {
+        fprintf(stderr, "tinybench: cannot connect to %s:%d\n", options.host, options.port);
+        return 1;
+    }
+
+    vector<Worker*> workers;
+    vector<pthread_t> tids(options.threads);
+    long long start = now_ns();
+    for (int i = 0; i < options.threads; i++) {
+        int connections = options.connections / options.threads + (i < options.connections % options.threads);
+        Worker* worker = new Worker(i, connections, options.rate / options.threads);
+        worker->warm_up_end_ = start + options.warm_up * 1000000000LL;
+        worker->end_ = worker->warm_up_end_ + options.duration * 1000000000LL;
+        workers.push_back(worker);
+    }
+    for (int i = 0; i < options.threads; i++)
+        pthread_create(&tids[i], nullptr, Worker::run_thread, workers[i]);
+
+    Stats total;
+    for (int i = 0; i < options.threads; i++) {
+        pthread_join(tids[i], nullptr);
+        total.merge(workers[i]->stats());
+        delete workers[i];
+    }
+
+    const LatencyHistogram& latency = total.latency;
+    printf("{\"mode\":\"%s\",\"threads\":%d,\"connections\":%d,\"keep_alive\":%s,\"pipeline\":%d,"
+        "\"rate\":%lld,\"duration_s\":%d,\"warm_up_s\":%d,\"mix\":{\"get\":%d,\"login\":%d,\"register\":%d},\n",
+        options.rate > 0 ? "open" : "closed", options.threads, options.connections, options.keep_alive ? "true" : "false",
+        options.pipeline, options.rate, options.duration, options.warm_up,
+        options.weights[REQ_GET], options.weights[REQ_LOGIN], options.weights[REQ_REGISTER]);
+    printf(" \"requests\":%lld,\"throughput_rps\":%.1f,\"bytes\":%lld,\"connects\":%lld,\"errors\":%lld,\"timeouts\":%lld,\n",
+        total.requests, (double) total.requests / options.duration, total.bytes, total.connects, total.errors, total.timeouts);
+    printf(" \"requests_by_kind\":{\"get\":%lld,\"login\":%lld,\"register\":%lld},\n",
+        total.kinds[REQ_GET], total.kinds[REQ_LOGIN], total.kinds[REQ_REGISTER]);
+    printf(" \"status\":{\"1xx\":%lld,\"2xx\":%lld,\"3xx\":%lld,\"4xx\":%lld,\"5xx\":%lld,\"other\":%lld},\n",
+        total.status[1], total.status[2], total.status[3], total.status[4], total.status[5], total.status[0]);
+    printf(" \"latency_us\":{\"min\":%.1f,\"mean\":%.1f,\"p50\":%.1f,\"p90\":%.1f,\"p99\":%.1f,\"p999\":%.1f,\"max\":%.1f}}\n",
+        latency.min_value() / 1000.0, latency.mean() / 1000.0, latency.percentile(0.5) / 1000.0,
+        latency.percentile(0.9) / 1000.0, latency.percentile(0.99) / 1000.0, latency.percentile(0.999) / 1000.0,
+        latency.max_value() / 1000.0);
+    return 0;
+}
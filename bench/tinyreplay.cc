@@ -0,0 +1,531 @@
+#include "pch.h"
+#include "bench_util.h"
+#include "capture.h"
+#include <netinet/tcp.h>
+#include <queue>
+
+using namespace std;
+
+/**
+ * tinyreplay：回放服务端-x捕获的流量
+ * 捕获文件中的每个连接回放为一个连接，按原来的时间间隔建立连接、发送请求，保留请求头的组合、请求大小和长连接的使用方式
+ * 同一连接上的请求依次发送，收到上一个响应后才发下一个；-s为加速倍数，0表示不等待，收到响应立即发送下一个
+ * 延迟从计划发送时刻算起，服务端变慢导致请求推迟时推迟的时间也计入延迟；-s 0时从实际发送时刻算起
+ * 结果以JSON输出到stdout，格式和tinybench一致
+ */
+
+struct Options {
+    const char* host = "127.0.0.1";
+    int port = 81;
+    int threads = 4;
+    double speed = 1;               // 加速倍数，0表示不等待
+    int timeout = 2000;             // 单个请求超时，超时后跳过该请求并重连，单位ms
+    const char* file = "./Capture.bin";
+};
+
+static Options options;
+
+// 捕获中的一个请求，数据在Session::data中
+struct Request {
+    long long time_us;              // 相对于所在捕获段开始的时间
+    size_t offset;
+    size_t len;
+};
+
+// 捕获中的一个连接
+struct Session {
+    long long open_us;              // 相对于捕获开始的时间，多段捕获依次首尾相接
+    string data;                    // 这个连接上收到的全部请求字节
+    vector<Request> requests;
+    size_t next = 0;                // 下一个要发送的请求
+
+    int fd = -1;
+    bool connected = false;
+    bool done = false;
+    string out;
+    size_t out_pos = 0;
+    string in;
+    bool inflight = false;
+    long long start = 0;            // 计算延迟的起点
+    long long sent = 0;             // 实际发送时刻，用于判断超时
+};
+
+struct Stats {
+    LatencyHistogram latency;
+    long long requests = 0;
+    long long bytes = 0;
+    long long status[6] = { 0 };    // 按状态码首位计数，0表示无法解析
+    long long connects = 0;
+    long long errors = 0;           // 连接失败、被重置或者响应格式错误，跳过的请求数
+    long long timeouts = 0;
+    long long late_ns = 0;          // 实际发送时刻晚于计划时刻的累计时间，-s 0时不统计
+
+    void merge(const Stats& other) {
+        latency.merge(other.latency);
+        requests += other.requests;
+        bytes += other.bytes;
+        for (int i = 0; i < 6; i++)
+            status[i] += other.status[i];
+        connects += other.connects;
+        errors += other.errors;
+        timeouts += other.timeouts;
+        late_ns += other.late_ns;
+    }
+};
+
+// 从data的pos开始找一个完整的请求，返回请求长度，不完整返回0
+static size_t request_length(const string& data, size_t pos) {
+    size_t end = data.find("\r\n\r\n", pos);
+    if (end == string::npos)
+        return 0;
+    long long length = 0;
+    size_t line = data.find("\r\n", pos) + 2;
+    while (line < end) {
+        size_t line_end = data.find("\r\n", line);
+        if (strncasecmp(data.data() + line, "Content-Length:", 15) == 0)
+            length = strtoll(data.data() + line + 15, nullptr, 10);
+        line = line_end + 2;
+    }
+    size_t total = end + 4 + max(length, 0LL) - pos;
+    return pos + total <= data.size() ? total : 0;
+}
+
+struct CaptureFile {
+    vector<Session> sessions;
+    long long requests = 0;
+    long long bytes = 0;
+    long long span_us = 0;          // 最后一个请求的时间
+    long long empty = 0;            // 没有完整请求的连接
+    long long truncated = 0;        // 连接末尾不完整的请求
+};
+
+// 读取捕获文件，按连接把数据拼起来再切分成请求
+static bool load_capture(const char* path, CaptureFile* capture) {
+    FILE* fp = fopen(path, "rb");
+    if (fp == nullptr)
+        return false;
+
+    // 捕获段内的连接id -> sessions下标
+    unordered_map<uint64_t, size_t> index;
+    // 数据块的时间，切分请求时用请求第一个字节所在块的时间
+    vector<vector<pair<size_t, long long>>> chunks;
+    long long segment_base = 0;     // 当前捕获段在回放时间轴上的起点
+    long long segment_first = -1;   // 当前捕获段第一条记录的单调时钟
+    long long segment_last = 0;
+    bool ok = true;
+    vector<char> buf;
+    while (true) {
+        char magic[sizeof(Capture::MAGIC)];
+        size_t n = fread(magic, 1, sizeof(magic), fp);
+        if (n == 0)
+            break;
+        // 每次启动追加一个文件头，新的一段接在上一段之后
+        if (n == sizeof(magic) && memcmp(magic, Capture::MAGIC, sizeof(magic)) == 0) {
+            uint64_t start_us;
+            if (fread(&start_us, sizeof(start_us), 1, fp) != 1) {
+                ok = false;
+                break;
+            }
+            if (segment_first >= 0)
+                segment_base += segment_last - segment_first + 1000;
+            segment_first = -1;
+            index.clear();
+            continue;
+        }
+        Capture::RecordHeader header;
+        memcpy(&header, magic, n);
+        if (n != sizeof(magic) || fread((char*) &header + n, sizeof(header) - n, 1, fp) != 1) {
+            ok = false;
+            break;
+        }
+        buf.resize(header.len);
+        if (header.len > 0 && fread(buf.data(), header.len, 1, fp) != 1) {
+            ok = false;
+            break;
+        }
+        if (segment_first < 0)
+            segment_first = header.time_us;
+        segment_last = header.time_us;
+        long long time_us = segment_base + header.time_us - segment_first;
+
+        if (header.type == Capture::OPEN) {
+            index[header.conn] = capture->sessions.size();
+            capture->sessions.emplace_back();
+            capture->sessions.back().open_us = time_us;
+            chunks.emplace_back();
+            continue;
+        }
+        auto it = index.find(header.conn);
+        if (it == index.end())
+            continue;
+        if (header.type == Capture::DATA) {
+            Session& session = capture->sessions[it->second];
+            chunks[it->second].emplace_back(session.data.size(), time_us);
+            session.data.append(buf.data(), header.len);
+        } else {
+            index.erase(it);
+        }
+    }
+    fclose(fp);
+
+    for (size_t i = 0; i < capture->sessions.size(); i++) {
+        Session& session = capture->sessions[i];
+        size_t pos = 0;
+        size_t chunk = 0;
+        while (pos < session.data.size()) {
+            size_t len = request_length(session.data, pos);
+            if (len == 0) {
+                capture->truncated++;
+                break;
+            }
+            while (chunk + 1 < chunks[i].size() && chunks[i][chunk + 1].first <= pos)
+                chunk++;
+            session.requests.push_back(Request{ chunks[i][chunk].second, pos, len });
+            capture->requests++;
+            capture->bytes += len;
+            capture->span_us = max(capture->span_us, chunks[i][chunk].second);
+            pos += len;
+        }
+        if (session.requests.empty())
+            capture->empty++;
+    }
+    // 没有完整请求的连接不回放
+    vector<Session> sessions;
+    for (Session& session : capture->sessions) {
+        if (!session.requests.empty())
+            sessions.push_back(move(session));
+    }
+    capture->sessions.swap(sessions);
+    return ok;
+}
+
+class Worker {
+public:
+    explicit Worker(long long base) : base_(base), remaining_(0) { }
+
+    static void* run_thread(void* arg) {
+        ((Worker*) arg)->run();
+        return nullptr;
+    }
+
+    void add(Session* session) {
+        sessions_.push_back(session);
+    }
+
+    const Stats& stats() const {
+        return stats_;
+    }
+
+private:
+    // 等待中的会话，按时刻从早到晚
+    typedef pair<long long, Session*> Timer;
+
+    void run();
+    // 回放时间轴上time_us对应的时刻
+    long long due(long long time_us) const {
+        return options.speed > 0 ? base_ + (long long) (time_us * 1000 / options.speed) : base_;
+    }
+    void open_conn(Session* s);
+    void close_conn(Session* s);
+    // 当前请求失败，跳过它继续后面的请求
+    void skip(Session* s, long long now);
+    void finish(Session* s);
+    void try_send(Session* s, long long now);
+    void flush(Session* s);
+    void on_readable(Session* s, long long now);
+    void check_timeouts(long long now);
+
+    long long base_;
+    int epollfd_;
+    sockaddr_in addr_;
+    vector<Session*> sessions_;
+    priority_queue<Timer, vector<Timer>, greater<Timer>> timers_;
+    size_t remaining_;
+    Stats stats_;
+};
+
+void Worker::open_conn(Session* s) {
+    s->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (s->fd == -1) {
+        stats_.errors += s->requests.size() - s->next;
+        finish(s);
+        return;
+    }
+    int flag = 1;
+    setsockopt(s->fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+    s->connected = false;
+    stats_.connects++;
+    if (connect(s->fd, (sockaddr*) &addr_, sizeof(addr_)) == -1 && errno != EINPROGRESS) {
+        // 服务端不可达，剩下的请求都算失败
+        stats_.errors += s->requests.size() - s->next;
+        finish(s);
+        return;
+    }
+    epoll_event event;
+    event.data.ptr = s;
+    event.events = EPOLLIN | EPOLLOUT;
+    epoll_ctl(epollfd_, EPOLL_CTL_ADD, s->fd, &event);
+}
+
+void Worker::close_conn(Session* s) {
+    if (s->fd != -1) {
+        epoll_ctl(epollfd_, EPOLL_CTL_DEL, s->fd, nullptr);
+        close(s->fd);
+        s->fd = -1;
+    }
+    s->connected = false;
+    s->out.clear();
+    s->out_pos = 0;
+    s->in.clear();
+    s->inflight = false;
+}
+
+void Worker::finish(Session* s) {
+    close_conn(s);
+    if (!s->done) {
+        s->done = true;
+        remaining_--;
+    }
+}
+
+void Worker::skip(Session* s, long long now) {
+    close_conn(s);
+    s->next++;
+    if (s->next >= s->requests.size())
+        finish(s);
+    else
+        timers_.push(Timer{ now, s });
+}
+
+void Worker::try_send(Session* s, long long now) {
+    if (s->done || s->inflight)
+        return;
+    if (s->next >= s->requests.size()) {
+        finish(s);
+        return;
+    }
+    // 服务端关闭了连接，重新连接后继续
+    if (s->fd == -1) {
+        open_conn(s);
+        return;
+    }
+    if (!s->connected)
+        return;
+    const Request& request = s->requests[s->next];
+    long long when = due(request.time_us);
+    if (when > now) {
+        timers_.push(Timer{ when, s });
+        return;
+    }
+    s->out.append(s->data, request.offset, request.len);
+    s->inflight = true;
+    s->start = options.speed > 0 ? when : now;
+    s->sent = now;
+    if (options.speed > 0)
+        stats_.late_ns += now - when;
+    flush(s);
+}
+
+void Worker::flush(Session* s) {
+    while (s->out_pos < s->out.size()) {
+        ssize_t n = send(s->fd, s->out.data() + s->out_pos, s->out.size() - s->out_pos, MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno == EAGAIN)
+                break;
+            stats_.errors++;
+            skip(s, now_ns());
+            return;
+        }
+        s->out_pos += n;
+    }
+    if (s->out_pos == s->out.size()) {
+        s->out.clear();
+        s->out_pos = 0;
+    }
+    epoll_event event;
+    event.data.ptr = s;
+    event.events = EPOLLIN | (s->out.empty() ? 0 : (uint32_t) EPOLLOUT);
+    epoll_ctl(epollfd_, EPOLL_CTL_MOD, s->fd, &event);
+}
+
+void Worker::on_readable(Session* s, long long now) {
+    char buf[65536];
+    bool eof = false;
+    while (true) {
+        ssize_t n = recv(s->fd, buf, sizeof(buf), 0);
+        if (n > 0) {
+            s->in.append(buf, n);
+            continue;
+        }
+        if (n == 0 || errno != EAGAIN)
+            eof = true;
+        break;
+    }
+
+    if (s->inflight) {
+        int status = 0;
+        long long length = parse_response(s->in, eof, &status);
+        if (length < 0 || (length == 0 && eof)) {
+            stats_.errors++;
+            skip(s, now);
+            return;
+        }
+        if (length > 0) {
+            stats_.latency.record(now - s->start);
+            stats_.requests++;
+            stats_.bytes += length;
+            stats_.status[status >= 100 && status < 600 ? status / 100 : 0]++;
+            s->in.erase(0, length);
+            s->inflight = false;
+            s->next++;
+        }
+    }
+    // 服务端关闭连接时，下一个请求重新连接
+    if (eof)
+        close_conn(s);
+    if (!s->inflight)
+        try_send(s, now);
+}
+
+void Worker::check_timeouts(long long now) {
+    for (Session* s : sessions_) {
+        if (s->inflight && now - s->sent > options.timeout * 1000000LL) {
+            stats_.timeouts++;
+            skip(s, now);
+        }
+    }
+}
+
+void Worker::run() {
+    epollfd_ = epoll_create(5);
+    bzero(&addr_, sizeof(addr_));
+    addr_.sin_family = AF_INET;
+    addr_.sin_port = htons(options.port);
+    inet_pton(AF_INET, options.host, &addr_.sin_addr);
+
+    remaining_ = sessions_.size();
+    for (Session* s : sessions_)
+        timers_.push(Timer{ due(s->open_us), s });
+
+    long long last_check = now_ns();
+    vector<epoll_event> events(1024);
+    while (remaining_ > 0) {
+        long long now = now_ns();
+        while (!timers_.empty() && timers_.top().first <= now) {
+            Session* s = timers_.top().second;
+            timers_.pop();
+            try_send(s, now);
+        }
+
+        int wait = 10;
+        if (!timers_.empty())
+            wait = max(0LL, min(10LL, (timers_.top().first - now) / 1000000));
+        int n = epoll_wait(epollfd_, events.data(), events.size(), wait);
+        now = now_ns();
+        for (int i = 0; i < n; i++) {
+            Session* s = (Session*) events[i].data.ptr;
+            if (s->fd == -1)
+                continue;
+            if (!s->connected) {
+                if (!(events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+                    continue;
+                int err = 0;
+                socklen_t len = sizeof(err);
+                getsockopt(s->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+                if (err != 0 || (events[i].events & (EPOLLERR | EPOLLHUP))) {
+                    stats_.errors++;
+                    skip(s, now);
+                    continue;
+                }
+                s->connected = true;
+                try_send(s, now);
+                if (s->fd == -1)
+                    continue;
+                // 请求还没到时间，只等读事件
+                if (!s->inflight) {
+                    epoll_event event;
+                    event.data.ptr = s;
+                    event.events = EPOLLIN;
+                    epoll_ctl(epollfd_, EPOLL_CTL_MOD, s->fd, &event);
+                }
+            }
+            if (s->fd != -1 && (events[i].events & EPOLLOUT) && !s->out.empty())
+                flush(s);
+            if (s->fd != -1 && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+                on_readable(s, now);
+        }
+
+        if (now - last_check >= 100000000LL) {
+            check_timeouts(now);
+            last_check = now;
+        }
+    }
+    close(epollfd_);
+}
+
+static void usage(const char* name) {
+    fprintf(stderr, "usage: %s [-a host] [-p port] [-t threads] [-s speed] [-T timeout_ms] [capture_file]\n", name);
+}
+
+int main(int argc, char* argv[]) {
+    int opt = 0;
+    while ((opt = getopt(argc, argv, "a:p:t:s:T:")) != -1) {
+        if (opt == 'a') options.host = optarg;
+        else if (opt == 'p') options.port = atoi(optarg);
+        else if (opt == 't') options.threads = max(1, atoi(optarg));
+        else if (opt == 's') options.speed = max(0.0, atof(optarg));
+        else if (opt == 'T') options.timeout = max(1, atoi(optarg));
+        else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind < argc)
+        options.file = argv[optind];
+    signal(SIGPIPE, SIG_IGN);
+
+    CaptureFile capture;
+    if (!load_capture(options.file, &capture)) {
+        if (capture.sessions.empty()) {
+            fprintf(stderr, "tinyreplay: cannot read %s\n", options.file);
+            return 1;
+        }
+        fprintf(stderr, "tinyreplay: %s is truncated, replaying the complete part\n", options.file);
+    }
+
+    // 同一个连接的请求由同一个线程回放，按连接轮流分配
+    options.threads = max(1, min(options.threads, (int) capture.sessions.size()));
+    long long base = now_ns() + 100000000LL;
+    vector<Worker*> workers;
+    for (int i = 0; i < options.threads; i++)
+        workers.push_back(new Worker(base));
+    for (size_t i = 0; i < capture.sessions.size(); i++)
+        workers[i % options.threads]->add(&capture.sessions[i]);
+
+    vector<pthread_t> tids(options.threads);
+    for (int i = 0; i < options.threads; i++)
+        pthread_create(&tids[i], nullptr, Worker::run_thread, workers[i]);
+    Stats total;
+    for (int i = 0; i < options.threads; i++) {
+        pthread_join(tids[i], nullptr);
+        total.merge(workers[i]->stats());
+        delete workers[i];
+    }
+    double elapsed = max(now_ns() - base, 1LL) / 1e9;
+
+    const LatencyHistogram& latency = total.latency;
+    printf("{\"mode\":\"replay\",\"file\":\"%s\",\"speed\":%g,\"threads\":%d,\n",
+        options.file, options.speed, options.threads);
+    printf(" \"capture\":{\"connections\":%zu,\"requests\":%lld,\"bytes\":%lld,\"span_s\":%.3f,\"empty_connections\":%lld,\"truncated\":%lld},\n",
+        capture.sessions.size(), capture.requests, capture.bytes, capture.span_us / 1e6, capture.empty, capture.truncated);
+    printf(" \"requests\":%lld,\"elapsed_s\":%.3f,\"throughput_rps\":%.1f,\"bytes\":%lld,\"connects\":%lld,\"errors\":%lld,\"timeouts\":%lld,"
+        "\"mean_late_us\":%.1f,\n", total.requests, elapsed, total.requests / elapsed, total.bytes, total.connects,
+        total.errors, total.timeouts, total.requests > 0 ? total.late_ns / 1000.0 / total.requests : 0.0);
+    printf(" \"status\":{\"1xx\":%lld,\"2xx\":%lld,\"3xx\":%lld,\"4xx\":%lld,\"5xx\":%lld,\"other\":%lld},\n",
+        total.status[1], total.status[2], total.status[3], total.status[4], total.status[5], total.status[0]);
+    printf(" \"latency_us\":{\"min\":%.1f,\"mean\":%.1f,\"p50\":%.1f,\"p90\":%.1f,\"p99\":%.1f,\"p999\":%.1f,\"max\":%.1f}}\n",
+        latency.min_value() / 1000.0, latency.mean() / 1000.0, latency.percentile(0.5) / 1000.0,
+        latency.percentile(0.9) / 1000.0, latency.percentile(0.99) / 1000.0, latency.percentile(0.999) / 1000.0,
+        latency.max_value() / 1000.0);
+    return 0;
+}
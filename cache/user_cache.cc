@@ -0,0 +1,243 @@
+#include "user_cache.h"
+
+using namespace std;
+
+// 向上取2的幂
+static int round_up(int n) {
+    int ret = 1;
+    while (ret < n)
+        ret <<= 1;
+    return ret;
+}
+
+UserCache::~UserCache() {
+    for (int i = 0; i < shard_count_; i++)
+        delete[] shards_[i].slots;
+    delete[] shards_;
+}
+
+void UserCache::init(int capacity, int shard_count, int negative_ttl) {
+    shard_count_ = round_up(shard_count > 0 ? shard_count : 1);
+    slot_count_ = round_up(max(capacity / shard_count_, MAX_PROBE));
+    negative_ttl_ = negative_ttl;
+    shards_ = new Shard[shard_count_];
+    for (int i = 0; i < shard_count_; i++) {
+        shards_[i].seq.store(0, memory_order_relaxed);
+        shards_[i].hand = 0;
+        shards_[i].slots = new Slot[slot_count_];
+        for (int j = 0; j < slot_count_; j++) {
+            shards_[i].slots[j].hash.store(0, memory_order_relaxed);
+            shards_[i].slots[j].referenced.store(false, memory_order_relaxed);
+        }
+    }
+}
+
+// FNV-1a，结果为0时改为1，0留给空槽位
+uint64_t UserCache::hash(const char* name, int len) {
+    uint64_t h = 14695981039346656037ULL;
+    for (int i = 0; i < len; i++) {
+        h ^= (unsigned char) name[i];
+        h *= 1099511628211ULL;
+    }
+    return h == 0 ? 1 : h;
+}
+
+bool UserCache::pack(const char* str, uint64_t* words, int word_count) {
+    int len = strlen(str);
+    if (len >= word_count * 8)
+        return false;
+    memset(words, 0, sizeof(uint64_t) * word_count);
+    memcpy(words, str, len);
+    return true;
+}
+
+UserCache::Lookup UserCache::find(const char* name, char* password, int size) {
+    uint64_t key[KEY_WORDS];
+    if (shards_ == nullptr || !pack(name, key, KEY_WORDS))
+        return MISS;
+    uint64_t h = hash(name, strlen(name));
+    Shard& shard = shards_[(h >> 32) & (shard_count_ - 1)];
+    int mask = slot_count_ - 1;
+
+    uint64_t value[VALUE_WORDS];
+    uint64_t expire = 0;
+    Slot* found;
+    uint64_t seq;
+    while (true) {
+        seq = shard.seq.load(memory_order_acquire);
+        // 正在写，等写者完成
+        if (seq & 1) {
+            sched_yield();
+            continue;
+        }
+
+        found = nullptr;
+        for (int i = 0; i < MAX_PROBE; i++) {
+            Slot& slot = shard.slots[(h + i) & mask];
+            uint64_t slot_hash = slot.hash.load(memory_order_relaxed);
+            if (slot_hash == 0)
+                break;
+            if (slot_hash != h)
+                continue;
+            bool equal = true;
+            for (int j = 0; j < KEY_WORDS && equal; j++)
+                equal = slot.key[j].load(memory_order_relaxed) == key[j];
+            if (!equal)
+                continue;
+            expire = slot.expire.load(memory_order_relaxed);
+            for (int j = 0; j < VALUE_WORDS; j++)
+                value[j] = slot.value[j].load(memory_order_relaxed);
+            found = &slot;
+            break;
+        }
+
+        // 读完数据后序列号没有变化，说明期间没有写者
+        atomic_thread_fence(memory_order_acquire);
+        if (shard.seq.load(memory_order_relaxed) == seq)
+            break;
+    }
+
+    if (found == nullptr)
+        return MISS;
+    // 已经置位就不再写，避免热点槽位所在的缓存行在核间来回失效
+    if (!found->referenced.load(memory_order_relaxed))
+        found->referenced.store(true, memory_order_relaxed);
+    if (expire != 0)
+        return (uint64_t) time(nullptr) < expire ? ABSENT : MISS;
+
+    int len = strnlen((const char*) value, VALUE_LEN - 1);
+    if (len >= size)
+        return MISS;
+    memcpy(password, value, len);
+    password[len] = '\0';
+    return HIT;
+}
+
+void UserCache::insert(const char* name, const char* password) {
+    uint64_t value[VALUE_WORDS];
+    if (!pack(password, value, VALUE_WORDS))
+        return;
+    store(name, value, 0);
+}
+
+void UserCache::insert_absent(const char* name) {
+    uint64_t value[VALUE_WORDS];
+    memset(value, 0, sizeof(value));
+    store(name, value, time(nullptr) + negative_ttl_);
+}
+
+// 优先使用已有的同名槽位，其次使用空槽位
+// 窗口满了从CLOCK指针开始扫描，访问位为1的清零跳过，为0的被淘汰，最多扫两轮
+UserCache::Slot* UserCache::select(Shard& shard, uint64_t h, const uint64_t* key) {
+    int mask = slot_count_ - 1;
+    for (int i = 0; i < MAX_PROBE; i++) {
+        Slot& slot = shard.slots[(h + i) & mask];
+        uint64_t slot_hash = slot.hash.load(memory_order_relaxed);
+        if (slot_hash == 0)
+            return &slot;
+        if (slot_hash != h)
+            continue;
+        bool equal = true;
+        for (int j = 0; j < KEY_WORDS && equal; j++)
+            equal = slot.key[j].load(memory_order_relaxed) == key[j];
+        if (equal)
+            return &slot;
+    }
+
+    Slot* victim = nullptr;
+    for (int i = 0; i < 2 * MAX_PROBE && victim == nullptr; i++) {
+        Slot& slot = shard.slots[(h + shard.hand) & mask];
+        shard.hand = (shard.hand + 1) % MAX_PROBE;
+        if (slot.referenced.load(memory_order_relaxed))
+            slot.referenced.store(false, memory_order_relaxed);
+        else
+            victim = &slot;
+    }
+    return victim;
+}
+
+void UserCache::store(const char* name, const uint64_t* value, uint64_t expire) {
+    uint64_t key[KEY_WORDS];
+    if (shards_ == nullptr || !pack(name, key, KEY_WORDS))
+        return;
+    uint64_t h = hash(name, strlen(name));
+    Shard& shard = shards_[(h >> 32) & (shard_count_ - 1)];
+
+    shard.mutex.lock();
+    Slot* target = select(shard, h, key);
+    if (target == nullptr) {
+        shard.mutex.unlock();
+        return;
+    }
+
+    // 序列号先变为奇数，写完数据后再变回偶数
+    uint64_t seq = shard.seq.load(memory_order_relaxed);
+    shard.seq.store(seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    for (int j = 0; j < KEY_WORDS; j++)
+        target->key[j].store(key[j], memory_order_relaxed);
+    for (int j = 0; j < VALUE_WORDS; j++)
+        target->value[j].store(value[j], memory_order_relaxed);
+    target->expire.store(expire, memory_order_relaxed);
+    target->hash.store(h, memory_order_relaxed);
+    target->referenced.store(false, memory_order_relaxed);
+    shard.seq.store(seq + 2, memory_order_release);
+    shard.mutex.unlock();
+}
+
+int UserCache::save_snapshot(const char* path) {
+    if (shards_ == nullptr)
+        return 0;
+    FILE* fp = fopen(path, "w");
+    if (fp == nullptr)
+        return 0;
+
+    int count = 0;
+    char name[KEY_LEN];
+    for (int i = 0; i < shard_count_; i++) {
+        Shard& shard = shards_[i];
+        // 持有写锁读取，得到的一定是完整的槽位
+        shard.mutex.lock();
+        for (int j = 0; j < slot_count_; j++) {
+            Slot& slot = shard.slots[j];
+            if (slot.hash.load(memory_order_relaxed) == 0 || slot.expire.load(memory_order_relaxed) != 0)
+                continue;
+            if (!slot.referenced.load(memory_order_relaxed))
+                continue;
+            for (int k = 0; k < KEY_WORDS; k++) {
+                uint64_t word = slot.key[k].load(memory_order_relaxed);
+                memcpy(name + k * 8, &word, min(8, KEY_LEN - k * 8));
+            }
+            name[KEY_LEN - 1] = '\0';
+            fprintf(fp, "%s\n", name);
+            count++;
+        }
+        shard.mutex.unlock();
+    }
+    fclose(fp);
+    return count;
+}
+
+int UserCache::warm_up(const char* path, bool (*loader)(const char* name, char* password, int size)) {
+    FILE* fp = fopen(path, "r");
+    if (fp == nullptr)
+        return 0;
+
+    int count = 0;
+    char line[KEY_LEN + 2];
+    char password[VALUE_LEN];
+    while (fgets(line, sizeof(line), fp) != nullptr) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0')
+            continue;
+        // 已经被请求加载过的不再查库
+        if (find(line, password, sizeof(password)) != MISS)
+            continue;
+        if (loader(line, password, sizeof(password))) {
+            insert(line, password);
+            count++;
+        }
+    }
+    fclose(fp);
+    return count;
+}
@@ -0,0 +1,88 @@
+#ifndef USER_CACHE_H
+#define USER_CACHE_H
+
+#include "pch.h"
+
+#include "lock.h"
+
+/**
+ * @brief 读多写少的并发用户名密码缓存，按需从数据库加载
+ * 按哈希分片，每个分片是固定容量的开放寻址表，总内存在init时确定
+ * 读者不加锁：分片上的序列锁(seqlock)为奇数表示正在写，读完后序列号不变才算读到一致的数据
+ * 写者在分片互斥锁内修改，探测窗口内没有空位时按CLOCK算法淘汰：命中过的槽位先清除访问位，跳过一轮
+ * 数据库中不存在的用户名也会缓存一段时间(负缓存)，避免反复查库
+ * 缓存未命中不代表用户不存在，调用者需要回落到数据库查询
+ */
+class UserCache {
+public:
+    static constexpr int KEY_LEN = 100;         // 用户名最大长度，含结尾\0
+    static constexpr int VALUE_LEN = 100;       // 密码最大长度，含结尾\0
+    static constexpr int MAX_PROBE = 8;         // 开放寻址的最大探测长度
+
+    // 查找结果
+    enum Lookup {
+        MISS = 0,                               // 缓存中没有，需要查数据库
+        HIT,                                    // 用户存在
+        ABSENT                                  // 负缓存命中，用户不存在
+    };
+
+    // 局部静态变量单例模式
+    static UserCache* get_instance() {
+        static UserCache cache;
+        return &cache;
+    }
+
+    // capacity为总槽位数，shard_count为分片数，都向上取2的幂，negative_ttl为负缓存的秒数
+    void init(int capacity = 1 << 16, int shard_count = 16, int negative_ttl = 60);
+
+    // 查找用户名，命中时把密码复制到password
+    Lookup find(const char* name, char* password, int size);
+    // 插入或更新一个用户
+    void insert(const char* name, const char* password);
+    // 记录一个数据库中不存在的用户名
+    void insert_absent(const char* name);
+
+    // 把命中过的用户名写入快照文件，每行一个，返回写入的个数
+    int save_snapshot(const char* path);
+    // 读取快照文件中的用户名，通过loader从数据库加载后放入缓存，返回加载的个数
+    // loader找到用户时把密码写入password并返回true
+    int warm_up(const char* path, bool (*loader)(const char* name, char* password, int size));
+
+private:
+    static constexpr int KEY_WORDS = (KEY_LEN + 7) / 8;
+    static constexpr int VALUE_WORDS = (VALUE_LEN + 7) / 8;
+
+    // 槽位的每个字都是原子变量，读者和写者并发访问时没有数据竞争
+    struct Slot {
+        std::atomic<uint64_t> hash;             // 0表示空槽位
+        std::atomic<uint64_t> expire;           // 0表示正常用户，否则为负缓存的过期时间
+        std::atomic<uint64_t> key[KEY_WORDS];
+        std::atomic<uint64_t> value[VALUE_WORDS];
+        std::atomic<bool> referenced;           // CLOCK访问位，读者命中时设置，不受序列锁保护
+    };
+
+    struct alignas(64) Shard {
+        std::atomic<uint64_t> seq;              // 序列锁，奇数表示正在写
+        Mutex mutex;                            // 写者之间互斥
+        Slot* slots;
+        int hand;                               // CLOCK指针，在探测窗口内的偏移
+    };
+
+    UserCache() : shards_(nullptr), shard_count_(0), slot_count_(0), negative_ttl_(60) { }
+    ~UserCache();
+
+    static uint64_t hash(const char* name, int len);
+    // 把字符串按字补齐0，超长返回false
+    static bool pack(const char* str, uint64_t* words, int word_count);
+    // 在序列锁保护下写入一个槽位，expire为0表示正常用户
+    void store(const char* name, const uint64_t* value, uint64_t expire);
+    // 在探测窗口内选择要写入的槽位，调用时需持有分片互斥锁
+    Slot* select(Shard& shard, uint64_t h, const uint64_t* key);
+
+    Shard* shards_;
+    int shard_count_;
+    int slot_count_;                            // 每个分片的槽位数
+    int negative_ttl_;
+};
+
+#endif
@@ -0,0 +1,279 @@
+#include "log.h"
+
+#include "async_db.h"
+
+using namespace std;
+
+AsyncDb::~AsyncDb() {
+    if (conns_ == nullptr)
+        return;
+    for (int i = 0; i < conn_count_; i++) {
+        if (conns_[i].mysql != nullptr)
+            conn_pool_->rel_conn(conns_[i].mysql);
+    }
+    delete[] conns_;
+}
+
+bool AsyncDb::init(ConnPool* conn_pool, int shared_conn, int pipeline_depth, int timeout_ms) {
+    conn_pool_ = conn_pool;
+    pipeline_depth_ = pipeline_depth > 0 ? pipeline_depth : 1;
+    timeout_ms_ = timeout_ms;
+    conn_count_ = shared_conn > 0 ? shared_conn : 1;
+    conns_ = new SharedConn[conn_count_];
+
+    int acquired = 0;
+    for (int i = 0; i < conn_count_; i++) {
+        // 数据库暂时不可用时先不取连接，第一次查询时再取
+        conns_[i].mysql = acquire();
+        if (conns_[i].mysql != nullptr)
+            acquired++;
+        // 驱动协程立即运行到第一次取批挂起
+        conns_[i].driver = drive(&conns_[i]);
+        conns_[i].driver.resume();
+    }
+    // 看门狗立即运行到第一次定时挂起
+    watchdog_ = watch();
+    watchdog_.resume();
+    return acquired > 0;
+}
+
+MYSQL* AsyncDb::acquire() {
+    MYSQL* mysql = conn_pool_->try_get_conn();
+    if (mysql == nullptr)
+        return nullptr;
+    // 只有共享连接打开多语句，用于合并只读查询
+    if (mysql_set_server_option(mysql, MYSQL_OPTION_MULTI_STATEMENTS_ON) != 0)
+        LOG_WARN("MySQL multi statements off: %s!", mysql_error(mysql));
+    return mysql;
+}
+
+bool AsyncDb::saturated() const {
+    int pending = 0;
+    for (int i = 0; i < conn_count_; i++)
+        pending += conns_[i].pending.load(memory_order_relaxed);
+    return conn_count_ > 0 && pending >= conn_count_ * pipeline_depth_ * SATURATION;
+}
+
+AsyncDb::SharedConn* AsyncDb::pick() {
+    SharedConn* best = &conns_[0];
+    for (int i = 1; i < conn_count_; i++) {
+        if (conns_[i].pending.load(memory_order_relaxed) < best->pending.load(memory_order_relaxed))
+            best = &conns_[i];
+    }
+    return best;
+}
+
+Task<AsyncDb::Result> AsyncDb::query(const char* sql, const char* const* params, int param_count, bool read_only) {
+    if (conn_count_ == 0)
+        co_return Result{ false, 0, nullptr, true };
+
+    Op op;
+    op.sql = sql;
+    op.params = params;
+    op.param_count = param_count;
+    op.read_only = read_only;
+    op.enqueue_ms = Executor::now_ms();
+    op.result = Result{ false, 0, nullptr, true };
+    co_await OpAwaiter(pick(), &op);
+    co_return op.result;
+}
+
+void AsyncDb::append_sql(MYSQL* mysql, const Op* op, string* sql) {
+    int param = 0;
+    for (const char* p = op->sql; *p != '\0'; p++) {
+        if (*p != '?' || param >= op->param_count) {
+            *sql += *p;
+            continue;
+        }
+        // 转义后最长为原来的两倍加结尾的\0
+        const char* value = op->params[param++];
+        unsigned long length = strlen(value);
+        size_t offset = sql->size() + 1;
+        sql->resize(offset + length * 2 + 2);
+        (*sql)[offset - 1] = '\'';
+        length = mysql_real_escape_string_quote(mysql, &(*sql)[offset], value, length, '\'');
+        sql->resize(offset + length);
+        *sql += '\'';
+    }
+}
+
+// 入队后唤醒空闲的驱动协程
+// 解锁之后本协程随时可能被恢复，不能再访问this
+void AsyncDb::OpAwaiter::await_suspend(coroutine_handle<> handle) {
+    SharedConn* conn = conn_;
+    op_->handle = handle;
+    conn->pending.fetch_add(1, memory_order_relaxed);
+
+    conn->mutex.lock();
+    conn->queue.push_back(op_);
+    coroutine_handle<> idle = conn->idle;
+    conn->idle = nullptr;
+    conn->mutex.unlock();
+
+    if (idle)
+        Executor::get_instance()->post(idle);
+}
+
+void AsyncDb::take_batch(SharedConn* conn, vector<Op*>* batch) {
+    batch->clear();
+    // 写操作单独发送，连续的只读查询最多合并pipeline_depth_条
+    Op* op = conn->queue.front();
+    conn->queue.pop_front();
+    batch->push_back(op);
+    if (!op->read_only)
+        return;
+    while (!conn->queue.empty() && (int) batch->size() < pipeline_depth_ && conn->queue.front()->read_only) {
+        batch->push_back(conn->queue.front());
+        conn->queue.pop_front();
+    }
+}
+
+bool AsyncDb::BatchAwaiter::await_ready() {
+    conn_->mutex.lock();
+    if (conn_->queue.empty()) {
+        // 保持加锁进入await_suspend，避免登记idle之前漏掉新提交的查询
+        return false;
+    }
+    db_->take_batch(conn_, batch_);
+    conn_->mutex.unlock();
+    return true;
+}
+
+bool AsyncDb::BatchAwaiter::await_suspend(coroutine_handle<> handle) {
+    conn_->idle = handle;
+    conn_->mutex.unlock();
+    return true;
+}
+
+void AsyncDb::BatchAwaiter::await_resume() {
+    if (!batch_->empty())
+        return;
+    // 被提交者唤醒，此时队列一定非空
+    conn_->mutex.lock();
+    db_->take_batch(conn_, batch_);
+    conn_->mutex.unlock();
+}
+
+Task<> AsyncDb::drive(SharedConn* conn) {
+    Executor* executor = Executor::get_instance();
+    vector<Op*> batch;
+    string sql;
+
+    while (true) {
+        batch.clear();
+        co_await BatchAwaiter(this, conn, &batch);
+
+        // 排队超时的查询直接返回不可用，避免积压的请求拖垮数据库
+        long long now = Executor::now_ms();
+        size_t live = 0;
+        for (Op* op : batch) {
+            if (now - op->enqueue_ms > timeout_ms_) {
+                conn->pending.fetch_sub(1, memory_order_relaxed);
+                executor->post(op->handle);
+            } else {
+                batch[live++] = op;
+            }
+        }
+        batch.resize(live);
+        if (batch.empty())
+            continue;
+
+        // 连接断开后重新从连接池获取，没有空闲连接时挂在定时器上重试，不占用工作线程
+        // 等连接池后台线程建立新连接，本批最早的查询排队超时后仍然没有则本批返回不可用
+        while (conn->mysql == nullptr) {
+            conn->mysql = acquire();
+            if (conn->mysql != nullptr || Executor::now_ms() - batch[0]->enqueue_ms > timeout_ms_)
+                break;
+            co_await executor->sleep(RETRY_MS);
+        }
+        MYSQL* mysql = conn->mysql;
+        if (mysql == nullptr) {
+            for (Op* op : batch) {
+                conn->pending.fetch_sub(1, memory_order_relaxed);
+                executor->post(op->handle);
+            }
+            continue;
+        }
+
+        sql.clear();
+        for (size_t i = 0; i < batch.size(); i++) {
+            if (i > 0)
+                sql += ';';
+            append_sql(mysql, batch[i], &sql);
+        }
+
+        // 语句很短，发送阶段不会阻塞，NOT_READY表示在等待数据库的响应
+        set_busy(conn, Executor::now_ms());
+        net_async_status status;
+        while ((status = mysql_real_query_nonblocking(mysql, sql.c_str(), sql.size())) == NET_ASYNC_NOT_READY)
+            co_await executor->readable(mysql_get_socket(mysql));
+
+        // 依次读取每条语句的结果，某条语句出错后，后面的语句不会被执行
+        size_t done = 0;
+        while (status != NET_ASYNC_ERROR && done < batch.size()) {
+            Op* op = batch[done];
+            MYSQL_RES* res = nullptr;
+            if (mysql_field_count(mysql) > 0) {
+                while ((status = mysql_store_result_nonblocking(mysql, &res)) == NET_ASYNC_NOT_READY)
+                    co_await executor->readable(mysql_get_socket(mysql));
+                if (status == NET_ASYNC_ERROR)
+                    break;
+            }
+            op->result = Result{ true, 0, res, false };
+            done++;
+            if (done == batch.size())
+                break;
+            while ((status = mysql_next_result_nonblocking(mysql)) == NET_ASYNC_NOT_READY)
+                co_await executor->readable(mysql_get_socket(mysql));
+        }
+
+        // 清除之后看门狗不再访问这条连接，才可以交还连接池
+        set_busy(conn, 0);
+        if (done < batch.size()) {
+            unsigned int error = mysql_errno(mysql);
+            LOG_ERROR("MySQL Error: %s!", mysql_error(mysql));
+            // 出错的语句返回错误，之后未执行的只读语句放回队列重新发送
+            batch[done]->result = Result{ false, error, nullptr, error >= CR_MIN_ERROR };
+            if (error >= CR_MIN_ERROR) {
+                conn_pool_->rel_conn(mysql, true);
+                conn->mysql = nullptr;
+            }
+            conn->mutex.lock();
+            for (size_t i = batch.size() - 1; i > done; i--)
+                conn->queue.push_front(batch[i]);
+            conn->mutex.unlock();
+            batch.resize(done + 1);
+        }
+
+        for (Op* op : batch) {
+            conn->pending.fetch_sub(1, memory_order_relaxed);
+            executor->post(op->handle);
+        }
+    }
+}
+
+void AsyncDb::set_busy(SharedConn* conn, long long busy_ms) {
+    conn->mutex.lock();
+    conn->busy_ms = busy_ms;
+    conn->mutex.unlock();
+}
+
+// 关闭socket后，驱动协程从读等待中醒来，非阻塞接口返回连接断开，本批查询返回不可用，连接交还连接池重连
+Task<> AsyncDb::watch() {
+    Executor* executor = Executor::get_instance();
+    while (true) {
+        co_await executor->sleep(max(timeout_ms_ / 2, 10));
+        long long now = Executor::now_ms();
+        for (int i = 0; i < conn_count_; i++) {
+            SharedConn* conn = &conns_[i];
+            // 驱动协程清除busy_ms之后才会交还连接，持有锁时连接一定有效
+            conn->mutex.lock();
+            if (conn->busy_ms > 0 && now - conn->busy_ms > timeout_ms_) {
+                LOG_WARN("AsyncDb: no response in %lldms, close connection!", now - conn->busy_ms);
+                shutdown(mysql_get_socket(conn->mysql), SHUT_RDWR);
+                conn->busy_ms = 0;
+            }
+            conn->mutex.unlock();
+        }
+    }
+}
@@ -0,0 +1,132 @@
+#ifndef ASYNC_DB_H
+#define ASYNC_DB_H
+
+#include "pch.h"
+
+#include "executor.h"
+#include "lock.h"
+#include "mysql_conn.h"
+#include "task.h"
+
+/**
+ * @brief 建立在ConnPool之上的异步数据库层
+ * 初始化时从连接池借出若干条共享连接，每条连接由一个常驻的驱动协程负责收发
+ * 请求协程提交查询后挂起，驱动协程在数据库socket可读时读取结果，再把请求协程交回执行器
+ * 多条只读查询排在同一条连接上时，合并成一次多语句请求发送，共用一次往返
+ * libmysqlclient的预处理语句没有非阻塞接口，参数由驱动协程按连接的字符集转义后拼进SQL文本，
+ * 任何参数都不能结束字符串，所以共享连接上打开多语句不会引入注入
+ * 连接断开后交还连接池重连，驱动协程不等待地再取一条新连接，取不到时挂在定时器上重试，
+ * 最早的查询排队超时仍然没有连接，或者排队超时的请求返回不可用
+ * 看门狗协程定时检查，查询发出后超时仍未读完结果的连接直接关闭socket，按连接断开处理
+ */
+class AsyncDb {
+public:
+    static constexpr int SATURATION = 4;        // 每条共享连接上平均排队超过这么多批查询时认为已饱和
+    static constexpr int RETRY_MS = 10;         // 连接池没有空闲连接时，驱动协程重试的间隔
+
+    // 查询结果，res为结果集，由调用者mysql_free_result
+    struct Result {
+        bool ok;
+        unsigned int error;     // mysql_errno
+        MYSQL_RES* res;
+        bool unavailable;       // 没有可用连接或者排队超时，调用者应返回503
+    };
+
+    // 局部静态变量单例模式
+    static AsyncDb* get_instance() {
+        static AsyncDb async_db;
+        return &async_db;
+    }
+
+    // 从conn_pool借出shared_conn条连接，每次最多合并pipeline_depth条只读查询
+    // 排队超过timeout_ms的查询不再执行，发出后超过timeout_ms的查询断开连接，都返回不可用
+    bool init(ConnPool* conn_pool, int shared_conn = 2, int pipeline_depth = 8, int timeout_ms = 500);
+
+    // 提交一条查询并挂起，直到结果返回
+    // sql中的?依次替换为转义并加上单引号的params，sql和params在协程恢复之前必须有效
+    // read_only为true表示查询没有副作用，可以和其他只读查询合并发送
+    Task<Result> query(const char* sql, const char* const* params = nullptr, int param_count = 0,
+        bool read_only = false);
+    // 未完成的查询是否已经排满，只读取计数，不加锁
+    bool saturated() const;
+
+private:
+    struct Op {
+        const char* sql;
+        const char* const* params;
+        int param_count;
+        bool read_only;
+        long long enqueue_ms;                   // 提交时间
+        Result result;
+        std::coroutine_handle<> handle;
+    };
+
+    struct SharedConn {
+        SharedConn() : mysql(nullptr), busy_ms(0), pending(0) { }
+
+        MYSQL* mysql;
+        Mutex mutex;                            // 保护queue、idle和busy_ms
+        long long busy_ms;                      // 本批查询的发送时间，0表示没有在等待数据库
+        std::list<Op*> queue;                   // 等待发送的查询
+        std::coroutine_handle<> idle;           // 没有查询时挂起的驱动协程
+        std::atomic<int> pending;               // 已提交未完成的查询数，用于选择连接
+        Task<> driver;                          // 驱动协程
+    };
+
+    // 请求协程提交查询时使用，挂起后由驱动协程恢复
+    class OpAwaiter {
+    public:
+        OpAwaiter(SharedConn* conn, Op* op) : conn_(conn), op_(op) { }
+
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(std::coroutine_handle<> handle);
+        void await_resume() const noexcept { }
+
+    private:
+        SharedConn* conn_;
+        Op* op_;
+    };
+
+    // 驱动协程取下一批查询，队列为空时挂起
+    class BatchAwaiter {
+    public:
+        BatchAwaiter(AsyncDb* db, SharedConn* conn, std::vector<Op*>* batch)
+            : db_(db), conn_(conn), batch_(batch) { }
+
+        bool await_ready();
+        bool await_suspend(std::coroutine_handle<> handle);
+        void await_resume();
+
+    private:
+        AsyncDb* db_;
+        SharedConn* conn_;
+        std::vector<Op*>* batch_;
+    };
+
+    AsyncDb() : conns_(nullptr), conn_count_(0), pipeline_depth_(1), timeout_ms_(500) { }
+    ~AsyncDb();
+
+    // 从队列头部取出可以一起发送的查询，调用时需持有conn->mutex
+    void take_batch(SharedConn* conn, std::vector<Op*>* batch);
+    // 选择未完成查询最少的连接
+    SharedConn* pick();
+    // 从连接池取一条连接作为共享连接，不等待，没有空闲连接时返回nullptr
+    MYSQL* acquire();
+    // 把op的语句追加到sql，参数按mysql的字符集转义
+    static void append_sql(MYSQL* mysql, const Op* op, std::string* sql);
+    // 驱动协程：取一批查询，发送，依次读取结果并恢复提交者
+    Task<> drive(SharedConn* conn);
+    // 看门狗协程：关闭等待结果超时的连接
+    Task<> watch();
+    // 设置或清除conn的busy_ms
+    static void set_busy(SharedConn* conn, long long busy_ms);
+
+    SharedConn* conns_;
+    int conn_count_;
+    int pipeline_depth_;
+    int timeout_ms_;
+    ConnPool* conn_pool_;
+    Task<> watchdog_;
+};
+
+#endif
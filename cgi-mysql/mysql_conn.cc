@@ -1,25 +1,65 @@
 #include "log.h"
 
+#include "executor.h"
 #include "mysql_conn.h"
+#include "usdt.h"
 
 using namespace std;
 
+StmtCache::~StmtCache() {
+    for (auto& item : stmts_)
+        mysql_stmt_close(item.second);
+}
+
+MYSQL_STMT* StmtCache::get(const char* sql) {
+    auto iter = stmts_.find(sql);
+    if (iter != stmts_.end())
+        return iter->second;
+
+    MYSQL_STMT* stmt = mysql_stmt_init(conn_);
+    if (stmt == nullptr)
+        return nullptr;
+    if (mysql_stmt_prepare(stmt, sql, strlen(sql)) != 0) {
+        LOG_ERROR("MySQL prepare error: %s!", mysql_stmt_error(stmt));
+        mysql_stmt_close(stmt);
+        return nullptr;
+    }
+    stmts_[sql] = stmt;
+    return stmt;
+}
+
+void StmtCache::drop(const char* sql) {
+    auto iter = stmts_.find(sql);
+    if (iter == stmts_.end())
+        return;
+    mysql_stmt_close(iter->second);
+    stmts_.erase(iter);
+}
+
 // 销毁数据库连接池
 ConnPool::~ConnPool() {
-    mutex_.lock();
-    if (conn_list_.size() > 0) {
-        // 通过迭代器遍历，关闭数据库连接
-        for (MYSQL* conn : conn_list_) 
-            mysql_close(conn);
-        // 清空list
-        conn_list_.clear();
+    if (running_) {
+        // 通知后台线程退出，阻塞在条件变量上的线程不能留到它析构之后
+        mutex_.lock();
+        stop_ = true;
         mutex_.unlock();
+        maintain_cond_.signal();
+        pthread_join(tid_, nullptr);
+    }
+    mutex_.lock();
+    for (auto& item : stmt_caches_) {
+        delete item.second;
+        mysql_close(item.first);
     }
+    stmt_caches_.clear();
+    conn_list_.clear();
+    broken_list_.clear();
     mutex_.unlock();
 }
 
 // 构造初始化
-void ConnPool::init(string url, string username, string password, string db_name, int port, unsigned int max_conn, bool close_log) {
+void ConnPool::init(string url, string username, string password, string db_name, int port,
+    unsigned int min_conn, unsigned int max_conn, bool close_log, int timeout_ms) {
     // 初始化数据库信息
     url_ = url;
     port_ = port;
@@ -27,69 +67,368 @@ void ConnPool::init(string url, string username, string password, string db_name
     password_ = password;
     db_name_ = db_name;
     close_log_ = close_log;
+    max_conn_ = max_conn > 0 ? max_conn : 1;
+    min_conn_ = min(min_conn, (unsigned int) max_conn_);
+    timeout_ms_ = timeout_ms;
 
-    // 创建max_conn条数据库连接
-    for (int i = 0; i < max_conn; i++) {
-        MYSQL* conn = nullptr;
-        conn = mysql_init(conn);
-        if (conn == nullptr) {
-            LOG_ERROR("MySQL Error: %s!", mysql_error(conn));
-            exit(EXIT_FAILURE);
-        }
-        conn = mysql_real_connect(conn, url.c_str(), username.c_str(), password.c_str(), db_name.c_str(), port, nullptr, 0);
-
-        if (conn == nullptr) {
-            LOG_ERROR("MySQL Error: %s!", mysql_error(conn));
-            exit(EXIT_FAILURE);
-        }
-        // 更新连接池和空闲连接数量
-        conn_list_.push_back(conn);
+    // 先建立min_conn条数据库连接，失败的由后台线程继续补充
+    for (int i = 0; i < min_conn_; i++) {
+        MYSQL* conn = connect();
+        if (conn == nullptr)
+            break;
+        long long now = Executor::now_ms();
+        mutex_.lock();
+        conn_list_.push_back(IdleConn{ conn, now, now });
         free_conn_++;
+        total_conn_++;
+        mutex_.unlock();
     }
-    // 将信号量初始化为空闲连接数量
-    sem_ = Sem(free_conn_);
-    max_conn_ = free_conn_;
+    if (total_conn_ < min_conn_)
+        LOG_WARN("MySQL: only %d of %d connections established!", total_conn_, min_conn_);
+
+    running_ = pthread_create(&tid_, nullptr, maintain_thread, this) == 0;
 }
 
-// 当有请求时，从数据库连接池中返回一个可用连接，更新使用和空闲连接数
-MYSQL* ConnPool::get_conn() {
-    MYSQL* conn = nullptr;
-    if (conn_list_.size() == 0)
+MYSQL* ConnPool::connect() {
+    MYSQL* conn = mysql_init(nullptr);
+    if (conn == nullptr) {
+        LOG_ERROR("MySQL Error: mysql_init failure!");
+        return nullptr;
+    }
+    // 读超时在TCP上最多重试两次，阻塞调用最长约为三倍
+    unsigned int timeout = max(1, (timeout_ms_ + 999) / 1000);
+    mysql_options(conn, MYSQL_OPT_CONNECT_TIMEOUT, &timeout);
+    mysql_options(conn, MYSQL_OPT_READ_TIMEOUT, &timeout);
+    mysql_options(conn, MYSQL_OPT_WRITE_TIMEOUT, &timeout);
+    if (mysql_real_connect(conn, url_.c_str(), username_.c_str(), password_.c_str(), db_name_.c_str(), port_, nullptr, 0) == nullptr) {
+        LOG_ERROR("MySQL Error: %s!", mysql_error(conn));
+        mysql_close(conn);
         return nullptr;
+    }
+    mutex_.lock();
+    stmt_caches_[conn] = new StmtCache(conn);
+    mutex_.unlock();
+    return conn;
+}
 
-    // 取出连接，信号量原子减1，为0则等待
-    sem_.wait();
+void ConnPool::destroy(MYSQL* conn) {
     mutex_.lock();
+    auto iter = stmt_caches_.find(conn);
+    StmtCache* cache = iter != stmt_caches_.end() ? iter->second : nullptr;
+    if (cache != nullptr)
+        stmt_caches_.erase(iter);
+    mutex_.unlock();
+    delete cache;
+    mysql_close(conn);
+}
+
+// 当有请求时，从数据库连接池中返回一个可用连接，更新使用和空闲连接数
+// 没有空闲连接时等待，未达到上限则唤醒后台线程新建一条，超时返回nullptr
+MYSQL* ConnPool::get_conn(int timeout_ms) {
+    long long start = Executor::now_ms();
+    MYSQL* conn = nullptr;
 
-    conn = conn_list_.front();
-    conn_list_.pop_front();
+    mutex_.lock();
+    while (true) {
+        if (!conn_list_.empty()) {
+            conn = conn_list_.front().conn;
+            conn_list_.pop_front();
+            free_conn_--;
+            curr_conn_++;
+            break;
+        }
+        long long remain = timeout_ms < 0 ? 1000 : timeout_ms - (Executor::now_ms() - start);
+        if (remain <= 0)
+            break;
+        struct timespec t;
+        clock_gettime(CLOCK_REALTIME, &t);
+        t.tv_sec += remain / 1000;
+        t.tv_nsec += (remain % 1000) * 1000000;
+        if (t.tv_nsec >= 1000000000) {
+            t.tv_sec++;
+            t.tv_nsec -= 1000000000;
+        }
+        waiters_++;
+        // 建立连接可能要等到连接超时，交给后台线程，调用者最多等待timeout_ms
+        if (total_conn_ < max_conn_)
+            maintain_cond_.signal();
+        cond_.timewait(mutex_.get(), t);
+        waiters_--;
+    }
+    [[maybe_unused]] int used = curr_conn_;
+    mutex_.unlock();
 
-    free_conn_--;
-    curr_conn_++;
+    long long wait_us = (Executor::now_ms() - start) * 1000;
+    wait_histogram_.record(wait_us);
+    USDT(conn_acquire, conn, wait_us, used);
+    return conn;
+}
 
+MYSQL* ConnPool::try_get_conn() {
+    MYSQL* conn = nullptr;
+    mutex_.lock();
+    if (!conn_list_.empty()) {
+        conn = conn_list_.front().conn;
+        conn_list_.pop_front();
+        free_conn_--;
+        curr_conn_++;
+    } else if (total_conn_ < max_conn_) {
+        dial_requests_ = min(dial_requests_ + 1, max_conn_);
+        maintain_cond_.signal();
+    }
+    [[maybe_unused]] int used = curr_conn_;
     mutex_.unlock();
+
+    USDT(conn_acquire, conn, 0LL, used);
     return conn;
 }
 
-// 释放当前使用的连接
-bool ConnPool::rel_conn(MYSQL* conn) {
+// 释放当前使用的连接，断开的连接交给后台线程处理
+bool ConnPool::rel_conn(MYSQL* conn, bool broken) {
     if (conn == nullptr) 
         return false;
 
+    long long now = Executor::now_ms();
     mutex_.lock();
-
-    conn_list_.push_back(conn);
-    
-    free_conn_++;
+    if (broken) {
+        broken_list_.push_back(conn);
+    } else {
+        conn_list_.push_back(IdleConn{ conn, now, now });
+        free_conn_++;
+    }
     curr_conn_--;
+    [[maybe_unused]] int used = curr_conn_;
+    mutex_.unlock();
+    cond_.signal();
+    USDT(conn_release, conn, (int) broken, used);
 
+    return true;
+}
+
+void* ConnPool::maintain_thread(void* arg) {
+    ConnPool* pool = (ConnPool*) arg;
+    long long report_ms = Executor::now_ms();
+    bool connected = true;
+    while (true) {
+        // 每秒维护一次，有线程在等待连接时提前唤醒，维护期间错过的通知按等待者数补上
+        // 上一轮建立连接失败时等满一秒，数据库不可用期间不被等待者唤醒后反复重连
+        pool->mutex_.lock();
+        if (!pool->stop_ && (!connected || !pool->need_dial())) {
+            struct timespec t;
+            clock_gettime(CLOCK_REALTIME, &t);
+            t.tv_sec++;
+            while (pool->maintain_cond_.timewait(pool->mutex_.get(), t) && !connected && !pool->stop_) { }
+        }
+        bool stop = pool->stop_;
+        pool->mutex_.unlock();
+        if (stop)
+            break;
+        connected = pool->maintain();
+
+        // 每分钟输出一次连接池状态和获取连接的等待耗时
+        long long now = Executor::now_ms();
+        if (now - report_ms >= 60000) {
+            report_ms = now;
+            const Histogram& wait = pool->wait_histogram_;
+            LOG_INFO("ConnPool: free %d, used %d, wait count %llu, p50 %lluus, p99 %lluus.",
+                pool->free_conn_, pool->curr_conn_, (unsigned long long) wait.count(),
+                (unsigned long long) wait.percentile(0.5), (unsigned long long) wait.percentile(0.99));
+        }
+    }
+    return nullptr;
+}
+
+bool ConnPool::maintain() {
+    long long now = Executor::now_ms();
+    list<MYSQL*> broken;
+    list<MYSQL*> shrink;
+    list<IdleConn> idle;
+
+    // 取出断开的连接、多于最小连接数的长期空闲连接，以及太久没有确认过的空闲连接
+    mutex_.lock();
+    broken.swap(broken_list_);
+    int surplus = total_conn_ - (int) broken.size() - min_conn_;
+    for (auto iter = conn_list_.begin(); iter != conn_list_.end(); ) {
+        if (now - iter->since >= IDLE_TIMEOUT && surplus > 0) {
+            shrink.push_back(iter->conn);
+            surplus--;
+            total_conn_--;
+        } else if (now - iter->alive >= PING_INTERVAL) {
+            idle.push_back(*iter);
+        } else {
+            iter++;
+            continue;
+        }
+        iter = conn_list_.erase(iter);
+        free_conn_--;
+    }
     mutex_.unlock();
-    // 释放连接原子加1
-    sem_.post();
 
+    for (MYSQL* conn : broken) {
+        destroy(conn);
+        mutex_.lock();
+        total_conn_--;
+        mutex_.unlock();
+    }
+    for (MYSQL* conn : shrink)
+        destroy(conn);
+
+    // ping一次，失败则关闭，成功的放回时保留放回时间，只更新确认时间
+    for (IdleConn& item : idle) {
+        bool alive = mysql_ping(item.conn) == 0;
+        if (!alive) {
+            LOG_WARN("MySQL: idle connection lost: %s!", mysql_error(item.conn));
+            destroy(item.conn);
+        }
+        mutex_.lock();
+        if (alive) {
+            conn_list_.push_back(IdleConn{ item.conn, item.since, Executor::now_ms() });
+            free_conn_++;
+        } else {
+            total_conn_--;
+        }
+        mutex_.unlock();
+        if (alive)
+            cond_.signal();
+    }
+
+    // 补足最小连接数，等待连接的线程多于空闲连接时也补充，退出时不再建立
+    while (true) {
+        mutex_.lock();
+        bool need = !stop_ && (total_conn_ < min_conn_ || need_dial());
+        if (need)
+            total_conn_++;
+        mutex_.unlock();
+        if (!need)
+            break;
+        MYSQL* conn = connect();
+        long long connected = Executor::now_ms();
+        mutex_.lock();
+        if (conn != nullptr) {
+            conn_list_.push_back(IdleConn{ conn, connected, connected });
+            free_conn_++;
+        } else {
+            total_conn_--;
+        }
+        mutex_.unlock();
+        // 数据库仍不可用，下一秒再试
+        if (conn == nullptr)
+            return false;
+        cond_.signal();
+    }
+    // 非阻塞的调用者没有等在这里，还需要连接时会再次请求
+    mutex_.lock();
+    dial_requests_ = 0;
+    mutex_.unlock();
     return true;
 }
 
+// 取出缓存的预处理语句，按字符串绑定参数并执行
+unsigned int ConnPool::run_stmt(MYSQL* conn, const char* sql, const char* const* params, int param_count, MYSQL_STMT** out) {
+    mutex_.lock();
+    auto iter = stmt_caches_.find(conn);
+    StmtCache* cache = iter != stmt_caches_.end() ? iter->second : nullptr;
+    mutex_.unlock();
+    if (cache == nullptr)
+        return CR_UNKNOWN_ERROR;
+    MYSQL_STMT* stmt = cache->get(sql);
+    if (stmt == nullptr)
+        return mysql_errno(conn) != 0 ? mysql_errno(conn) : CR_UNKNOWN_ERROR;
+
+    // 参数都按字符串绑定
+    vector<MYSQL_BIND> binds(param_count);
+    vector<unsigned long> lengths(param_count);
+    for (int i = 0; i < param_count; i++) {
+        lengths[i] = strlen(params[i]);
+        memset(&binds[i], 0, sizeof(MYSQL_BIND));
+        binds[i].buffer_type = MYSQL_TYPE_STRING;
+        binds[i].buffer = (void*) params[i];
+        binds[i].buffer_length = lengths[i];
+        binds[i].length = &lengths[i];
+    }
+
+    if (mysql_stmt_bind_param(stmt, binds.data()) || mysql_stmt_execute(stmt)) {
+        unsigned int error = mysql_stmt_errno(stmt);
+        // 客户端错误说明连接已断开，语句随之失效，下次重新准备
+        if (error >= CR_MIN_ERROR)
+            cache->drop(sql);
+        return error;
+    }
+    *out = stmt;
+    return 0;
+}
+
+unsigned int ConnPool::execute(MYSQL* conn, const char* sql, const char* const* params, int param_count,
+    char* result, unsigned long result_size, unsigned long long* rows) {
+    MYSQL_STMT* stmt = nullptr;
+    unsigned int error = run_stmt(conn, sql, params, param_count, &stmt);
+    if (error != 0)
+        return error;
+
+    if (result == nullptr) {
+        if (rows != nullptr)
+            *rows = mysql_stmt_affected_rows(stmt);
+        return 0;
+    }
+
+    // 取第一行第一列
+    MYSQL_BIND bind;
+    unsigned long length = 0;
+    bool is_null = false;
+    memset(&bind, 0, sizeof(bind));
+    bind.buffer_type = MYSQL_TYPE_STRING;
+    bind.buffer = result;
+    bind.buffer_length = result_size;
+    bind.length = &length;
+    bind.is_null = &is_null;
+    result[0] = '\0';
+
+    unsigned long long count = 0;
+    if (mysql_stmt_bind_result(stmt, &bind) || mysql_stmt_store_result(stmt)) {
+        error = mysql_stmt_errno(stmt);
+    } else {
+        count = mysql_stmt_num_rows(stmt);
+        int ret = mysql_stmt_fetch(stmt);
+        if ((ret == 0 || ret == MYSQL_DATA_TRUNCATED) && !is_null)
+            result[min(length, result_size - 1)] = '\0';
+    }
+    mysql_stmt_free_result(stmt);
+    if (rows != nullptr)
+        *rows = count;
+    return error;
+}
+
+unsigned int ConnPool::fetch_column(MYSQL* conn, const char* sql, const char* const* params, int param_count,
+    vector<string>* values) {
+    MYSQL_STMT* stmt = nullptr;
+    unsigned int error = run_stmt(conn, sql, params, param_count, &stmt);
+    if (error != 0)
+        return error;
+
+    char buf[256];
+    MYSQL_BIND bind;
+    unsigned long length = 0;
+    bool is_null = false;
+    memset(&bind, 0, sizeof(bind));
+    bind.buffer_type = MYSQL_TYPE_STRING;
+    bind.buffer = buf;
+    bind.buffer_length = sizeof(buf);
+    bind.length = &length;
+    bind.is_null = &is_null;
+
+    if (mysql_stmt_bind_result(stmt, &bind) || mysql_stmt_store_result(stmt)) {
+        error = mysql_stmt_errno(stmt);
+    } else {
+        int ret;
+        while ((ret = mysql_stmt_fetch(stmt)) == 0 || ret == MYSQL_DATA_TRUNCATED) {
+            if (!is_null)
+                values->push_back(string(buf, min(length, (unsigned long) sizeof(buf))));
+        }
+    }
+    mysql_stmt_free_result(stmt);
+    return error;
+}
+
 ConnRaii::ConnRaii(MYSQL** conn, ConnPool* conn_pool) : pool_(conn_pool) {
     *conn = conn_pool->get_conn();
     conn_ = *conn;
@@ -3,42 +3,139 @@
 
 #include "pch.h"
 
+#include "histogram.h"
 #include "lock.h"
 
+/**
+ * @brief 单条连接上的预处理语句缓存，以SQL文本为key
+ * 第一次使用时mysql_stmt_prepare，之后直接绑定参数执行
+ * 只被持有该连接的线程访问，不需要加锁
+ */
+class StmtCache {
+public:
+    explicit StmtCache(MYSQL* conn) : conn_(conn) { }
+    ~StmtCache();
+
+    // 获取预处理语句，没有则先准备
+    MYSQL_STMT* get(const char* sql);
+    // 语句随连接一起失效时移除，下次使用重新准备
+    void drop(const char* sql);
+
+private:
+    MYSQL* conn_;
+    std::unordered_map<std::string, MYSQL_STMT*> stmts_;
+};
+
+/**
+ * @brief 弹性数据库连接池
+ * 启动时只建立min_conn条连接，不够用时按需扩展到max_conn条，建立失败不会退出进程
+ * get_conn最多等待timeout_ms，超时返回nullptr，由调用者返回503；它不建立连接，只唤醒后台线程去建立
+ * 协程里使用try_get_conn，不等待，取不到时请求后台线程建立一条，由调用者挂起后重试
+ * 后台线程建立新连接、关闭断开的连接、回收长期空闲的多余连接，并对空闲连接定期mysql_ping
+ * 连接设置了连接、读、写超时，数据库失去响应时阻塞的调用最多等待timeout_ms取整到秒
+ */
 class ConnPool {
 public:
+    static constexpr int PING_INTERVAL = 30000;     // 空闲超过该时间的连接需要ping，单位ms
+    static constexpr int IDLE_TIMEOUT = 60000;      // 多于min_conn的空闲连接超过该时间被关闭，单位ms
+
     // 局部静态变量单例模式
     static ConnPool* get_instance() {
         static ConnPool conn_pool;
         return &conn_pool;
     }
 
-    void init(std::string url, std::string username, std::string password, std::string db_name, int port, unsigned int max_conn, bool close_log);
-    // 获取数据库连接
-    MYSQL* get_conn();
-    // 释放连接
-    bool rel_conn(MYSQL* conn);
+    void init(std::string url, std::string username, std::string password, std::string db_name, int port,
+        unsigned int min_conn, unsigned int max_conn, bool close_log, int timeout_ms = 500);
+    // 获取数据库连接，等待时间为init时设置的timeout_ms，超时返回nullptr
+    MYSQL* get_conn() {
+        return get_conn(timeout_ms_);
+    }
+    // 获取数据库连接，最多等待timeout_ms，小于0表示一直等待
+    MYSQL* get_conn(int timeout_ms);
+    // 不等待，没有空闲连接时立即返回nullptr，未达到上限则请求后台线程新建一条
+    MYSQL* try_get_conn();
+    // 释放连接，broken为true表示连接已经断开，交给后台线程关闭并补充
+    bool rel_conn(MYSQL* conn, bool broken = false);
+
+    /**
+     * @brief 在conn上执行预处理语句，语句缓存在该连接上
+     * 
+     * @param params 字符串参数，依次绑定到sql中的?
+     * @param result 非空时取第一行第一列，以\0结尾
+     * @param rows 非空时返回取到或影响的行数
+     * @return 0表示成功，否则为mysql_stmt_errno
+     */
+    unsigned int execute(MYSQL* conn, const char* sql, const char* const* params, int param_count,
+        char* result = nullptr, unsigned long result_size = 0, unsigned long long* rows = nullptr);
+    // 执行预处理语句，取出所有行的第一列，返回值同execute
+    unsigned int fetch_column(MYSQL* conn, const char* sql, const char* const* params, int param_count,
+        std::vector<std::string>* values);
 
-    // 获取连接
+    // 获取空闲连接数
     int get_free_conn() {
         return free_conn_;
     }
+    // 获取已使用的连接数
+    int get_curr_conn() {
+        return curr_conn_;
+    }
+    // 获取等待连接的耗时分布，单位us
+    const Histogram& get_wait_histogram() {
+        return wait_histogram_;
+    }
 
 private:
-    ConnPool() = default;
+    // 空闲连接
+    struct IdleConn {
+        MYSQL* conn;
+        long long since;            // 放回连接池的时间，空闲回收按它计算
+        long long alive;            // 最近一次确认连接可用的时间，放回或ping成功时更新
+    };
+
+    ConnPool() : min_conn_(0), max_conn_(0), curr_conn_(0), free_conn_(0), total_conn_(0), waiters_(0), dial_requests_(0),
+        timeout_ms_(500), running_(false), stop_(false) { }
     // 销毁所有连接
     ~ConnPool();
 
+    // 建立一条新连接，失败返回nullptr
+    MYSQL* connect();
+    // 关闭连接并删除其预处理语句缓存
+    void destroy(MYSQL* conn);
+    // 取出缓存的预处理语句，绑定参数并执行，成功时通过out返回语句
+    unsigned int run_stmt(MYSQL* conn, const char* sql, const char* const* params, int param_count, MYSQL_STMT** out);
+    // 后台维护线程
+    static void* maintain_thread(void* arg);
+    // 执行一轮维护，建立连接失败时返回false
+    bool maintain();
+    // 需要为等待者新建连接，调用时需持有mutex_
+    bool need_dial() const {
+        return waiters_ + dial_requests_ > free_conn_ && total_conn_ < max_conn_;
+    }
+
+    int min_conn_;                  // 最小连接数
     int max_conn_;                  // 最大连接数
     int curr_conn_;                 // 当前已使用的连接数
     int free_conn_;                 // 当前空闲的连接数
+    int total_conn_;                // 已建立和正在建立的连接总数
+    int waiters_;                   // 正在等待连接的线程数
+    int dial_requests_;             // try_get_conn取不到连接的次数，每轮维护后清零，最多max_conn
+    int timeout_ms_;                // 获取连接的默认等待时间，也用于连接、读、写超时
 
     Mutex mutex_;
-    std::list<MYSQL*> conn_list_;   // 连接池
-    Sem sem_;
+    Cond cond_;                     // 有连接放回或者新建时通知等待者
+    Cond maintain_cond_;            // 有线程在等待连接或者退出时唤醒后台线程
+    bool running_;
+    bool stop_;                     // 后台线程退出，由mutex_保护
+    pthread_t tid_;
+    std::list<IdleConn> conn_list_; // 空闲连接
+    std::list<MYSQL*> broken_list_; // 等待后台关闭的断开连接
+    // 每条连接的预处理语句缓存，连接建立和关闭时在mutex_内修改
+    std::unordered_map<MYSQL*, StmtCache*> stmt_caches_;
+    Histogram wait_histogram_;      // 获取连接的等待耗时
 
     std::string url_;               // 主机地址
-    std::string port_;              // 数据库端口号
+    int port_;                      // 数据库端口号
     std::string username_;          // 登录数据库用户名
     std::string password_;          // 登录数据库密码
     std::string db_name_;           // 使用数据库名
@@ -0,0 +1,183 @@
+#include <mysql/mysqld_error.h>
+
+#include "executor.h"
+#include "log.h"
+
+#include "register_batcher.h"
+
+using namespace std;
+
+void RegisterBatcher::SubmitAwaiter::await_suspend(coroutine_handle<> handle) {
+    pending_.handle = handle;
+    pending_.enqueue_ms = Executor::now_ms();
+    // 在锁内通知，解锁后批量线程随时可能恢复协程，不能再访问this
+    batcher_->mutex_.lock();
+    batcher_->queue_.push_back(&pending_);
+    int size = batcher_->queue_.size();
+    if (size == 1 || size >= batcher_->max_batch_)
+        batcher_->cond_.signal();
+    batcher_->mutex_.unlock();
+}
+
+RegisterBatcher::~RegisterBatcher() {
+    if (running_) {
+        // 通知批量线程写完已提交的注册后退出，阻塞在条件变量上的线程不能留到它析构之后
+        mutex_.lock();
+        stop_ = true;
+        mutex_.unlock();
+        cond_.signal();
+        pthread_join(tid_, nullptr);
+    }
+}
+
+void RegisterBatcher::init(ConnPool* conn_pool, int window_ms, int max_batch) {
+    conn_pool_ = conn_pool;
+    window_ms_ = window_ms > 0 ? window_ms : 0;
+    max_batch_ = max_batch > 0 ? max_batch : 1;
+
+    running_ = pthread_create(&tid_, nullptr, worker, this) == 0;
+}
+
+void* RegisterBatcher::worker(void* arg) {
+    RegisterBatcher* batcher = (RegisterBatcher*) arg;
+    batcher->run();
+    return nullptr;
+}
+
+void RegisterBatcher::run() {
+    Executor* executor = Executor::get_instance();
+    vector<Pending*> batch;
+    while (true) {
+        mutex_.lock();
+        while (queue_.empty() && !stop_)
+            cond_.wait(mutex_.get());
+        if (queue_.empty()) {
+            mutex_.unlock();
+            break;
+        }
+
+        // 从最早的一条开始攒window_ms毫秒，凑够max_batch条提前发送，退出时不再等待
+        long long deadline = queue_.front()->enqueue_ms + window_ms_;
+        while ((int) queue_.size() < max_batch_ && !stop_) {
+            long long remain = deadline - Executor::now_ms();
+            if (remain <= 0)
+                break;
+            struct timespec t;
+            clock_gettime(CLOCK_REALTIME, &t);
+            t.tv_nsec += remain * 1000000;
+            t.tv_sec += t.tv_nsec / 1000000000;
+            t.tv_nsec %= 1000000000;
+            cond_.timewait(mutex_.get(), t);
+        }
+        while (!queue_.empty() && (int) batch.size() < max_batch_) {
+            batch.push_back(queue_.front());
+            queue_.pop_front();
+        }
+        mutex_.unlock();
+
+        flush(batch);
+        // 交回执行器之后协程可能立即恢复并销毁Pending，先取出handle
+        for (Pending* pending : batch)
+            executor->post(pending->handle);
+        batch.clear();
+    }
+}
+
+void RegisterBatcher::flush(vector<Pending*>& batch) {
+    for (Pending* pending : batch)
+        pending->status = UNAVAILABLE;
+    MYSQL* conn = conn_pool_->get_conn();
+    if (conn == nullptr)
+        return;
+
+    // 同一批内重名的，只有第一个参与插入
+    vector<Pending*> rows;
+    for (Pending* pending : batch) {
+        bool dup = false;
+        for (Pending* row : rows) {
+            if (strcmp(row->name, pending->name) == 0) {
+                dup = true;
+                break;
+            }
+        }
+        if (dup)
+            pending->status = DUPLICATE;
+        else
+            rows.push_back(pending);
+    }
+
+    unsigned int error = insert_rows(conn, rows.data(), rows.size());
+    // 检查之后仍然撞上唯一键(比如大小写不敏感的排序规则)，逐行重试以区分各自的结果
+    if (error == ER_DUP_ENTRY) {
+        for (Pending* row : rows) {
+            error = insert_rows(conn, &row, 1);
+            if (error == ER_DUP_ENTRY)
+                row->status = DUPLICATE;
+            else if (error >= CR_MIN_ERROR)
+                break;
+            else if (error != 0)
+                row->status = FAILED;
+        }
+    } else if (error != 0 && error < CR_MIN_ERROR) {
+        for (Pending* row : rows)
+            row->status = FAILED;
+    }
+
+    if (error != 0 && error != ER_DUP_ENTRY)
+        LOG_ERROR("MySQL register batch of %d error: %u!", (int) rows.size(), error);
+    // 客户端错误说明连接已断开，交给连接池重连，剩下的请求返回不可用
+    conn_pool_->rel_conn(conn, error >= CR_MIN_ERROR);
+}
+
+unsigned int RegisterBatcher::insert_rows(MYSQL* conn, Pending** rows, int count) {
+    if (count == 0)
+        return 0;
+    if (mysql_autocommit(conn, false))
+        return mysql_errno(conn);
+
+    // 锁住这批用户名，找出已经存在的
+    string sql = "SELECT username FROM user WHERE username IN (";
+    vector<const char*> params;
+    for (int i = 0; i < count; i++) {
+        sql += i == 0 ? "?" : ", ?";
+        params.push_back(rows[i]->name);
+    }
+    sql += ") FOR UPDATE";
+    vector<string> exists;
+    unsigned int error = conn_pool_->fetch_column(conn, sql.c_str(), params.data(), count, &exists);
+
+    // 其余的用一条多行INSERT写入
+    vector<Pending*> fresh;
+    if (error == 0) {
+        for (int i = 0; i < count; i++) {
+            if (find(exists.begin(), exists.end(), rows[i]->name) == exists.end())
+                fresh.push_back(rows[i]);
+        }
+    }
+    if (error == 0 && !fresh.empty()) {
+        sql = "INSERT INTO user(username, passwd) VALUES";
+        params.clear();
+        for (size_t i = 0; i < fresh.size(); i++) {
+            sql += i == 0 ? "(?, ?)" : ", (?, ?)";
+            params.push_back(fresh[i]->name);
+            params.push_back(fresh[i]->password);
+        }
+        error = conn_pool_->execute(conn, sql.c_str(), params.data(), params.size());
+    }
+
+    if (error == 0 && mysql_commit(conn))
+        error = mysql_errno(conn);
+    // 提交成功才设置结果，失败时由调用者决定重试或者返回错误
+    if (error == 0) {
+        for (int i = 0; i < count; i++)
+            rows[i]->status = DUPLICATE;
+        for (Pending* row : fresh)
+            row->status = REGISTERED;
+    } else {
+        mysql_rollback(conn);
+    }
+    // 恢复自动提交失败说明连接已断开，返回客户端错误让调用者丢弃连接
+    if (mysql_autocommit(conn, true) && error == 0)
+        error = mysql_errno(conn);
+    return error;
+}
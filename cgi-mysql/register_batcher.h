@@ -0,0 +1,87 @@
+#ifndef REGISTER_BATCHER_H
+#define REGISTER_BATCHER_H
+
+#include "pch.h"
+
+#include "lock.h"
+#include "mysql_conn.h"
+
+/**
+ * @brief 注册请求的批量写入器
+ * 请求协程提交用户名和密码后挂起，后台线程攒够window_ms毫秒或者max_batch条后
+ * 在一个事务里先SELECT ... FOR UPDATE找出已存在的用户名，再用一条多行INSERT写入其余的，最后一次COMMIT
+ * 每个请求各自得到注册成功或重名的结果，插入吞吐随批量大小增长，而不是受限于每次提交的延迟
+ */
+class RegisterBatcher {
+public:
+    enum Status {
+        REGISTERED,     // 注册成功
+        DUPLICATE,      // 用户名已存在
+        UNAVAILABLE,    // 没有可用的数据库连接，调用者应返回503
+        FAILED          // 其他数据库错误
+    };
+
+private:
+    struct Pending {
+        const char* name;
+        const char* password;
+        long long enqueue_ms;                   // 提交时间，批次窗口从最早的提交开始计算
+        Status status;
+        std::coroutine_handle<> handle;
+    };
+
+public:
+    // 请求协程提交注册时使用，挂起后由批量线程交回执行器恢复
+    class SubmitAwaiter {
+    public:
+        SubmitAwaiter(RegisterBatcher* batcher, const char* name, const char* password)
+            : batcher_(batcher), pending_{ name, password, 0, UNAVAILABLE, nullptr } { }
+
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(std::coroutine_handle<> handle);
+        Status await_resume() const noexcept { return pending_.status; }
+
+    private:
+        RegisterBatcher* batcher_;
+        Pending pending_;
+    };
+
+    // 局部静态变量单例模式
+    static RegisterBatcher* get_instance() {
+        static RegisterBatcher register_batcher;
+        return &register_batcher;
+    }
+
+    // 启动批量线程，每批最多等待window_ms毫秒、最多max_batch条
+    void init(ConnPool* conn_pool, int window_ms = 5, int max_batch = 64);
+
+    // 提交一条注册并挂起，name和password在恢复之前必须有效
+    SubmitAwaiter submit(const char* name, const char* password) {
+        return SubmitAwaiter(this, name, password);
+    }
+
+private:
+    RegisterBatcher() : conn_pool_(nullptr), window_ms_(5), max_batch_(64), running_(false), stop_(false) { }
+    ~RegisterBatcher();
+
+    // 后台批量线程
+    static void* worker(void* arg);
+    void run();
+    // 写入一批注册，设置每条的结果
+    void flush(std::vector<Pending*>& batch);
+    // 在一个事务里检查重名并插入rows，提交成功后才设置结果，返回0或mysql错误码
+    unsigned int insert_rows(MYSQL* conn, Pending** rows, int count);
+
+    ConnPool* conn_pool_;
+    int window_ms_;
+    int max_batch_;
+
+    Mutex mutex_;                               // 保护queue_和stop_
+    Cond cond_;                                 // 有新的注册或者凑够一批时通知批量线程
+    std::list<Pending*> queue_;                 // 等待写入的注册
+    bool running_;
+    bool stop_;
+    pthread_t tid_;
+};
+
+#endif
@@ -4,7 +4,7 @@
 // 端口号，默认81
 int Config::port_ = 81;
 // 日志写入方式，默认同步
-bool Config::write_log_ = false;
+int Config::write_log_ = 0;
 // 触发组合模式，默认listenfd LT + connfd LT
 int Config::trig_mode_ = 0;
 // listenfd触发模式，默认LT
@@ -15,25 +15,67 @@ bool Config::connfd_trig_mode_ = false;
 bool Config::opt_linger_ = false;
 // 数据库连接池容量，默认8
 int Config::conn_pool_size_ = 8;
+// 数据库连接池最小连接数，默认4
+int Config::conn_pool_min_ = 4;
 // 线程池容量，默认8
 int Config::thread_pool_size_ = 8;
 // 关闭日志，默认不关闭
 bool Config::close_log_ = false;
 // 并发模型，默认是proactor
 bool Config::actor_pattern_ = false;
+// 启动时按快照预热用户缓存，默认不预热
+bool Config::warm_up_ = false;
+// 用户存储后端，默认MySQL
+int Config::user_store_ = 0;
+// 运行期最低日志级别，默认INFO
+int Config::log_level_ = 1;
+// 记录访问日志，默认记录
+bool Config::access_log_ = true;
+// 慢请求阈值，单位ms，默认200
+int Config::slow_ms_ = 200;
+// 捕获原始请求用于回放，默认不捕获
+bool Config::capture_ = false;
+// 请求在请求队列中等待的上限，单位ms，默认5000
+int Config::deadline_ms_ = 5000;
+// 请求队列排队延迟超过该值时拒绝新请求，单位ms，默认500
+int Config::overload_ms_ = 500;
+// 每个IP每秒的请求数和新建连接数，默认不限
+int Config::ip_rate_ = 0;
+// 每个IP的并发连接数，默认不限
+int Config::ip_conns_ = 0;
+// 请求头的截止时间，单位ms，默认10000
+int Config::header_ms_ = 10000;
+// 请求体的截止时间，单位ms，默认20000
+int Config::body_ms_ = 20000;
+// 发送响应的最低速率，单位字节/s，默认1024
+int Config::min_send_rate_ = 1024;
 
 
 void Config::parse_arg(int argc, char* argv[]) {
     int opt = 0;
-    const char str[] = "p:w:m:o:c:t:l:a:";
+    const char str[] = "p:w:m:o:c:n:t:l:a:u:b:v:r:s:x:d:q:i:j:h:e:z:";
     while ((opt = getopt(argc, argv, str)) != -1) {
         if (opt == 'p') port_ = atoi(optarg);
         if (opt == 'w') write_log_ = atoi(optarg);
         if (opt == 'm') trig_mode_ = atoi(optarg);
         if (opt == 'o') opt_linger_ = atoi(optarg);
         if (opt == 'c') conn_pool_size_ = atoi(optarg);
+        if (opt == 'n') conn_pool_min_ = atoi(optarg);
         if (opt == 't') thread_pool_size_ = atoi(optarg);
         if (opt == 'l') close_log_ = atoi(optarg);
         if (opt == 'a') actor_pattern_ = atoi(optarg);
+        if (opt == 'u') warm_up_ = atoi(optarg);
+        if (opt == 'b') user_store_ = atoi(optarg);
+        if (opt == 'v') log_level_ = atoi(optarg);
+        if (opt == 'r') access_log_ = atoi(optarg);
+        if (opt == 's') slow_ms_ = atoi(optarg);
+        if (opt == 'x') capture_ = atoi(optarg);
+        if (opt == 'd') deadline_ms_ = atoi(optarg);
+        if (opt == 'q') overload_ms_ = atoi(optarg);
+        if (opt == 'i') ip_rate_ = atoi(optarg);
+        if (opt == 'j') ip_conns_ = atoi(optarg);
+        if (opt == 'h') header_ms_ = atoi(optarg);
+        if (opt == 'e') body_ms_ = atoi(optarg);
+        if (opt == 'z') min_send_rate_ = atoi(optarg);
     }
 }
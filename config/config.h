@@ -12,7 +12,7 @@ public:
     // 端口号，默认81
     static int port_;
     // 日志写入方式，默认同步
-    static bool write_log_;
+    static int write_log_;
     // 触发组合模式，默认listenfd LT + connfd LT
     static int trig_mode_;
     // listenfd触发模式，默认LT
@@ -23,12 +23,40 @@ public:
     static bool opt_linger_;
     // 数据库连接池容量，默认8
     static int conn_pool_size_;
+    // 数据库连接池最小连接数，默认4
+    static int conn_pool_min_;
     // 线程池容量，默认8
     static int thread_pool_size_;
     // 关闭日志，默认不关闭
     static bool close_log_;
     // 并发模型，默认是proactor
     static bool actor_pattern_;
+    // 启动时按快照预热用户缓存，默认不预热
+    static bool warm_up_;
+    // 用户存储后端，默认MySQL
+    static int user_store_;
+    // 运行期最低日志级别，默认INFO
+    static int log_level_;
+    // 记录访问日志，默认记录
+    static bool access_log_;
+    // 慢请求阈值，单位ms，默认200
+    static int slow_ms_;
+    // 捕获原始请求用于回放，默认不捕获
+    static bool capture_;
+    // 请求在请求队列中等待的上限，单位ms，默认5000
+    static int deadline_ms_;
+    // 请求队列排队延迟超过该值时拒绝新请求，单位ms，默认500
+    static int overload_ms_;
+    // 每个IP每秒的请求数和新建连接数，默认不限
+    static int ip_rate_;
+    // 每个IP的并发连接数，默认不限
+    static int ip_conns_;
+    // 请求头的截止时间，单位ms，默认10000
+    static int header_ms_;
+    // 请求体的截止时间，单位ms，默认20000
+    static int body_ms_;
+    // 发送响应的最低速率，单位字节/s，默认1024
+    static int min_send_rate_;
 };
 
 
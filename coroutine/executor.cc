@@ -0,0 +1,113 @@
+#include "executor.h"
+
+using namespace std;
+
+Executor::Executor() : epollfd_(-1), wakefd_(-1) {
+    waiters_ = new atomic<void*>[MAX_FD];
+    for (int i = 0; i < MAX_FD; i++)
+        waiters_[i].store(nullptr, memory_order_relaxed);
+}
+
+Executor::~Executor() {
+    if (wakefd_ != -1)
+        close(wakefd_);
+    delete[] waiters_;
+}
+
+void Executor::init(int epollfd, function<void(coroutine_handle<>)> post) {
+    epollfd_ = epollfd;
+    post_ = post;
+
+    wakefd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wakefd_ == -1) {
+        STDERR_FUNC_LINE();
+        exit(EXIT_FAILURE);
+    }
+    epoll_event event;
+    event.data.fd = wakefd_;
+    event.events = EPOLLIN;
+    epoll_ctl(epollfd_, EPOLL_CTL_ADD, wakefd_, &event);
+}
+
+long long Executor::now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+// 先登记协程再注册事件，保证事件到来时一定能找到等待者
+// fd可能是第一次等待，也可能被关闭后复用，MOD失败时改用ADD
+void Executor::arm(int fd, uint32_t events, coroutine_handle<> handle) {
+    waiters_[fd].store(handle.address(), memory_order_release);
+
+    epoll_event event;
+    event.data.fd = fd;
+    event.events = events | EPOLLONESHOT | EPOLLRDHUP;
+    if (epoll_ctl(epollfd_, EPOLL_CTL_MOD, fd, &event) == -1 && errno == ENOENT)
+        epoll_ctl(epollfd_, EPOLL_CTL_ADD, fd, &event);
+}
+
+void Executor::add_timer(int ms, coroutine_handle<> handle) {
+    long long expire = now_ms() + ms;
+    timer_mutex_.lock();
+    bool earliest = timers_.empty() || expire < timers_.top().first;
+    timers_.push(TimerEntry(expire, handle.address()));
+    timer_mutex_.unlock();
+    // 新定时器比之前的都早，需要让事件循环重新计算超时时间
+    if (earliest)
+        wake();
+}
+
+void Executor::wake() {
+    uint64_t one = 1;
+    ::write(wakefd_, &one, sizeof(one));
+}
+
+bool Executor::dispatch(int fd) {
+    if (fd == wakefd_) {
+        uint64_t count;
+        ::read(wakefd_, &count, sizeof(count));
+        return true;
+    }
+    if (fd < 0 || fd >= MAX_FD || waiters_[fd].load(memory_order_relaxed) == nullptr)
+        return false;
+    void* address = waiters_[fd].exchange(nullptr, memory_order_acquire);
+    if (address == nullptr)
+        return false;
+    post(coroutine_handle<>::from_address(address));
+    return true;
+}
+
+int Executor::next_timeout() {
+    timer_mutex_.lock();
+    if (timers_.empty()) {
+        timer_mutex_.unlock();
+        return -1;
+    }
+    long long expire = timers_.top().first;
+    timer_mutex_.unlock();
+    long long timeout = expire - now_ms();
+    return timeout > 0 ? (int) timeout : 0;
+}
+
+void Executor::run_timers() {
+    long long now = now_ms();
+    while (true) {
+        timer_mutex_.lock();
+        if (timers_.empty() || timers_.top().first > now) {
+            timer_mutex_.unlock();
+            break;
+        }
+        void* address = timers_.top().second;
+        timers_.pop();
+        timer_mutex_.unlock();
+        post(coroutine_handle<>::from_address(address));
+    }
+}
+
+void Executor::post(coroutine_handle<> handle) {
+    if (post_)
+        post_(handle);
+    else
+        handle.resume();
+}
@@ -0,0 +1,104 @@
+#ifndef EXECUTOR_H
+#define EXECUTOR_H
+
+#include "pch.h"
+
+#include "lock.h"
+
+/**
+ * @brief 协程执行器，挂在主线程的epoll事件循环上
+ * 协程co_await某个fd就绪或者定时器时挂起，不再占用工作线程
+ * 事件循环发现fd就绪或者定时器到期后，通过post_把协程交回线程池恢复执行
+ */
+class Executor {
+public:
+    static constexpr int MAX_FD = 65536;
+
+    // 局部静态变量单例模式
+    static Executor* get_instance() {
+        static Executor executor;
+        return &executor;
+    }
+
+    // 等待fd上的事件，使用EPOLLONESHOT注册，每次co_await只恢复一次
+    class FdAwaiter {
+    public:
+        FdAwaiter(Executor* executor, int fd, uint32_t events)
+            : executor_(executor), fd_(fd), events_(events) { }
+
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(std::coroutine_handle<> handle) {
+            executor_->arm(fd_, events_, handle);
+        }
+        void await_resume() const noexcept { }
+
+    private:
+        Executor* executor_;
+        int fd_;
+        uint32_t events_;
+    };
+
+    // 等待一段时间，单位ms
+    class SleepAwaiter {
+    public:
+        SleepAwaiter(Executor* executor, int ms) : executor_(executor), ms_(ms) { }
+
+        bool await_ready() const noexcept { return ms_ <= 0; }
+        void await_suspend(std::coroutine_handle<> handle) {
+            executor_->add_timer(ms_, handle);
+        }
+        void await_resume() const noexcept { }
+
+    private:
+        Executor* executor_;
+        int ms_;
+    };
+
+    // 绑定事件循环的epollfd，post为把就绪协程交给工作线程的函数
+    void init(int epollfd, std::function<void(std::coroutine_handle<>)> post);
+
+    FdAwaiter readable(int fd) {
+        return FdAwaiter(this, fd, EPOLLIN);
+    }
+    FdAwaiter writable(int fd) {
+        return FdAwaiter(this, fd, EPOLLOUT);
+    }
+    SleepAwaiter sleep(int ms) {
+        return SleepAwaiter(this, ms);
+    }
+
+    // 以下由事件循环调用
+    // fd上有协程在等待，则调度该协程并返回true
+    bool dispatch(int fd);
+    // epoll_wait的超时时间，没有定时器时为-1
+    int next_timeout();
+    // 调度所有到期的定时器
+    void run_timers();
+
+    // 调度一个就绪的协程，未绑定线程池时直接在当前线程恢复
+    void post(std::coroutine_handle<> handle);
+
+    // 单调时钟，单位ms
+    static long long now_ms();
+
+private:
+    Executor();
+    ~Executor();
+
+    void arm(int fd, uint32_t events, std::coroutine_handle<> handle);
+    void add_timer(int ms, std::coroutine_handle<> handle);
+    // 唤醒阻塞在epoll_wait上的事件循环
+    void wake();
+
+    typedef std::pair<long long, void*> TimerEntry;
+
+    int epollfd_;
+    int wakefd_;                                        // eventfd，用于唤醒事件循环
+    std::function<void(std::coroutine_handle<>)> post_;
+    std::atomic<void*>* waiters_;                       // 每个fd上挂起的协程
+
+    Mutex timer_mutex_;                                 // 保护定时器堆
+    std::priority_queue<TimerEntry, std::vector<TimerEntry>, std::greater<TimerEntry>> timers_;
+};
+
+#endif
@@ -0,0 +1,161 @@
+#ifndef TASK_H
+#define TASK_H
+
+#include "pch.h"
+
+/**
+ * @brief 惰性启动的协程任务，创建后处于挂起状态，需要resume或者被co_await才会执行
+ * 被co_await时记录调用者作为continuation，结束时通过对称转移直接恢复调用者
+ * 作为根任务时没有continuation，结束后停在final_suspend，由持有者负责销毁协程帧
+ * 根任务可以设置结束回调，在协程挂起到final_suspend之后调用，回调之后其他线程可以安全地销毁协程帧
+ * 协程的第一个参数(成员函数协程是对象本身)提供get_arena()时，协程帧从它的arena中分配，否则从堆上分配
+ */
+template <typename T>
+class Task;
+
+namespace detail {
+
+// 协程结束时的awaiter，有continuation则转移回调用者，否则调用结束回调，返回到resume的地方
+struct FinalAwaiter {
+    bool await_ready() noexcept { return false; }
+
+    template <typename Promise>
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept {
+        std::coroutine_handle<> continuation = handle.promise().continuation_;
+        if (continuation)
+            return continuation;
+        // 回调可能让其他线程销毁协程帧，之后不能再访问promise
+        void (*on_done)(void*) = handle.promise().on_done_;
+        if (on_done)
+            on_done(handle.promise().on_done_arg_);
+        return std::noop_coroutine();
+    }
+
+    void await_resume() noexcept { }
+};
+
+// 协程帧后面多分配一个字节，记录帧是否在arena中
+// 编译器释放协程帧时传入和分配时相同的大小，据此找到这个字节
+struct PromiseBase {
+    static void* operator new(size_t size) {
+        char* frame = (char*) ::operator new(size + 1);
+        frame[size] = false;
+        return frame;
+    }
+
+    // arena剩余空间不够时回落到堆
+    template <typename Owner, typename... Args>
+        requires requires(Owner& owner, size_t size) { owner.get_arena().alloc(size); }
+    static void* operator new(size_t size, Owner& owner, Args&...) {
+        char* frame = (char*) owner.get_arena().alloc(size + 1);
+        if (frame == nullptr)
+            return operator new(size);
+        frame[size] = true;
+        return frame;
+    }
+
+    // arena中的协程帧随arena整体重置，不单独释放
+    static void operator delete(void* ptr, size_t size) {
+        if (!((char*) ptr)[size])
+            ::operator delete(ptr);
+    }
+
+    std::suspend_always initial_suspend() noexcept { return { }; }
+    FinalAwaiter final_suspend() noexcept { return { }; }
+    void unhandled_exception() { std::terminate(); }
+
+    std::coroutine_handle<> continuation_;  // co_await该任务的协程
+    void (*on_done_)(void*) = nullptr;      // 根任务的结束回调
+    void* on_done_arg_ = nullptr;
+};
+
+template <typename T>
+struct Promise : PromiseBase {
+    Task<T> get_return_object();
+    void return_value(T value) { value_ = value; }
+
+    T value_;
+};
+
+template <>
+struct Promise<void> : PromiseBase {
+    Task<void> get_return_object();
+    void return_void() { }
+};
+
+} // namespace detail
+
+template <typename T = void>
+class Task {
+public:
+    using promise_type = detail::Promise<T>;
+    using handle_type = std::coroutine_handle<promise_type>;
+
+    Task() : handle_(nullptr) { }
+    explicit Task(handle_type handle) : handle_(handle) { }
+    Task(Task&& other) noexcept : handle_(other.handle_) { other.handle_ = nullptr; }
+    Task(const Task&) = delete;
+
+    Task& operator=(Task&& other) noexcept {
+        if (this != &other) {
+            if (handle_)
+                handle_.destroy();
+            handle_ = other.handle_;
+            other.handle_ = nullptr;
+        }
+        return *this;
+    }
+    Task& operator=(const Task&) = delete;
+
+    ~Task() {
+        if (handle_)
+            handle_.destroy();
+    }
+
+    // 设置根任务的结束回调，在resume之前调用
+    void on_done(void (*callback)(void*), void* arg) {
+        handle_.promise().on_done_ = callback;
+        handle_.promise().on_done_arg_ = arg;
+    }
+
+    // 作为根任务启动或继续执行
+    void resume() {
+        if (handle_ && !handle_.done())
+            handle_.resume();
+    }
+
+    bool done() const {
+        return handle_ == nullptr || handle_.done();
+    }
+
+    // 被co_await时，先记录调用者，再对称转移到本任务执行
+    bool await_ready() const noexcept { return false; }
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller) noexcept {
+        handle_.promise().continuation_ = caller;
+        return handle_;
+    }
+
+    T await_resume() {
+        if constexpr (!std::is_void_v<T>)
+            return handle_.promise().value_;
+    }
+
+private:
+    handle_type handle_;
+};
+
+namespace detail {
+
+template <typename T>
+Task<T> Promise<T>::get_return_object() {
+    return Task<T>(std::coroutine_handle<Promise<T>>::from_promise(*this));
+}
+
+inline Task<void> Promise<void>::get_return_object() {
+    return Task<void>(std::coroutine_handle<Promise<void>>::from_promise(*this));
+}
+
+} // namespace detail
+
+#endif
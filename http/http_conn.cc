@@ -1,6 +1,7 @@
 #include "log.h"
 
 #include "http_conn.h"
+#include "usdt.h"
 #include "pch.h"
 #include <cerrno>
 #include <cstdio>
@@ -14,20 +15,33 @@ constexpr char ERROR_403_TITLE[] = "Forbidden";
 constexpr char ERROR_403_FORM[] = "You do not have permission to get file form this server.\n";
 constexpr char ERROR_404_TITLE[] = "Not Found";
 constexpr char ERROR_404_FORM[] = "The requested file was not found on this server.\n";
+constexpr char ERROR_429_TITLE[] = "Too Many Requests";
+constexpr char ERROR_429_FORM[] = "You have sent too many requests, please retry later.\n";
 constexpr char ERROR_500_TITLE[] = "Internal Error";
 constexpr char ERROR_500_FORM[] = "There was an unusual problem serving the request file.\n";
+constexpr char ERROR_503_TITLE[] = "Service Unavailable";
+constexpr char ERROR_503_FORM[] = "The server is temporarily unable to handle the request.\n";
 
-unordered_map<string, string> users;
-Mutex mutex;
-
-int HttpConn::user_count_ = 0;
+atomic<int> HttpConn::user_count_(0);
 int HttpConn::epollfd_ = -1;
+int HttpConn::header_ms_ = 0;
+int HttpConn::body_ms_ = 0;
+int HttpConn::min_send_rate_ = 0;
+
+string_view HttpConn::overload_response() {
+    static const string response = [] {
+        char buf[256];
+        int len = snprintf(buf, sizeof(buf), "HTTP/1.1 503 %s\r\nRetry-After:%d\r\nContent-Length:%d\r\nConnection:close\r\n\r\n%s",
+            ERROR_503_TITLE, RETRY_AFTER, (int) strlen(ERROR_503_FORM), ERROR_503_FORM);
+        return string(buf, len);
+    }();
+    return response;
+}
 
 
 // 初始化新接收的连接
 // check_state_默认为分析请求行状态
 void HttpConn::init() {
-    mysql_ = nullptr;
     bytes_sent_ = 0;
     bytes_unsent_ = 0;
     check_state_ = CHECK_STATE_REQUEST_LINE;
@@ -45,6 +59,13 @@ void HttpConn::init() {
     state_ = false;
     timer_flag_ = false;
     improve_ = false;
+    parsed_us_ = 0;
+    handled_us_ = 0;
+    status_ = 0;
+    body_ = nullptr;
+    metrics_body_.clear();
+    header_deadline_us_.store(0, memory_order_relaxed);
+    body_deadline_us_.store(0, memory_order_relaxed);
 
     bzero(read_buf_, READ_BUFFER_SIZE);
     bzero(write_buf_, WRITE_BUFFER_SIZE);
@@ -55,13 +76,19 @@ void HttpConn::init() {
 void HttpConn::init(int sockfd, const sockaddr_in& addr, const char* root_dir, bool trig_mode, bool close_log, string username, string password, string db_name) {
     sockfd_ = sockfd;
     address_ = addr;
+    inet_ntop(AF_INET, &addr.sin_addr, ip_, sizeof(ip_));
+    enqueue_us_ = 0;
+    start_us_ = 0;
+    dispatch_us_ = 0;
+    read_us_ = 0;
+    capture_conn_ = Capture::get_instance()->open_conn(addr);
+    pins_.store(0, memory_order_relaxed);
 
     Utils::add_fd(epollfd_, sockfd_, true, trig_mode);
     user_count_++;
 
     // 当浏览器出现连接重置时，可能时网站根目录出错或http响应格式出错，或者访问的文件中内容完全为空
     root_dir_ = root_dir;
-    trig_mode_ = trig_mode;
     close_log_ = close_log;
 
     strcpy(username_, username.c_str());
@@ -71,45 +98,83 @@ void HttpConn::init(int sockfd, const sockaddr_in& addr, const char* root_dir, b
     init();
 }
 
-void HttpConn::init_mysql_result(ConnPool* conn_pool) {
-    // 先从连接池取一个连接
-    MYSQL* mysql = nullptr;
-    ConnRaii mysql_conn(&mysql, conn_pool);
-    // 在user表中检索username，passwd数据，浏览器端输入
-    if (mysql_query(mysql, "SELECT username, passwd FROM user"))
-        LOG_ERROR("SELECT error: %s!", mysql_error(mysql));
-    // 从表中检索完整的结果集
-    MYSQL_RES* result = mysql_store_result(mysql);
-    // 返回结果集中的列数
-    int numfields = mysql_num_fields(result);
-    // 返回所有字段结构的数组
-    MYSQL_FIELD* fields = mysql_fetch_fields(result);
-    // 从结果集中获取下一行，将对应的用户名和密码，存入map中
-    while (MYSQL_ROW row = mysql_fetch_row(result)) {
-        string temp1(row[0]);
-        string temp2(row[1]);
-        users[temp1] = temp2;
-    }
+// 关闭连接，定时器到期和主线程的各种关闭都经过这里，重复调用时什么也不做
+// 先让请求队列中的任务失效，工作线程还持有连接时由它在最后一次unpin时完成关闭
+void HttpConn::close_conn(bool real_close) {
+    if (!real_close)
+        return;
+    int pins = pins_.fetch_or(CLOSING, memory_order_acq_rel);
+    if (pins & CLOSING)
+        return;
+    retire();
+    if (pins < PIN)
+        shut();
 }
 
-// 关闭连接，关闭一个连接，客户总量减一
-void HttpConn::close_conn(bool real_close) {
-    if (real_close && (sockfd_ != -1)) {
-        Utils::remove_fd(epollfd_, sockfd_);
-        sockfd_ = -1;
-        user_count_--;
-    }
+void HttpConn::unpin() {
+    if (pins_.fetch_sub(PIN, memory_order_acq_rel) == (PIN | CLOSING))
+        shut();
+}
+
+// 注销事件并关闭fd，客户总量减一，归还限流计数
+// fd关闭后可能立即被新连接复用，主线程会重新初始化本对象，所以最后才关闭fd
+void HttpConn::shut() {
+    int sockfd = sockfd_;
+    sockfd_ = -1;
+    Capture::get_instance()->write(capture_conn_, Capture::CLOSE, nullptr, 0);
+    RateLimiter::get_instance()->release(address_.sin_addr.s_addr);
+    user_count_--;
+    Utils::remove_fd(epollfd_, sockfd);
 }
 
 // 循环读取客户端数据，直到无数据可读，或对方关闭连接
 // 非阻塞ET工作模式下，需要一次性将数据读完
+template <typename Trigger>
 bool HttpConn::read_once() {
+    long long start = AccessLog::now_us();
+    int read_idx = read_idx_;
+    bool ret = recv_all<Trigger>();
+    // 捕获这次读到的原始字节
+    if (read_idx_ > read_idx)
+        Capture::get_instance()->write(capture_conn_, Capture::DATA, read_buf_ + read_idx, read_idx_ - read_idx);
+    read_us_ = AccessLog::now_us() - start;
+    Metrics::get_instance()->observe(Metrics::STAGE_READ, read_us_);
+    // 请求头的截止时间从新请求的第一个字节算起，之后的读取不再延后
+    if (read_idx == 0 && read_idx_ > 0 && header_ms_ > 0)
+        header_deadline_us_.store(start + header_ms_ * 1000LL, memory_order_relaxed);
+    // 超过截止时间的连接按读取失败关闭，发送RST直接回收
+    if (ret && read_overdue(start + read_us_)) {
+        Utils::set_reset(sockfd_);
+        ret = false;
+    }
+    USDT(read, sockfd_, read_idx_, read_us_, (int) ret);
+    return ret;
+}
+
+bool HttpConn::read_overdue(long long now, Metrics::Counter* reason) const {
+    long long header = header_deadline_us_.load(memory_order_relaxed);
+    long long body = body_deadline_us_.load(memory_order_relaxed);
+    if (header > 0 && now > header) {
+        if (reason)
+            *reason = Metrics::SLOW_HEADER;
+        return true;
+    }
+    if (body > 0 && now > body) {
+        if (reason)
+            *reason = Metrics::SLOW_BODY;
+        return true;
+    }
+    return false;
+}
+
+template <typename Trigger>
+bool HttpConn::recv_all() {
     if (read_idx_ >= READ_BUFFER_SIZE) 
         return false;
     
     int bytes_read = 0;
 
-    if (trig_mode_ == 0) {
+    if constexpr (!Trigger::EDGE) {
         bytes_read = recv(sockfd_, read_buf_ + read_idx_, READ_BUFFER_SIZE - read_idx_, 0);
         read_idx_ += bytes_read;
         if (bytes_read <= 0)
@@ -133,26 +198,73 @@ bool HttpConn::read_once() {
     }
 }
 
+template <typename Trigger>
 void HttpConn::process() {
-    HttpCode read_ret = process_read();
+    // 协程结束前连接一直被持有，不会收到新的事件，上一个协程一定已经结束
+    // 否则它的帧可能还挂在AsyncDb或RegisterBatcher上，不能销毁
+    if (!task_.done()) {
+        LOG_ERROR("Request on fd %d is still running!", sockfd_);
+        unpin();
+        return;
+    }
+    start_us_ = AccessLog::now_us();
+    store_us_ = 0;
+    // 先销毁上一个协程的帧，之后arena中的帧都已释放，可以整体重置
+    task_ = Task<>();
+    arena_.reset();
+    task_ = serve();
+    task_.on_done(rearm<Trigger>, this);
+    task_.resume();
+}
+
+template <typename Trigger>
+void HttpConn::expire() {
+    // 调用方持有连接，fd不会被关闭复用；主线程已经要求关闭时，释放持有后由工作线程关闭
+    if (closing())
+        return;
+    // 重新注册事件后epoll报告EPOLLHUP，主线程移除定时器并关闭连接
+    shutdown(sockfd_, SHUT_RDWR);
+    Utils::modify_fd<Trigger>(epollfd_, sockfd_, EPOLLIN);
+}
+
+// 协程挂起到final_suspend之后才注册事件，否则事件触发后其他工作线程可能在协程帧还在使用时销毁它
+// 主线程已经要求关闭时不再注册，释放持有后由本线程关闭连接
+template <typename Trigger>
+void HttpConn::rearm(void* arg) {
+    HttpConn* conn = (HttpConn*) arg;
+    if (!conn->closing())
+        Utils::modify_fd<Trigger>(epollfd_, conn->sockfd_, conn->rearm_event_);
+    conn->unpin();
+}
+
+Task<> HttpConn::serve() {
+    HttpCode read_ret = co_await process_read();
+    // 没有进入do_request的请求，解析结束即处理开始
+    if (parsed_us_ == 0)
+        parsed_us_ = AccessLog::now_us();
 
     // NO_REQUEST, 表示请求不完整，需要继续接收请求数据
     if (read_ret == NO_REQUEST) {
-        // 注册并监听读事件
-        Utils::modify_fd(epollfd_, sockfd_, EPOLLIN, trig_mode_);
-        return;
+        // 结束后注册并监听读事件
+        rearm_event_ = EPOLLIN;
+        co_return;
     }
 
     // 调用process_write完成报文响应
     bool write_ret = process_write(read_ret);
-    if (!write_ret)
-        close_conn();
-        
-    // 注册并监听写事件
-    Utils::modify_fd(epollfd_, sockfd_, EPOLLOUT, trig_mode_);
+    handled_us_ = AccessLog::now_us();
+    // 工作线程不直接关闭，定时器还在主线程的链表中，关闭读写后由主线程按对端关闭的流程关闭
+    if (!write_ret) {
+        shutdown(sockfd_, SHUT_RDWR);
+        rearm_event_ = EPOLLIN;
+        co_return;
+    }
+
+    // 结束后注册并监听写事件
+    rearm_event_ = EPOLLOUT;
 }
 
-HttpConn::HttpCode HttpConn::process_read() {
+Task<HttpConn::HttpCode> HttpConn::process_read() {
     // 初始化状态机状态、http请求结果
     LineState line_state = LINE_STATE_OK;
     HttpCode ret = NO_REQUEST;
@@ -165,38 +277,42 @@ HttpConn::HttpCode HttpConn::process_read() {
         // start_line_是每个数据行在read_buf_中的起始位置
         // checked_idx_表示状态机在read_buf_中读取的位置
         start_line_ = checked_idx_;
-        LOG_INFO("Process read: %s.", text);
+        LOG_DEBUG("Process read: %s.", text);
 
         // 主状态机的三种状态转移逻辑
         if (check_state_ == CHECK_STATE_REQUEST_LINE) {
             // 解析请求行
             ret = parse_request_line(text);
             if (ret == BAD_REQUEST)
-                return BAD_REQUEST;
+                co_return BAD_REQUEST;
         }
         else if (check_state_ == CHECK_STATE_HEADER) {
             // 解析请求头
             ret = parse_headers(text);
             if (ret == BAD_REQUEST)
-                return BAD_REQUEST;
+                co_return BAD_REQUEST;
             // 完整解析GET请求后，跳转到报文响应函数
-            else if (ret == GET_REQUEST) 
-                return do_request();
+            else if (ret == GET_REQUEST) {
+                USDT(parse, sockfd_, (int) method_, url_);
+                co_return co_await do_request();
+            }
         }
         else if (check_state_ == CHECK_STATE_CONTENT) {
             // 解析请求体
             ret = parse_content(text);
             // 完整解析POST请求后，跳转到报文响应函数
-            if (ret == GET_REQUEST) 
-                return do_request();
+            if (ret == GET_REQUEST) {
+                USDT(parse, sockfd_, (int) method_, url_);
+                co_return co_await do_request();
+            }
             // 解析完请求体即完成报文解析，避免再次进入循环，更新line_state_
             line_state = LINE_STATE_OPEN;
         }
         else {
-            return INTERNAL_ERROR;
+            co_return INTERNAL_ERROR;
         }
     }
-    return NO_REQUEST;
+    co_return NO_REQUEST;
 }
 
 // 从状态机，用于分析出一行内容
@@ -299,8 +415,11 @@ HttpConn::HttpCode HttpConn::parse_headers(char* text) {
     if (text[0] == '\0') {
         // 判断是GET还是POST请求
         if (content_length_ != 0) {
-            // POST需要跳转到消息体处理状态
+            // POST需要跳转到消息体处理状态，改为计算请求体的截止时间
             check_state_ = CHECK_STATE_CONTENT;
+            header_deadline_us_.store(0, memory_order_relaxed);
+            if (body_ms_ > 0)
+                body_deadline_us_.store(AccessLog::now_us() + body_ms_ * 1000LL, memory_order_relaxed);
             return NO_REQUEST;
         }
         return GET_REQUEST;
@@ -323,7 +442,8 @@ HttpConn::HttpCode HttpConn::parse_headers(char* text) {
         text += strspn(text, " \t");
         host_ = text;
     } else {
-        LOG_INFO("Oop! Unknown header: %s.", text);
+        // 攻击流量可能带大量无效头部，限速避免日志写满磁盘
+        LOG_LIMIT(LOG_LEVEL_INFO, 10, "Oop! Unknown header: %s.", text);
     }
     return NO_REQUEST;
 }
@@ -342,30 +462,41 @@ HttpConn::HttpCode HttpConn::parse_content(char* text) {
 
 void HttpConn::jump_to(const char url[]) {
     const int len = strlen(root_dir_);
-    char* url_real = (char*) malloc(sizeof(char) * 200);
-    strcpy(url_real, url);
-    strncpy(real_file_ + len, url_real, strlen(url_real));
-    free(url_real);
+    strncpy(real_file_ + len, url, FILENAME_LEN - len - 1);
 }
 
-HttpConn::HttpCode HttpConn::do_request() {
+Task<HttpConn::HttpCode> HttpConn::do_request() {
+    parsed_us_ = AccessLog::now_us();
+    // 请求已经收完，等待数据库期间不算超时
+    header_deadline_us_.store(0, memory_order_relaxed);
+    body_deadline_us_.store(0, memory_order_relaxed);
+    // 指标只对本机开放，监控代理和服务端部署在一起
+    if (method_ == GET && strcmp(url_, "/metrics") == 0) {
+        if (ntohl(address_.sin_addr.s_addr) >> 24 != 127)
+            co_return FORBIDDEN_REQUEST;
+        metrics_body_ = Metrics::get_instance()->render();
+        co_return METRICS_REQUEST;
+    }
     // 将初始化的real_file_赋值为网站根目录
     strcpy(real_file_, root_dir_);
     int len = strlen(root_dir_);
     // 找到url_中/的位置
     const char* p = strrchr(url_, '/');
+    bool auth = cgi_ == 1 && (*(p + 1) == '2' || *(p + 1) == '3');
+
+    // 按IP限流，登录注册额外受更严格的限制
+    if (!RateLimiter::get_instance()->admit(address_.sin_addr.s_addr, auth, parsed_us_)) {
+        Metrics::get_instance()->add(auth ? Metrics::RATE_LIMITED_AUTH : Metrics::RATE_LIMITED_REQUESTS);
+        co_return TOO_MANY_REQUESTS;
+    }
 
     // 处理cgi_
     // 实现登录和注册校验
-    if (cgi_ == 1 && (*(p + 1) == '2' || *(p + 1) == '3')) {
+    if (auth) {
         // 根据标志判断是登录检测还是注册检测
         char flag = url_[1];
 
-        char* url_real = (char*) malloc(sizeof(char) * 200);
-        strcpy(url_real, "/");
-        strcat(url_real, url_ + 2);
-        strncpy(real_file_ + len, url_real, FILENAME_LEN - len - 1);
-        free(url_real);
+        snprintf(real_file_ + len, FILENAME_LEN - len, "/%s", url_ + 2);
 
         // 将用户名和密码提取出来
         // user=123&passwd=123
@@ -381,40 +512,61 @@ HttpConn::HttpCode HttpConn::do_request() {
             password[j] = content_[i];
         password[j] = '\0';
 
-        // 同步线程登录校验
+        // 登录注册先查缓存，缓存未命中再查用户存储后端
+        // MySQL后端等待数据库响应时协程挂起，工作线程去处理其他请求
+        UserCache* cache = UserCache::get_instance();
+        UserStore* store = UserStore::get_instance();
+        char stored[UserCache::VALUE_LEN];
+        UserCache::Lookup lookup = cache->find(name, stored, sizeof(stored));
+        Metrics::get_instance()->add(lookup == UserCache::HIT ? Metrics::CACHE_HITS :
+            lookup == UserCache::ABSENT ? Metrics::CACHE_ABSENT : Metrics::CACHE_MISSES);
+        if (lookup == UserCache::MISS) {
+            // 后端已经排满，再排队也会超时，直接返回503
+            if (store->saturated()) {
+                Metrics::get_instance()->add(Metrics::SHED_DATABASE);
+                co_return SERVICE_UNAVAILABLE;
+            }
+            long long store_start = AccessLog::now_us();
+            UserStore::Status status = co_await store->find(name, stored, sizeof(stored));
+            store_us_ += AccessLog::now_us() - store_start;
+            // 后端暂时不可用，返回503
+            if (status == UserStore::UNAVAILABLE)
+                co_return SERVICE_UNAVAILABLE;
+            if (status == UserStore::OK) {
+                cache->insert(name, stored);
+                lookup = UserCache::HIT;
+            // 后端中也没有，记入负缓存
+            } else if (status == UserStore::NOT_FOUND) {
+                cache->insert_absent(name);
+                lookup = UserCache::ABSENT;
+            }
+        }
+        bool found = lookup == UserCache::HIT;
 
-        // 如果是注册，先检测数据库中是否有重名的
+        // 如果是注册，先检测是否有重名的
         // 没有重名的，进行增加数据
         if (*(p + 1) == '3') {
-            char* sql_insert = (char*) malloc(sizeof(char) * 200);
-            strcat(sql_insert, "INSERT INTO user(username, passwd) VALUES(");
-            strcat(sql_insert, "'");
-            strcat(sql_insert, name);
-            strcat(sql_insert, "', '");
-            strcat(sql_insert, password);
-            strcat(sql_insert, "')");
-            LOG_INFO("MySQL: %s.", sql_insert);
-
-            // 判断map中能否找到重复的用户名
-            if (users.find(name) == users.end()) {
-                // 向数据库中插入数据时，需要通过锁来同步数据
-                mutex.lock();
-                int res = mysql_query(mysql_, sql_insert);
-                users.insert(pair<string, string>(name, password));
-                mutex.unlock();
-                // 校验成功，跳转登录页面
-                if (res == 0)
+            LOG_INFO("UserStore: register %s.", name);
+            if (lookup == UserCache::ABSENT) {
+                long long store_start = AccessLog::now_us();
+                UserStore::Status status = co_await store->add(name, password);
+                store_us_ += AccessLog::now_us() - store_start;
+                if (status == UserStore::UNAVAILABLE)
+                    co_return SERVICE_UNAVAILABLE;
+                // 校验成功，写入缓存，跳转登录页面
+                if (status == UserStore::OK) {
+                    cache->insert(name, password);
                     strcpy(url_, "/log.html");
                 // 校验失败，跳转注册失败页面
-                else
+                } else {
                     strcpy(url_, "/registerError.html");
+                }
             } else {
                 strcpy(url_, "/registerError.html");
             }
         // 如果是登录，直接判断
-        // 若浏览器端输入的登录名和密码在表中可以查找到，返回1，否则返回0
         } else if (*(p + 1) == '2') {
-            if (users.find(name) != users.end() && users[name] == password)
+            if (found && strcmp(stored, password) == 0)
                 strcpy(url_, "/welcome.html");
             else
                 strcpy(url_, "/logError.html");
@@ -438,13 +590,13 @@ HttpConn::HttpCode HttpConn::do_request() {
     // 通过stat获取请求资源文件信息，成功则将信息更新到file_stat_结构体
     // 失败返回NO_RESOURCE状态，表示资源不存在
     if (stat(real_file_, &file_stat_) < 0) 
-        return NO_RESOURCE;
+        co_return NO_RESOURCE;
     // 判断文件的权限，是否可读，不可读则返回FORBIDDEN_REQUEST状态
     if (!(file_stat_.st_mode & S_IROTH))
-        return FORBIDDEN_REQUEST;
+        co_return FORBIDDEN_REQUEST;
     // 判断文件类型，如果是目录，则返回BAD_REQUEST状态，表示请求报文有误
     if (S_ISDIR(file_stat_.st_mode))
-        return BAD_REQUEST;
+        co_return BAD_REQUEST;
 
     // 以只读方式获取文件描述符，通过mmap将该文件映射到内存中
     int fd = open(real_file_, O_RDONLY);
@@ -452,7 +604,7 @@ HttpConn::HttpCode HttpConn::do_request() {
     // 避免文件描述符的浪费和占用
     close(fd);
     // 表示请求文件存在，且可以访问
-    return FILE_REQUEST;
+    co_return FILE_REQUEST;
 }
 
 bool HttpConn::add_response(const char* format, ...) {
@@ -474,12 +626,13 @@ bool HttpConn::add_response(const char* format, ...) {
     write_idx_ += len;
     // 清空可变参数列表
     va_end(arg_list);
-    LOG_INFO("Request: %s.", write_buf_);
+    LOG_DEBUG("Request: %s.", write_buf_);
     return true;
 }
 
 // 添加状态行
 bool HttpConn::add_status_line(int status, const char* title) {
+    status_ = status;
     return add_response("%s %d %s\r\n", "HTTP/1.1", status, title);
 }
 
@@ -494,7 +647,7 @@ bool HttpConn::add_headers(int content_len) {
 
 // 添加Content-Length，表示响应报文的长度
 bool HttpConn::add_content_length(int content_len) {
-    return add_response("Content_Length:%d\r\n", content_len);
+    return add_response("Content-Length:%d\r\n", content_len);
 }
 
 // 添加文本类型，这里是html
@@ -526,6 +679,20 @@ bool HttpConn::process_write(HttpCode ret) {
         add_headers(strlen(ERROR_500_FORM));
         if (!add_content(ERROR_500_FORM))
             return false;
+    // 数据库暂时不可用，503
+    } else if (ret == SERVICE_UNAVAILABLE) {
+        add_status_line(503, ERROR_503_TITLE);
+        add_response("Retry-After:%d\r\n", RETRY_AFTER);
+        add_headers(strlen(ERROR_503_FORM));
+        if (!add_content(ERROR_503_FORM))
+            return false;
+    // 按IP限流，429
+    } else if (ret == TOO_MANY_REQUESTS) {
+        add_status_line(429, ERROR_429_TITLE);
+        add_response("Retry-After:%d\r\n", RETRY_AFTER);
+        add_headers(strlen(ERROR_429_FORM));
+        if (!add_content(ERROR_429_FORM))
+            return false;
     // 报文语法有误，404
     } else if (ret == BAD_REQUEST) {
         add_status_line(404, ERROR_404_TITLE);
@@ -548,7 +715,8 @@ bool HttpConn::process_write(HttpCode ret) {
             iv_[0].iov_base = write_buf_;
             iv_[0].iov_len = write_idx_;
             // 第二个iovec指针指向mmap返回的文件指针，长度指向文件大小
-            iv_[1].iov_base = file_address_;
+            body_ = file_address_;
+            iv_[1].iov_base = body_;
             iv_[1].iov_len = file_stat_.st_size;
             iv_count_ = 2;
             // 发送的全部数据为响应报文头部信息和文件大小
@@ -561,6 +729,19 @@ bool HttpConn::process_write(HttpCode ret) {
             if (!add_content(OK_STRING))
                 return false;
         }
+    // 指标，200，响应体在metrics_body_中
+    } else if (ret == METRICS_REQUEST) {
+        add_status_line(200, OK_200_TITLE);
+        add_response("Content-Type:%s\r\n", "text/plain; version=0.0.4");
+        add_headers(metrics_body_.size());
+        body_ = metrics_body_.data();
+        iv_[0].iov_base = write_buf_;
+        iv_[0].iov_len = write_idx_;
+        iv_[1].iov_base = body_;
+        iv_[1].iov_len = metrics_body_.size();
+        iv_count_ = 2;
+        bytes_unsent_ = write_idx_ + metrics_body_.size();
+        return true;
     } else {
         return false;
     }
@@ -579,12 +760,13 @@ void HttpConn::unmap() {
     }
 }
 
+template <typename Trigger>
 bool HttpConn::write() {
     int temp = 0;
     // 若要发送的数据长度为0
     // 表示响应报文为空，一般不会出现这种情况
     if (bytes_unsent_ == 0) {
-        Utils::modify_fd(epollfd_, sockfd_, EPOLLIN, trig_mode_);
+        Utils::modify_fd<Trigger>(epollfd_, sockfd_, EPOLLIN);
         init();
         return true;
     }
@@ -596,8 +778,19 @@ bool HttpConn::write() {
         if (temp < 0) {
             // 判断缓冲区是否满了
             if (errno == EAGAIN) {
+                // 对端接收过慢，不再等缓冲区中的数据发完，发送RST直接回收
+                // 发送缓冲区可以有几MB，按扣除缓冲区中未确认的字节数后实际送达的字节数计算速率
+                long long elapsed = AccessLog::now_us() - handled_us_;
+                int unacked = 0;
+                if (min_send_rate_ > 0 && elapsed > SEND_GRACE_MS * 1000LL && ioctl(sockfd_, SIOCOUTQ, &unacked) == 0 &&
+                    (bytes_sent_ - unacked) * 1000000LL < min_send_rate_ * elapsed) {
+                    Metrics::get_instance()->add(Metrics::SLOW_WRITE);
+                    Utils::set_reset(sockfd_);
+                    unmap();
+                    return false;
+                }
                 // 重新注册写事件
-                Utils::modify_fd(epollfd_, sockfd_, EPOLLOUT, trig_mode_);
+                Utils::modify_fd<Trigger>(epollfd_, sockfd_, EPOLLOUT);
                 return true;
             }
             // 如果发送失败，但不是缓冲区问题，取消映射
@@ -612,19 +805,34 @@ bool HttpConn::write() {
         if (bytes_sent_ >= iv_[0].iov_len) {
             // 不再继续发送头部信息
             iv_[0].iov_len = 0;
-            iv_[1].iov_base = file_address_ + (bytes_sent_ - write_idx_);
+            iv_[1].iov_base = body_ + (bytes_sent_ - write_idx_);
             iv_[1].iov_len = bytes_unsent_;
         // 继续发送第一个iovec头部信息的数据
         } else {
             iv_[0].iov_base = write_buf_ + bytes_sent_;
-            iv_[0].iov_len -= bytes_sent_;
+            iv_[0].iov_len = write_idx_ - bytes_sent_;
         }
 
         // 判断条件，数据已全部发送完
         if (bytes_unsent_ <= 0) {
             unmap();
+            // 每个完成的响应记录一条访问日志和各阶段耗时，之后init会清空url_所在的读缓冲区
+            long long now = AccessLog::now_us();
+            long long queue_us = enqueue_us_ > 0 ? start_us_ - enqueue_us_ : 0;
+            AccessLog::get_instance()->record(address_, method_, url_, status_, bytes_sent_,
+                queue_us, parsed_us_ - start_us_, handled_us_ - parsed_us_, now - handled_us_);
+            Metrics* metrics = Metrics::get_instance();
+            metrics->observe(Metrics::STAGE_QUEUE, queue_us);
+            metrics->observe(Metrics::STAGE_PARSE, parsed_us_ - start_us_);
+            metrics->observe(Metrics::STAGE_HANDLER, handled_us_ - parsed_us_);
+            metrics->observe(Metrics::STAGE_WRITE, now - handled_us_);
+            if (status_ >= 200 && status_ < 600)
+                metrics->add((Metrics::Counter) (Metrics::RESPONSES_2XX + min(status_ / 100 - 2, 3)));
+            metrics->add(Metrics::RESPONSE_BYTES, bytes_sent_);
+            record_slow(now, queue_us);
+            USDT(response, sockfd_, status_, bytes_sent_, now - begin_us());
             // 在epoll树上重置EPOLLONESHOT事件
-            Utils::modify_fd(epollfd_, sockfd_, EPOLLIN, trig_mode_);
+            Utils::modify_fd<Trigger>(epollfd_, sockfd_, EPOLLIN);
             // 浏览器请求为长连接
             if (linger_) {
                 // 重新初始化http对象
@@ -637,3 +845,40 @@ bool HttpConn::write() {
     }
     return false;
 }
+
+void HttpConn::record_slow(long long now, long long queue_us) {
+    SlowLog* slow_log = SlowLog::get_instance();
+    long long begin = begin_us();
+    if (!slow_log->is_slow(now - begin))
+        return;
+
+    SlowLog::Request request;
+    timespec wall;
+    clock_gettime(CLOCK_REALTIME, &wall);
+    request.time_us = wall.tv_sec * 1000000LL + wall.tv_nsec / 1000;
+    memcpy(request.ip, ip_, sizeof(request.ip));
+    request.port = ntohs(address_.sin_port);
+    request.method = method_;
+    snprintf(request.path, sizeof(request.path), "%s", url_ != nullptr ? url_ : "-");
+    request.status = status_;
+    request.bytes = bytes_sent_;
+    request.total_us = now - begin;
+    request.stages[SlowLog::STAGE_DISPATCH] = enqueue_us_ > begin ? enqueue_us_ - begin : 0;
+    request.stages[SlowLog::STAGE_READ] = read_us_;
+    request.stages[SlowLog::STAGE_QUEUE] = queue_us;
+    request.stages[SlowLog::STAGE_PARSE] = parsed_us_ - start_us_;
+    request.stages[SlowLog::STAGE_STORE] = store_us_;
+    request.stages[SlowLog::STAGE_HANDLER] = handled_us_ - parsed_us_ - store_us_;
+    request.stages[SlowLog::STAGE_WRITE] = now - handled_us_;
+    slow_log->record(request);
+}
+
+// 事件循环和工作线程按启动参数选用其中一种触发模式的版本
+template bool HttpConn::read_once<LevelTrigger>();
+template bool HttpConn::read_once<EdgeTrigger>();
+template bool HttpConn::write<LevelTrigger>();
+template bool HttpConn::write<EdgeTrigger>();
+template void HttpConn::process<LevelTrigger>();
+template void HttpConn::process<EdgeTrigger>();
+template void HttpConn::expire<LevelTrigger>();
+template void HttpConn::expire<EdgeTrigger>();
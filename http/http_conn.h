@@ -3,15 +3,30 @@
 
 #include "pch.h"
 
+#include "access_log.h"
+#include "arena.h"
+#include "capture.h"
 #include "lock.h"
+#include "metrics.h"
+#include "rate_limiter.h"
+#include "slow_log.h"
 #include "mysql_conn.h"
+#include "task.h"
+#include "user_cache.h"
+#include "user_store.h"
 #include "utils.h"
 
 class HttpConn {
+    // 微基准直接调用解析和响应生成的私有函数
+    friend struct HttpConnBench;
+
 public:
     static constexpr int FILENAME_LEN = 200;
     static constexpr int READ_BUFFER_SIZE = 2048;
     static constexpr int WRITE_BUFFER_SIZE = 1024;
+    static constexpr int ARENA_SIZE = 2048;     // 一个请求的协程帧，约700字节
+    static constexpr int RETRY_AFTER = 1;       // 503和429响应建议客户端重试的间隔，单位s
+    static constexpr int SEND_GRACE_MS = 1000;  // 响应开始发送这么久之后才检查发送速率
     
     enum Method {
         GET = 0,
@@ -41,7 +56,10 @@ public:
         FORBIDDEN_REQUEST,
         FILE_REQUEST,
         INTERNAL_ERROR,
-        CLOSED_CONNECTION
+        CLOSED_CONNECTION,
+        SERVICE_UNAVAILABLE,
+        TOO_MANY_REQUESTS,
+        METRICS_REQUEST
     };
 
     // 从状态机的状态
@@ -54,31 +72,101 @@ public:
     // 初始化套接字地址，函数内部会调用私有方法init
     void init(int sockfd, const sockaddr_in& addr, const char* root_dir, bool trig_mode, bool close_log,
         std::string username, std::string password, std::string db_name);
-    // 关闭http连接
+    // 关闭http连接，所有关闭路径共用，只在主线程调用，连接被持有时推迟到最后一次unpin
     void close_conn(bool real_close = true);
+    // 以下四个函数按触发模式Trigger实例化，LevelTrigger和EdgeTrigger的版本在http_conn.cc中显式实例化
+    // 启动请求处理协程，协程在等待数据库时挂起，不占用工作线程
+    template <typename Trigger>
     void process();
     // 读取浏览器端发来的全部数据
+    template <typename Trigger>
     bool read_once();
     // 响应报文写入函数
+    template <typename Trigger>
     bool write();
+    // 请求在队列中超过截止时间，不再处理，关闭读写后由主线程按对端关闭的流程关闭连接
+    template <typename Trigger>
+    void expire();
+    // 连接的代数，每次要求关闭连接加一，请求入队时记录，出队时不同说明排队期间连接已要求关闭
+    uint32_t get_generation() const {
+        return generation_.load(std::memory_order_acquire);
+    }
+    void retire() {
+        generation_.fetch_add(1, std::memory_order_release);
+    }
+    // 主线程把连接交给线程池前持有一次，工作线程处理完、请求协程结束后释放
+    // 持有期间主线程的关闭推迟到最后一次释放，fd不会被新连接复用，挂起的协程帧不会被销毁
+    void pin() {
+        pins_.fetch_add(PIN, std::memory_order_relaxed);
+    }
+    void unpin();
+    // 主线程已经要求关闭，之后不再处理这个连接的事件
+    bool closing() const {
+        return pins_.load(std::memory_order_acquire) & CLOSING;
+    }
     sockaddr_in* get_address() {
         return &address_;
     }
-    // CGI使用线程池初始化数据库表
-    void init_mysql_result(ConnPool* conn_pool);
+    // 请求头或请求体超过截止时间时返回true，reason为对应的指标
+    bool read_overdue(long long now, Metrics::Counter* reason = nullptr) const;
+    // 当前请求读取阶段的截止时间，单调时钟，0表示没有正在读取的请求
+    long long get_read_deadline() const {
+        long long header = header_deadline_us_.load(std::memory_order_relaxed);
+        return header > 0 ? header : body_deadline_us_.load(std::memory_order_relaxed);
+    }
+    // 请求处理协程的帧从这里分配，见Task
+    Arena<ARENA_SIZE>& get_arena() {
+        return arena_;
+    }
+    // 过载时主线程直接发送的503，带Retry-After，第一次调用时格式化
+    static std::string_view overload_response();
+    // 客户端IP，建立连接时格式化一次，避免在事件循环中调用非线程安全的inet_ntoa
+    const char* get_ip() const {
+        return ip_;
+    }
+    // 主线程处理读事件时记录epoll_wait返回的时间，慢请求的总耗时从这里算起
+    void mark_dispatch(long long now) {
+        dispatch_us_ = now;
+    }
+    // 主线程把请求放入请求队列前记录时间，用于访问日志的排队耗时
+    void mark_enqueue() {
+        enqueue_us_ = AccessLog::now_us();
+    }
 
     static int epollfd_;
-    static int user_count_;
+    static std::atomic<int> user_count_;
+    // 慢速客户端的限制，0表示不限
+    static int header_ms_;                  // 从请求的第一个字节到请求头收完，单位ms
+    static int body_ms_;                    // 从请求头收完到请求体收完，单位ms
+    static int min_send_rate_;              // 发送响应的最低速率，单位字节/s
 
-    MYSQL* mysql_;
     bool state_;                             // 读为false，写为true
     bool timer_flag_;
-    bool improve_;
+    // reactor模式下主线程自旋等待工作线程读写完成，必须是原子变量，先写timer_flag_再置位
+    std::atomic<bool> improve_;
 
 private:
+    static constexpr int CLOSING = 1;       // pins_的最低位，主线程已经要求关闭
+    static constexpr int PIN = 2;           // 每次持有在pins_上加的值
+
     void init();
+    // 完成关闭，由close_conn或者最后一次unpin调用
+    void shut();
+    // read_once的实现，按触发模式读取套接字
+    template <typename Trigger>
+    bool recv_all();
+    // 请求的开始时间，主线程记录了读事件时从epoll_wait返回算起，否则从工作线程开始处理算起
+    long long begin_us() const {
+        return dispatch_us_ > 0 && dispatch_us_ <= start_us_ ? dispatch_us_ : start_us_;
+    }
+    // 总耗时超过阈值时把各阶段耗时写入慢请求记录，在write完成响应时调用
+    void record_slow(long long now, long long queue_us);
+    // 请求处理协程：解析报文、生成响应，结束后由rearm注册读或写事件
+    Task<> serve();
+    template <typename Trigger>
+    static void rearm(void* arg);
     // 从read_buf_读取，并处理请求报文
-    HttpCode process_read();
+    Task<HttpCode> process_read();
     // 向write_buf_写入响应报文数据
     bool process_write(HttpCode ret);
     // 主状态机解析报文中的请求行数据
@@ -88,7 +176,7 @@ private:
     // 主状态机解析报文中的请求内容
     HttpCode parse_content(char* text);
     // 生成响应报文
-    HttpCode do_request();
+    Task<HttpCode> do_request();
     // start_line_是已经解析的字符
     // get_line用于将指针向后偏移，指向未处理的字符
     // start_line_是行在buffer中的起始位置，将该位置后面的数据赋给text
@@ -114,6 +202,7 @@ private:
     
     int sockfd_;
     sockaddr_in address_;
+    char ip_[INET_ADDRSTRLEN];
     
     char read_buf_[READ_BUFFER_SIZE];       // 存储读取的请求报文数据
     int read_idx_;                          // 缓冲区read_buf_中数据的最后一个字节的下一个位置
@@ -135,6 +224,8 @@ private:
     bool linger_;
 
     char* file_address_;                    // 读取服务器上的文件地址
+    std::string metrics_body_;              // /metrics的响应体，保留容量给下一次使用
+    char* body_;                            // 第二个iovec发送的响应体，指向文件或metrics_body_
     struct stat file_stat_;
     struct iovec iv_[2];                    // io向量机制iovec
     int iv_count_;
@@ -142,15 +233,33 @@ private:
     char* content_;                         // 存储请求体数据
     int bytes_unsent_;                      // 未发送字节数
     int bytes_sent_;                        // 已发送字节数
+    Task<> task_;                           // 当前请求的处理协程
+    Arena<ARENA_SIZE> arena_;               // 当前请求的协程帧，启动下一个处理协程前重置
+    int rearm_event_;                       // 协程结束后注册的事件
+    std::atomic<uint32_t> generation_;      // 连接的代数，主线程关闭连接时加一
+    std::atomic<int> pins_;                 // 持有次数乘以PIN，加上CLOSING位
+    // 读取阶段的截止时间，单调时钟，单位us，0表示不在该阶段，部分读取不会延后
+    // 工作线程解析时更新，主线程在定时器和关闭连接时读取
+    std::atomic<long long> header_deadline_us_;
+    std::atomic<long long> body_deadline_us_;
+
+    // 访问日志的各阶段时间戳，单调时钟，单位us
+    long long enqueue_us_;                  // 放入请求队列
+    long long start_us_;                    // 工作线程开始处理
+    long long parsed_us_;                   // 请求解析完成
+    long long handled_us_;                  // 响应生成完成
+    int status_;                            // 响应状态码
+    uint64_t capture_conn_;                 // 流量捕获中的连接id，未启用时为0
+    // 慢请求记录额外需要的时间，只保留最后一次读事件
+    long long dispatch_us_;                 // epoll_wait返回
+    long long read_us_;                     // 读取套接字的耗时
+    long long store_us_;                    // 等待用户存储后端的耗时
 
     
     // 网站根目录，文件夹内存放请求的资源和跳转的html文件
     // 当浏览器出现连接重置时，可能时网站根目录出错或http响应格式出错或者访问的文件中内容完全为空
     const char* root_dir_;
 
-    // 将表中的用户名和密码放入
-    std::unordered_map<std::string, std::string> users_;
-    bool trig_mode_;
     bool close_log_;
 
     char username_[128];
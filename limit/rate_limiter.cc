@@ -0,0 +1,215 @@
+#include "rate_limiter.h"
+
+using namespace std;
+
+// 向上取2的幂
+static int round_up(int n) {
+    int ret = 1;
+    while (ret < n)
+        ret <<= 1;
+    return ret;
+}
+
+RateLimiter::~RateLimiter() {
+    destroy();
+}
+
+void RateLimiter::destroy() {
+    for (int i = 0; i < shard_count_; i++) {
+        delete[] shards_[i].heads;
+        delete[] shards_[i].entries;
+    }
+    delete[] shards_;
+    shards_ = nullptr;
+    shard_count_ = 0;
+}
+
+void RateLimiter::init(int rate, int max_conns, int capacity, int shard_count) {
+    destroy();
+    if (rate <= 0 && max_conns <= 0)
+        return;
+    rate_ = rate > 0 ? rate : 0;
+    burst_ = rate_ * BURST_SECONDS;
+    auth_rate_ = rate_ / AUTH_DIVISOR;
+    auth_burst_ = max(auth_rate_ * BURST_SECONDS, 1.0f);
+    max_conns_ = max_conns > 0 ? max_conns : 0;
+
+    shard_count_ = round_up(shard_count > 0 ? shard_count : 1);
+    entry_count_ = round_up(max(capacity / shard_count_, MAX_EVICT_SKIP));
+    shards_ = new Shard[shard_count_];
+    for (int i = 0; i < shard_count_; i++) {
+        Shard& shard = shards_[i];
+        shard.heads = new int[entry_count_];
+        fill(shard.heads, shard.heads + entry_count_, -1);
+        shard.entries = new Entry[entry_count_];
+        shard.size = 0;
+        shard.lru_head = -1;
+        shard.lru_tail = -1;
+        shard.evictions = 0;
+    }
+}
+
+void RateLimiter::lru_unlink(Shard& shard, int index) {
+    Entry& entry = shard.entries[index];
+    if (entry.lru_prev != -1)
+        shard.entries[entry.lru_prev].lru_next = entry.lru_next;
+    else
+        shard.lru_head = entry.lru_next;
+    if (entry.lru_next != -1)
+        shard.entries[entry.lru_next].lru_prev = entry.lru_prev;
+    else
+        shard.lru_tail = entry.lru_prev;
+}
+
+void RateLimiter::lru_push(Shard& shard, int index) {
+    Entry& entry = shard.entries[index];
+    entry.lru_prev = -1;
+    entry.lru_next = shard.lru_head;
+    if (shard.lru_head != -1)
+        shard.entries[shard.lru_head].lru_prev = index;
+    else
+        shard.lru_tail = index;
+    shard.lru_head = index;
+}
+
+void RateLimiter::refill(Entry& entry, long long now_us) {
+    if (now_us <= entry.refill_us)
+        return;
+    float seconds = (now_us - entry.refill_us) / 1e6f;
+    entry.refill_us = now_us;
+    entry.conn_tokens = min(entry.conn_tokens + seconds * rate_, burst_);
+    entry.request_tokens = min(entry.request_tokens + seconds * rate_, burst_);
+    entry.auth_tokens = min(entry.auth_tokens + seconds * auth_rate_, auth_burst_);
+}
+
+// 命中的条目移到访问链表头部
+// 没有命中时先用未分配的条目，用满后从链表尾部淘汰，有连接的条目移到头部跳过，最多跳过MAX_EVICT_SKIP个
+// 跳过后仍然有连接时不淘汰，否则该IP的并发上限被重置，之后的release也会减到新条目上
+RateLimiter::Entry* RateLimiter::find(Shard& shard, uint32_t addr, uint64_t h, bool create, long long now_us) {
+    int bucket = (h >> 32) & (entry_count_ - 1);
+    for (int i = shard.heads[bucket]; i != -1; i = shard.entries[i].next) {
+        if (shard.entries[i].addr != addr)
+            continue;
+        if (shard.lru_head != i) {
+            lru_unlink(shard, i);
+            lru_push(shard, i);
+        }
+        return &shard.entries[i];
+    }
+    if (!create)
+        return nullptr;
+
+    int index;
+    if (shard.size < entry_count_) {
+        index = shard.size++;
+    } else {
+        index = shard.lru_tail;
+        for (int i = 0; i < MAX_EVICT_SKIP && shard.entries[index].conns > 0; i++) {
+            lru_unlink(shard, index);
+            lru_push(shard, index);
+            index = shard.lru_tail;
+        }
+        if (shard.entries[index].conns > 0)
+            return nullptr;
+        // 从原来的哈希桶中摘下
+        int* link = &shard.heads[(hash(shard.entries[index].addr) >> 32) & (entry_count_ - 1)];
+        while (*link != index)
+            link = &shard.entries[*link].next;
+        *link = shard.entries[index].next;
+        lru_unlink(shard, index);
+        shard.evictions++;
+    }
+
+    Entry& entry = shard.entries[index];
+    entry.addr = addr;
+    entry.next = shard.heads[bucket];
+    shard.heads[bucket] = index;
+    entry.conns = 0;
+    entry.conn_tokens = burst_;
+    entry.request_tokens = burst_;
+    entry.auth_tokens = auth_burst_;
+    entry.refill_us = now_us;
+    lru_push(shard, index);
+    return &entry;
+}
+
+RateLimiter::Verdict RateLimiter::acquire(uint32_t addr, long long now_us) {
+    if (shards_ == nullptr)
+        return ALLOW;
+    uint64_t h = hash(addr);
+    Shard& shard = shard_of(h);
+    Verdict ret = ALLOW;
+    shard.mutex.lock();
+    Entry* entry = find(shard, addr, h, true, now_us);
+    if (entry == nullptr) {
+        shard.mutex.unlock();
+        return TABLE_FULL;
+    }
+    refill(*entry, now_us);
+    if (max_conns_ > 0 && entry->conns >= max_conns_) {
+        ret = CONN_LIMITED;
+    } else if (rate_ > 0 && entry->conn_tokens < 1) {
+        ret = RATE_LIMITED;
+    } else {
+        entry->conn_tokens -= 1;
+        entry->conns++;
+    }
+    shard.mutex.unlock();
+    return ret;
+}
+
+void RateLimiter::release(uint32_t addr) {
+    if (shards_ == nullptr)
+        return;
+    uint64_t h = hash(addr);
+    Shard& shard = shard_of(h);
+    shard.mutex.lock();
+    // 连接关闭前条目不会被淘汰，找不到时说明连接不是acquire通过的
+    Entry* entry = find(shard, addr, h, false, 0);
+    if (entry != nullptr && entry->conns > 0)
+        entry->conns--;
+    shard.mutex.unlock();
+}
+
+bool RateLimiter::admit(uint32_t addr, bool auth, long long now_us) {
+    if (shards_ == nullptr || rate_ == 0)
+        return true;
+    uint64_t h = hash(addr);
+    Shard& shard = shard_of(h);
+    shard.mutex.lock();
+    Entry* entry = find(shard, addr, h, true, now_us);
+    // 有连接的条目不会被淘汰，这里只有连接都已关闭的IP才会找不到，不限制
+    if (entry == nullptr) {
+        shard.mutex.unlock();
+        return true;
+    }
+    refill(*entry, now_us);
+    bool ret = entry->request_tokens >= 1 && (!auth || entry->auth_tokens >= 1);
+    if (ret) {
+        entry->request_tokens -= 1;
+        if (auth)
+            entry->auth_tokens -= 1;
+    }
+    shard.mutex.unlock();
+    return ret;
+}
+
+int RateLimiter::get_size() {
+    int size = 0;
+    for (int i = 0; i < shard_count_; i++) {
+        shards_[i].mutex.lock();
+        size += shards_[i].size;
+        shards_[i].mutex.unlock();
+    }
+    return size;
+}
+
+uint64_t RateLimiter::get_evictions() {
+    uint64_t evictions = 0;
+    for (int i = 0; i < shard_count_; i++) {
+        shards_[i].mutex.lock();
+        evictions += shards_[i].evictions;
+        shards_[i].mutex.unlock();
+    }
+    return evictions;
+}
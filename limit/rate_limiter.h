@@ -0,0 +1,103 @@
+#ifndef RATE_LIMITER_H
+#define RATE_LIMITER_H
+
+#include "pch.h"
+
+#include "lock.h"
+
+/**
+ * @brief 按客户端IP限流，接受连接和处理请求时各检查一次
+ * 每个IP一个条目，包含连接、请求、登录注册三个令牌桶和当前连接数，令牌在访问条目时按经过的时间补充
+ * 按哈希分片，每个分片是定长的条目数组加链式哈希，总内存在init时确定
+ * 条目用满后淘汰分片内最久没有访问且没有连接的IP，找不到时拒绝新的IP，不影响已跟踪IP的连接计数
+ * 主线程接受连接，工作线程检查请求，分片内用互斥锁
+ */
+class RateLimiter {
+public:
+    static constexpr int BURST_SECONDS = 2;     // 令牌桶容量为这么多秒的配额
+    static constexpr int AUTH_DIVISOR = 10;     // 登录注册的速率为普通请求的几分之一
+    static constexpr int MAX_EVICT_SKIP = 8;    // 淘汰时最多跳过几个还有连接的条目
+
+    // 接受连接的检查结果
+    enum Verdict {
+        ALLOW = 0,
+        RATE_LIMITED,                           // 新建连接过快
+        CONN_LIMITED,                           // 并发连接数达到上限
+        TABLE_FULL                              // 条目用满且都还有连接，无法跟踪新的IP
+    };
+
+    // 局部静态变量单例模式
+    static RateLimiter* get_instance() {
+        static RateLimiter limiter;
+        return &limiter;
+    }
+
+    // rate为每个IP每秒的请求数和新建连接数，max_conns为每个IP的并发连接数，0表示不限，都为0时不启用
+    // capacity为最多跟踪的IP数，shard_count为分片数，都向上取2的幂
+    void init(int rate, int max_conns, int capacity = 1 << 16, int shard_count = 16);
+    bool enabled() const {
+        return shards_ != nullptr;
+    }
+
+    // 接受连接时调用，addr为网络字节序，通过时该IP的连接数加一，now_us为单调时钟
+    Verdict acquire(uint32_t addr, long long now_us);
+    // 关闭acquire通过的连接时调用
+    void release(uint32_t addr);
+    // 处理请求前调用，auth为登录注册，额外消耗更严格的令牌桶
+    bool admit(uint32_t addr, bool auth, long long now_us);
+
+    // 跟踪的IP数和累计淘汰数，读取时遍历分片，只用于监控
+    int get_size();
+    uint64_t get_evictions();
+
+private:
+    struct Entry {
+        uint32_t addr;
+        int next;                               // 同一哈希桶中的下一个条目，-1表示结束
+        int lru_prev;                           // 访问顺序链表，头部最近访问
+        int lru_next;
+        int conns;                              // 当前连接数
+        float conn_tokens;
+        float request_tokens;
+        float auth_tokens;
+        long long refill_us;                    // 上次补充令牌的时间
+    };
+
+    struct alignas(64) Shard {
+        Mutex mutex;
+        int* heads;                             // 哈希桶，-1表示空
+        Entry* entries;
+        int size;                               // 已使用的条目数，用满前按顺序分配
+        int lru_head;
+        int lru_tail;
+        uint64_t evictions;
+    };
+
+    RateLimiter() : shards_(nullptr), shard_count_(0), entry_count_(0), rate_(0), max_conns_(0) { }
+    ~RateLimiter();
+
+    void destroy();
+    static uint64_t hash(uint32_t addr) {
+        return addr * 0x9E3779B97F4A7C15ULL;
+    }
+    Shard& shard_of(uint64_t h) {
+        return shards_[(h >> 56) & (shard_count_ - 1)];
+    }
+    // 查找条目，不存在时create为true则新建或淘汰一个，没有可淘汰的条目时返回nullptr，调用时需持有分片互斥锁
+    Entry* find(Shard& shard, uint32_t addr, uint64_t h, bool create, long long now_us);
+    // 按经过的时间补充令牌
+    void refill(Entry& entry, long long now_us);
+    void lru_unlink(Shard& shard, int index);
+    void lru_push(Shard& shard, int index);
+
+    Shard* shards_;
+    int shard_count_;
+    int entry_count_;                           // 每个分片的条目数
+    float rate_;                                // 普通请求和新建连接的每秒令牌数，0表示不限
+    float burst_;
+    float auth_rate_;
+    float auth_burst_;
+    int max_conns_;
+};
+
+#endif
@@ -27,6 +27,10 @@ public:
         return sem_wait(&sem_) == 0;
     }
 
+    bool timewait(struct timespec t) {
+        return sem_timedwait(&sem_, &t) == 0;
+    }
+
     bool post() {
         return sem_post(&sem_) == 0;
     }
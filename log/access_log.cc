@@ -0,0 +1,219 @@
+#include "access_log.h"
+#include "pch.h"
+
+using namespace std;
+
+constexpr char ACCESS_LOG_MAGIC[8] = { 'T', 'W', 'S', 'A', 'C', 'C', '1', '\n' };
+
+// 和HttpConn::Method的顺序一致
+static const char* const METHOD_NAMES[] = { "GET", "POST", "HEAD", "PUT", "DELETE", "TRACE", "OPTIONS", "CONNECT", "PATH" };
+
+static_assert(sizeof(AccessLog::Record) == 128, "access record must be two cache lines");
+
+AccessLog::~AccessLog() {
+    if (running_) {
+        // 通知压缩线程写完剩余记录后退出
+        stop_.store(true);
+        pthread_join(tid_, nullptr);
+    }
+    if (gz_ != nullptr)
+        gzclose(gz_);
+    if (header_ != nullptr)
+        munmap(header_, map_size_);
+}
+
+bool AccessLog::init(const char* path, int capacity) {
+    snprintf(path_, sizeof(path_), "%s", path);
+    char name[256];
+    snprintf(name, sizeof(name), "%s.ring", path);
+    int fd = open(name, O_RDWR | O_CREAT, 0644);
+    if (fd == -1)
+        return false;
+
+    // 文件大小和容量不符时重新创建，旧记录丢弃
+    map_size_ = HEADER_SIZE + (size_t) capacity * sizeof(Record);
+    struct stat st;
+    bool fresh = fstat(fd, &st) == -1 || (size_t) st.st_size != map_size_;
+    if (fresh && (ftruncate(fd, 0) == -1 || ftruncate(fd, map_size_) == -1)) {
+        close(fd);
+        return false;
+    }
+    void* addr = mmap(nullptr, map_size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    // 映射建立后不再需要文件描述符
+    close(fd);
+    if (addr == MAP_FAILED)
+        return false;
+
+    header_ = (Header*) addr;
+    ring_ = (Record*) ((char*) addr + HEADER_SIZE);
+    capacity_ = capacity;
+    uint64_t head = header_->head.load();
+    uint64_t tail = header_->tail.load();
+    if (fresh || memcmp(header_->magic, ACCESS_LOG_MAGIC, sizeof(ACCESS_LOG_MAGIC)) != 0 ||
+        header_->capacity != capacity_ || tail > head || head - tail > capacity_) {
+        memset(addr, 0, map_size_);
+        memcpy(header_->magic, ACCESS_LOG_MAGIC, sizeof(ACCESS_LOG_MAGIC));
+        header_->capacity = capacity_;
+        head = 0;
+    }
+    // 上次退出时还没压缩的记录由压缩线程补写，其中没写完的跳过
+    recover_end_ = head;
+
+    running_ = pthread_create(&tid_, nullptr, compress_thread, nullptr) == 0;
+    if (!running_) {
+        munmap(header_, map_size_);
+        header_ = nullptr;
+        ring_ = nullptr;
+        return false;
+    }
+    return true;
+}
+
+void AccessLog::record(const sockaddr_in& addr, int method, const char* path, int status, int bytes,
+    int queue_us, int parse_us, int handler_us, int write_us) {
+    if (ring_ == nullptr)
+        return;
+
+    // 占用一个位置，压缩线程跟不上时丢弃，不让工作线程等待
+    uint64_t head = header_->head.load(memory_order_relaxed);
+    do {
+        if (head - header_->tail.load(memory_order_acquire) >= capacity_) {
+            header_->dropped.fetch_add(1, memory_order_relaxed);
+            return;
+        }
+    } while (!header_->head.compare_exchange_weak(head, head + 1, memory_order_relaxed));
+
+    Record* r = &ring_[head % capacity_];
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    r->time_us = now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+    r->addr = addr.sin_addr.s_addr;
+    r->port = addr.sin_port;
+    r->status = status;
+    r->bytes = max(bytes, 0);
+    r->queue_us = max(queue_us, 0);
+    r->parse_us = max(parse_us, 0);
+    r->handler_us = max(handler_us, 0);
+    r->write_us = max(write_us, 0);
+    r->method = method;
+    if (path == nullptr)
+        path = "-";
+    int len = strnlen(path, PATH_LEN);
+    memcpy(r->path, path, len);
+    r->path_len = len;
+    // 发布记录，压缩线程看到seq后才读取其余字段
+    r->seq.store(head + 1, memory_order_release);
+}
+
+void* AccessLog::compress_thread(void*) {
+    AccessLog::get_instance()->compress();
+    return nullptr;
+}
+
+void AccessLog::compress() {
+    char* batch = new char[BATCH_SIZE];
+    long long last_flush = now_us();
+    while (true) {
+        bool stop = stop_.load();
+        int n = drain(batch);
+        // 压缩数据定期刷到文件，进程崩溃时最多丢失最后一秒
+        if (gz_ != nullptr && now_us() - last_flush >= FLUSH_INTERVAL * 1000LL) {
+            gzflush(gz_, Z_SYNC_FLUSH);
+            last_flush = now_us();
+        }
+        if (stop)
+            break;
+        if (n == 0)
+            usleep(IDLE_WAIT * 1000);
+    }
+    delete[] batch;
+}
+
+int AccessLog::drain(char* batch) {
+    uint64_t tail = header_->tail.load(memory_order_relaxed);
+    uint64_t head = header_->head.load(memory_order_acquire);
+    int len = 0;
+    int count = 0;
+    while (tail < head) {
+        Record* r = &ring_[tail % capacity_];
+        if (r->seq.load(memory_order_acquire) != tail + 1) {
+            // 工作线程还没写完，下次再取
+            if (tail >= recover_end_)
+                break;
+            // 上次退出前没写完的记录
+            header_->tail.store(++tail, memory_order_release);
+            continue;
+        }
+
+        // 时间每秒只转换一次，按记录时间切换到当天的文件
+        time_t t = r->time_us / 1000000;
+        if (t != second_) {
+            second_ = t;
+            localtime_r(&t, &tm_);
+        }
+        if (tm_.tm_mday != date_ || gz_ == nullptr) {
+            if (len > 0 && gz_ != nullptr)
+                gzwrite(gz_, batch, len);
+            len = 0;
+            rotate(&tm_);
+        }
+
+        if (len + LINE_SIZE > BATCH_SIZE) {
+            if (gz_ != nullptr)
+                gzwrite(gz_, batch, len);
+            len = 0;
+        }
+        len += format(*r, batch + len, BATCH_SIZE - len);
+        // 记录已经复制出来，位置可以被工作线程复用
+        header_->tail.store(++tail, memory_order_release);
+        count++;
+    }
+    if (len > 0 && gz_ != nullptr)
+        gzwrite(gz_, batch, len);
+    return count;
+}
+
+void AccessLog::rotate(const struct tm* p_tm) {
+    if (gz_ != nullptr)
+        gzclose(gz_);
+    date_ = p_tm->tm_mday;
+    char name[256];
+    snprintf(name, sizeof(name), "%s_%d_%02d_%02d.gz", path_, p_tm->tm_year + 1900, p_tm->tm_mon + 1, p_tm->tm_mday);
+    // 追加写入新的gzip成员，重启后仍能整体解压，压缩级别1优先保证吞吐
+    gz_ = gzopen(name, "ab1");
+    if (gz_ == nullptr)
+        STDERR_FUNC_LINE();
+}
+
+int AccessLog::format(const Record& record, char* buf, int size) {
+    const struct tm& tm = tm_;
+    char ip[INET_ADDRSTRLEN];
+    struct in_addr in;
+    in.s_addr = record.addr;
+    inet_ntop(AF_INET, &in, ip, sizeof(ip));
+
+    // 路径来自请求，需要转义引号、反斜杠和控制字符
+    char path[PATH_LEN * 6 + 1];
+    int n = 0;
+    for (int i = 0; i < record.path_len && i < PATH_LEN; i++) {
+        unsigned char c = record.path[i];
+        if (c == '"' || c == '\\') {
+            path[n++] = '\\';
+            path[n++] = c;
+        } else if (c < 0x20 || c >= 0x7f) {
+            n += snprintf(path + n, sizeof(path) - n, "\\u%04x", c);
+        } else {
+            path[n++] = c;
+        }
+    }
+    path[n] = '\0';
+
+    const char* method = record.method < sizeof(METHOD_NAMES) / sizeof(METHOD_NAMES[0]) ? METHOD_NAMES[record.method] : "-";
+    int len = snprintf(buf, size,
+        "{\"time\":\"%d-%02d-%02dT%02d:%02d:%02d.%06lld\",\"ip\":\"%s\",\"port\":%d,\"method\":\"%s\",\"path\":\"%s\","
+        "\"status\":%d,\"bytes\":%u,\"queue_us\":%u,\"parse_us\":%u,\"handler_us\":%u,\"write_us\":%u}\n",
+        tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec,
+        (long long) (record.time_us % 1000000), ip, ntohs(record.port), method, path,
+        record.status, record.bytes, record.queue_us, record.parse_us, record.handler_us, record.write_us);
+    return min(len, size - 1);
+}
@@ -0,0 +1,108 @@
+#ifndef ACCESS_LOG_H
+#define ACCESS_LOG_H
+
+#include "pch.h"
+
+/**
+ * @brief 访问日志，每个完成的响应一条定长记录
+ * 记录写入mmap映射的环形文件，工作线程只做一次CAS占位和一次内存拷贝，不做格式化和系统调用
+ * 后台线程按顺序取出记录，格式化成JSON行，用zlib压缩写入按天切换的.gz文件
+ * 环形文件满时丢弃新记录并计数，不阻塞请求；进程崩溃后未压缩的记录留在环形文件里，下次启动时补写
+ */
+class AccessLog {
+public:
+    static constexpr int PATH_LEN = 82;             // 记录中路径的最大长度，超出截断
+
+    // 一条访问记录，正好两个cache line
+    struct Record {
+        std::atomic<uint64_t> seq;                  // 占位序号加1，写完后发布，读取方据此判断记录是否完整
+        uint64_t time_us;                           // 响应完成的墙上时间，单位us
+        uint32_t addr;                              // 客户端IPv4地址，网络字节序
+        uint16_t port;                              // 客户端端口，网络字节序
+        uint16_t status;                            // 响应状态码
+        uint32_t bytes;                             // 发送的字节数
+        uint32_t queue_us;                          // 读完请求到工作线程开始处理
+        uint32_t parse_us;                          // 解析请求
+        uint32_t handler_us;                        // 生成响应，包括等待数据库
+        uint32_t write_us;                          // 生成响应到发送完成
+        uint8_t method;                             // HttpConn::Method
+        uint8_t path_len;
+        char path[PATH_LEN];
+    };
+
+    // 局部静态变量单例模式
+    static AccessLog* get_instance() {
+        static AccessLog access_log;
+        return &access_log;
+    }
+
+    // 单调时钟，单位us，用于计算各阶段耗时
+    static long long now_us() {
+        struct timespec t;
+        clock_gettime(CLOCK_MONOTONIC, &t);
+        return t.tv_sec * 1000000LL + t.tv_nsec / 1000;
+    }
+
+    // 打开或创建path.ring环形文件，容量为capacity条记录，压缩文件名为path_日期.gz
+    bool init(const char* path, int capacity = 1 << 16);
+    bool enabled() const {
+        return ring_ != nullptr;
+    }
+
+    // 追加一条记录，未启用或者环形文件已满时直接返回，method是HttpConn::Method
+    void record(const sockaddr_in& addr, int method, const char* path, int status, int bytes,
+        int queue_us, int parse_us, int handler_us, int write_us);
+
+    // 因为环形文件已满而丢弃的记录数，保存在环形文件中，跨重启累计
+    unsigned long long get_dropped() const {
+        return header_ != nullptr ? header_->dropped.load() : 0;
+    }
+
+private:
+    // 环形文件头，占用第一页
+    struct Header {
+        char magic[8];
+        uint64_t capacity;
+        std::atomic<uint64_t> head;                 // 下一个要占用的位置
+        std::atomic<uint64_t> tail;                 // 下一个要压缩的位置
+        std::atomic<uint64_t> dropped;
+    };
+
+    static constexpr int HEADER_SIZE = 4096;        // 文件头占用的字节数，记录从第二页开始
+    static constexpr int IDLE_WAIT = 10;            // 没有记录时压缩线程的等待时间，单位ms
+    static constexpr int FLUSH_INTERVAL = 1000;     // 压缩数据刷到文件的最长间隔，单位ms
+    static constexpr int BATCH_SIZE = 1 << 16;      // 一次gzwrite的最大字节数
+    static constexpr int LINE_SIZE = 1024;          // 单条记录格式化后的最大长度
+
+    AccessLog() : header_(nullptr), ring_(nullptr), capacity_(0), map_size_(0), recover_end_(0),
+        gz_(nullptr), date_(0), second_(0), running_(false), stop_(false) { }
+    ~AccessLog();
+
+    // 后台压缩线程
+    static void* compress_thread(void* arg);
+    void compress();
+    // 压缩并写出当前所有已发布的记录，返回处理的条数
+    int drain(char* batch);
+    // 把一条记录格式化成JSON行，时间使用tm_，返回长度
+    int format(const Record& record, char* buf, int size);
+    // 按日期打开压缩文件
+    void rotate(const struct tm* p_tm);
+
+    Header* header_;
+    Record* ring_;
+    uint64_t capacity_;
+    size_t map_size_;
+    uint64_t recover_end_;                          // 启动时已经占用的位置，其中没有写完的记录直接跳过
+
+    char path_[128];                                // 压缩文件名前缀
+    gzFile gz_;                                     // 当天的压缩文件，只有压缩线程访问
+    int date_;
+    time_t second_;                                 // tm_对应的秒，压缩线程按秒缓存时间转换
+    struct tm tm_;
+
+    bool running_;
+    std::atomic<bool> stop_;
+    pthread_t tid_;
+};
+
+#endif
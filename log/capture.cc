@@ -0,0 +1,102 @@
+#include "capture.h"
+#include "access_log.h"
+#include "pch.h"
+
+using namespace std;
+
+Capture::~Capture() {
+    if (running_) {
+        // 通知写线程写完剩余数据后退出
+        mutex_.lock();
+        stop_ = true;
+        mutex_.unlock();
+        cond_.signal();
+        pthread_join(tid_, nullptr);
+    }
+    if (fp_ != nullptr)
+        fclose(fp_);
+}
+
+bool Capture::init(const char* path, int buffer_size) {
+    fp_ = fopen(path, "ab");
+    if (fp_ == nullptr)
+        return false;
+
+    FileHeader header;
+    memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    header.start_us = now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+    // 追加到已有文件时文件头也追加，回放时据此分段
+    fwrite(&header, sizeof(header), 1, fp_);
+    fflush(fp_);
+
+    buffer_size_ = buffer_size;
+    buffer_.reserve(buffer_size_);
+    running_ = pthread_create(&tid_, nullptr, flush_thread, nullptr) == 0;
+    return running_;
+}
+
+uint64_t Capture::open_conn(const sockaddr_in& addr) {
+    if (!running_)
+        return 0;
+    uint64_t conn = next_conn_.fetch_add(1, memory_order_relaxed);
+    write(conn, OPEN, (const char*) &addr, sizeof(addr));
+    return conn;
+}
+
+void Capture::write(uint64_t conn, Type type, const char* data, int len) {
+    if (!running_ || conn == 0)
+        return;
+    RecordHeader header;
+    header.time_us = AccessLog::now_us();
+    header.conn = conn;
+    header.len = len;
+    header.type = type;
+    header.reserved = 0;
+
+    mutex_.lock();
+    if (buffer_.size() + sizeof(header) + len > buffer_size_) {
+        mutex_.unlock();
+        dropped_.fetch_add(1, memory_order_relaxed);
+        return;
+    }
+    buffer_.append((const char*) &header, sizeof(header));
+    buffer_.append(data, len);
+    mutex_.unlock();
+}
+
+void* Capture::flush_thread(void*) {
+    Capture::get_instance()->flush_loop();
+    return nullptr;
+}
+
+void Capture::flush_loop() {
+    string batch;
+    batch.reserve(buffer_size_);
+    while (true) {
+        mutex_.lock();
+        if (!stop_) {
+            timespec t;
+            clock_gettime(CLOCK_REALTIME, &t);
+            t.tv_nsec += FLUSH_INTERVAL * 1000000LL;
+            if (t.tv_nsec >= 1000000000) {
+                t.tv_sec++;
+                t.tv_nsec -= 1000000000;
+            }
+            cond_.timewait(mutex_.get(), t);
+        }
+        // 交换缓冲区，在锁外写文件
+        batch.swap(buffer_);
+        bool stop = stop_;
+        mutex_.unlock();
+
+        if (!batch.empty()) {
+            fwrite(batch.data(), 1, batch.size(), fp_);
+            fflush(fp_);
+            batch.clear();
+        }
+        if (stop)
+            break;
+    }
+}
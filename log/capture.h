@@ -0,0 +1,81 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include "pch.h"
+
+#include "lock.h"
+
+/**
+ * @brief 流量捕获，把收到的原始请求字节按连接和时间写入二进制文件，供tinyreplay回放
+ * 文件开头是FileHeader，之后每条记录是一个RecordHeader加上len字节数据
+ * 连接用进程内递增的id区分，文件描述符复用时不会混淆；OPEN和CLOSE记录保留长连接的使用方式
+ * 写入方只在锁内追加到内存缓冲区，后台线程定期交换缓冲区后写文件
+ * 缓冲区超过上限时丢弃新记录并计数，不阻塞请求
+ */
+class Capture {
+public:
+    static constexpr char MAGIC[8] = { 'T', 'W', 'S', 'C', 'A', 'P', '1', '\n' };
+
+    enum Type {
+        OPEN = 0,               // 建立连接，数据为客户端地址sockaddr_in
+        DATA,                   // 从套接字读到的数据
+        CLOSE                   // 关闭连接，没有数据
+    };
+
+    struct FileHeader {
+        char magic[8];
+        uint64_t start_us;      // 开始捕获的墙上时间，单位us
+    };
+
+    // 记录头，数据紧随其后
+    struct RecordHeader {
+        uint64_t time_us;       // 单调时钟，单位us
+        uint64_t conn;          // 连接id
+        uint32_t len;           // 数据长度
+        uint16_t type;          // Type
+        uint16_t reserved;
+    };
+
+    // 局部静态变量单例模式
+    static Capture* get_instance() {
+        static Capture capture;
+        return &capture;
+    }
+
+    // 以追加方式打开捕获文件，buffer_size为内存缓冲区上限
+    bool init(const char* path, int buffer_size = 1 << 22);
+    bool enabled() const {
+        return running_;
+    }
+
+    // 分配一个连接id，未启用时返回0
+    uint64_t open_conn(const sockaddr_in& addr);
+    void write(uint64_t conn, Type type, const char* data, int len);
+
+    // 因为缓冲区已满而丢弃的记录数
+    unsigned long long get_dropped() const {
+        return dropped_.load(std::memory_order_relaxed);
+    }
+
+private:
+    static constexpr int FLUSH_INTERVAL = 100;      // 缓冲区写到文件的最长间隔，单位ms
+
+    Capture() : fp_(nullptr), buffer_size_(0), running_(false), stop_(false), next_conn_(1), dropped_(0) { }
+    ~Capture();
+
+    static void* flush_thread(void* arg);
+    void flush_loop();
+
+    FILE* fp_;
+    size_t buffer_size_;
+    Mutex mutex_;                                   // 保护buffer_和stop_
+    Cond cond_;
+    std::string buffer_;                            // 写入方追加的缓冲区
+    bool running_;
+    bool stop_;
+    pthread_t tid_;
+    std::atomic<uint64_t> next_conn_;
+    std::atomic<unsigned long long> dropped_;
+};
+
+#endif
@@ -3,145 +3,394 @@
 
 using namespace std;
 
+bool Log::binary_ = false;
+
 Log::~Log() {
-    if (fp_ != nullptr)
-        fclose(fp_);
+    if (running_) {
+        // 通知写线程写出剩余日志后退出
+        stop_.store(true);
+        wake_.post();
+        pthread_join(tid_, nullptr);
+    }
+    for (Ring* ring : rings_)
+        delete ring;
+    if (fd_ != -1)
+        close(fd_);
+    if (retired_fd_ != -1)
+        close(retired_fd_);
+    if (next_fd_ != -1)
+        close(next_fd_);
 }
 
 void* Log::async_write_log() {
-    string temp;
-    // 从阻塞队列中取出一个日志string，写入文件
-    while (log_queue_->pop(temp)) {
-        mutex_.lock();
-        fputs(temp.c_str(), fp_);
-        mutex_.unlock();
+    while (true) {
+        bool stop = stop_.load();
+        struct timespec t;
+        clock_gettime(CLOCK_REALTIME, &t);
+        t.tv_sec += FLUSH_INTERVAL / 1000;
+        t.tv_nsec += (FLUSH_INTERVAL % 1000) * 1000000;
+        if (t.tv_nsec >= 1000000000) {
+            t.tv_sec++;
+            t.tv_nsec -= 1000000000;
+        }
+        if (!stop)
+            wake_.timewait(t);
+
+        // 同步模式下调用线程自己写文件，写线程只负责切换
+        if (isasync_) {
+            long long lines = drain();
+            count_.fetch_add(lines);
+        }
+        maintain();
+        if (stop)
+            break;
     }
     return nullptr;
 }
 
-// 异步需要设置阻塞队列的长度，同步不需要设置
-bool Log::init(const char* filename, bool close_log, int buf_size, int max_lines, int max_queue_size) {
-    // 如果设置了max_queue_size，则设置为异步
-    if (max_queue_size > 0) {
-        // 设置写入方式
-        isasync_ = true;
-        // 创建并设置阻塞队列长度
-        log_queue_ = new BlockingQueue<string>(max_queue_size);
-        pthread_t tid;
-        // flush_log_thread为的回调函数，这里表示创建线程异步写日志
-        pthread_create(&tid, nullptr, flush_log_thread, nullptr);
+void Log::maintain() {
+    time_t now = time(nullptr);
+    struct tm tm;
+    localtime_r(&now, &tm);
+
+    // 跨天切换到当天的文件
+    if (date_ != tm.tm_mday) {
+        date_ = tm.tm_mday;
+        count_ = 0;
+        part_ = 0;
+        rotate(&tm, 0);
+        return;
+    }
+    // 超过了最大行，在之前的日志名基础上加后缀，二进制模式不按行数切换
+    if (!binary_ && count_ / max_lines_ > part_) {
+        part_ = count_ / max_lines_;
+        rotate(&tm, part_);
+        return;
     }
 
+    // 快到切换时间时提前打开下一个文件，切换时只需要交换文件描述符
+    if (next_fd_ != -1)
+        return;
+    time_t later = now + PREPARE_AHEAD;
+    struct tm next;
+    localtime_r(&later, &next);
+    if (next.tm_mday != tm.tm_mday)
+        prepare(&next, 0);
+    else if (!binary_ && count_ >= (part_ + 1) * max_lines_ - max_lines_ / 10)
+        prepare(&tm, part_ + 1);
+}
+
+bool Log::log_name(char* name, size_t size, const struct tm* p_tm, long long part) {
+    int n;
+    if (part > 0)
+        n = snprintf(name, size, "%s%d_%02d_%02d_%s.%lld", dir_,
+            p_tm->tm_year + 1900, p_tm->tm_mon + 1, p_tm->tm_mday, filename_, part);
+    else
+        n = snprintf(name, size, "%s%d_%02d_%02d_%s", dir_,
+            p_tm->tm_year + 1900, p_tm->tm_mon + 1, p_tm->tm_mday, filename_);
+    return n >= 0 && (size_t) n < size;
+}
+
+void Log::prepare(const struct tm* p_tm, long long part) {
+    if (log_name(next_name_, sizeof(next_name_), p_tm, part))
+        next_fd_ = open(next_name_, O_WRONLY | O_CREAT | O_APPEND, 0644);
+}
+
+// 异步模式下每行都写入线程自己的缓冲区，同步模式直接写文件
+bool Log::init(const char* filename, bool close_log, int buf_size, int max_lines, bool async, bool binary) {
     close_log_ = close_log;
-    // 输出内容的长度
-    buf_size_ = buf_size;
-    buf_ = new char[buf_size_];
-    bzero(buf_, sizeof(char) * buf_size_);
+    // 单行日志的最大长度，不超过线程栈上缓冲区的大小
+    buf_size_ = max(64, min(buf_size, LINE_SIZE));
     // 日志的最大行数
     max_lines_ = max_lines;
 
     time_t t = time(nullptr);
-    struct tm* p_tm = localtime(&t);
-    // 从后往前找到第一个/的位置
-    const char* p = strrchr(filename, '/');
-    char log_name[256];
-    bzero(log_name, sizeof(log_name));
-
-    // 相当于自定义日志名
+    struct tm tm;
+    localtime_r(&t, &tm);
+    // 从后往前找到第一个/的位置，前面是目录，后面是文件名
     // 若输入的文件名没有/，则直接将时间+文件名作为日志名
-    if (p == nullptr) {
-        snprintf(log_name, 512, "%d_%02d_%02d_%s", p_tm->tm_year + 1900, p_tm->tm_mon + 1, p_tm->tm_mday, filename);
-    } else {
-        // 将/的位置向后移动一个位置，然后复制到filename_中
-        // p - filename + 1是文件所在路径文件夹的长度
-        // dir_相当于./
-        strcpy(filename_, p + 1);
-        strncpy(dir_, filename, p - filename + 1);
-        // 后面的参数和format有关
-        snprintf(log_name, 512, "%s%d_%02d_%02d_%s", dir_, p_tm->tm_year + 1900, p_tm->tm_mon + 1, p_tm->tm_mday, filename_);
-    }
-    date_ = p_tm->tm_mday;
+    const char* p = strrchr(filename, '/');
+    // 目录或文件名过长时不截断，直接初始化失败
+    const char* base = p == nullptr ? filename : p + 1;
+    int dir_len = p == nullptr ? 0 : p - filename + 1;
+    if (dir_len >= (int) sizeof(dir_) || strlen(base) >= sizeof(filename_))
+        return false;
+    snprintf(dir_, sizeof(dir_), "%.*s", dir_len, filename);
+    snprintf(filename_, sizeof(filename_), "%s", base);
+    date_ = tm.tm_mday;
 
-    fp_ = fopen(log_name, "a");
-    if (fp_ == nullptr)
+    char name[NAME_SIZE];
+    if (!log_name(name, sizeof(name), &tm, 0))
         return false;
+    fd_ = open(name, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd_ == -1)
+        return false;
+
+    // 写线程负责切换文件，异步模式下还负责写出日志，二进制模式依赖它写出调用点定义
+    isasync_ = async || binary;
+    binary_ = binary;
+    // flush_log_thread为的回调函数，这里表示创建线程异步写日志
+    running_ = pthread_create(&tid_, nullptr, flush_log_thread, nullptr) == 0;
+    if (!running_) {
+        isasync_ = false;
+        binary_ = false;
+    }
     return true;
 }
 
-void Log::write_log(int level, const char* format, ...) {
-    struct timeval now = { 0, 0 };
-    gettimeofday(&now, nullptr);
-    time_t t = now.tv_sec;
-    struct tm* p_tm = localtime(&t);
-    char str[16];
-    bzero(str, sizeof(str));
+Log::Ring* Log::local_ring() {
+    thread_local RingHolder holder;
+    if (holder.ring != nullptr)
+        return holder.ring;
 
-    // 日志分级
-    if (level == 0) strcpy(str, "[debug]:");
-    else if (level == 1) strcpy(str, "[info]:");
-    else if (level == 2) strcpy(str, "[warn]:");
-    else if (level == 3) strcpy(str, "[error]:");
-    else strcpy(str, "[info]:");
-    
+    // 优先复用已退出线程的缓冲区，剩余的日志仍由写线程写出
     mutex_.lock();
-    // 更新现有行数
-    count_++;
-
-    // 日志不是今天或写入的日志行数是最大行的倍数
-    // max_lines_为最大行数
-    if (date_ != p_tm->tm_mday || count_ % max_lines_ == 0) {
-        char new_log[256];
-        bzero(new_log, sizeof(new_log));
-        fflush(fp_);
-        fflush(fp_);
-        char tail[16];
-        bzero(tail, sizeof(tail));
-
-        // 格式化日志名的中间部分
-        snprintf(tail, 16, "%d_%02d_%02d_", p_tm->tm_year + 1900, p_tm->tm_mon + 1, p_tm->tm_mday);
-
-        // 如果时间不是今天，则创建今天的日志，更新date_和count_
-        if (date_ != p_tm->tm_mday) {
-            snprintf(new_log, 512, "%s%s%s", dir_, tail, filename_);
-            date_ = p_tm->tm_mday;
-            count_ = 0;
-        } else {
-            // 超过了最大行，在之前的日志名基础上加后缀，count_/max_lines_
-            snprintf(new_log, 512, "%s%s%s.%lld", dir_, tail, filename_, count_ / max_lines_);
+    for (Ring* ring : rings_) {
+        if (!ring->owned.load(memory_order_acquire)) {
+            ring->owned.store(true, memory_order_relaxed);
+            holder.ring = ring;
+            break;
+        }
+    }
+    if (holder.ring == nullptr) {
+        holder.ring = new Ring();
+        rings_.push_back(holder.ring);
+    }
+    mutex_.unlock();
+    return holder.ring;
+}
+
+void Log::append(const char* line, int len) {
+    Ring* ring = local_ring();
+    unsigned long long head = ring->head.load(memory_order_relaxed);
+    // 空间不足时唤醒写线程，让出CPU等它写出
+    while (head + len - ring->tail.load(memory_order_acquire) > RING_SIZE) {
+        // 写线程已经退出，只能直接写文件
+        if (stop_.load(memory_order_relaxed)) {
+            if (write(fd_, line, len) != len)
+                STDERR_FUNC_LINE();
+            return;
         }
-        fp_ = fopen(new_log, "a");
+        wake_.post();
+        sched_yield();
     }
 
+    // 跨过缓冲区末尾时分两段复制
+    int pos = head % RING_SIZE;
+    int first = min(len, RING_SIZE - pos);
+    memcpy(ring->data + pos, line, first);
+    memcpy(ring->data, line + first, len - first);
+    ring->head.store(head + len, memory_order_release);
+
+    // 刚超过一半时唤醒写线程，平时由写线程定时写出
+    unsigned long long used = head + len - ring->tail.load(memory_order_relaxed);
+    if (used >= RING_SIZE / 2 && used - len < RING_SIZE / 2)
+        wake_.post();
+}
+
+long long Log::drain() {
+    mutex_.lock();
+    vector<Ring*> rings(rings_);
     mutex_.unlock();
-    
-    va_list valist;
-    // 将传入的format参数赋值给valist，便于格式化输出
-    va_start(valist, format);
 
-    string temp;
+    struct iovec iv[IOV_MAX];
+    long long lines = 0;
+    size_t i = 0;
+    while (i < rings.size()) {
+        // 每次最多取IOV_MAX / 2个缓冲区，每个最多两段
+        int n = 0;
+        size_t total = 0;
+        size_t begin = i;
+        vector<unsigned long long> heads;
+        for (; i < rings.size() && n + 2 <= IOV_MAX; i++) {
+            Ring* ring = rings[i];
+            unsigned long long head = ring->head.load(memory_order_acquire);
+            unsigned long long tail = ring->tail.load(memory_order_relaxed);
+            heads.push_back(head);
+            if (head == tail)
+                continue;
+            int pos = tail % RING_SIZE;
+            int len = head - tail;
+            int first = min(len, RING_SIZE - pos);
+            iv[n].iov_base = ring->data + pos;
+            iv[n++].iov_len = first;
+            if (len > first) {
+                iv[n].iov_base = ring->data;
+                iv[n++].iov_len = len - first;
+            }
+            total += len;
+        }
+        if (n == 0)
+            continue;
+
+        // 二进制模式下先写出新登记的调用点，它们一定在本批记录之前登记
+        if (binary_)
+            write_sites();
+        else
+            for (int j = 0; j < n; j++)
+                lines += count((char*) iv[j].iov_base, (char*) iv[j].iov_base + iv[j].iov_len, '\n');
+
+        // 写入不完整时跳过已写出的部分继续写
+        struct iovec* cur = iv;
+        int left = n;
+        while (total > 0) {
+            ssize_t ret = writev(fd_, cur, left);
+            if (ret < 0) {
+                if (errno == EINTR)
+                    continue;
+                STDERR_FUNC_LINE();
+                break;
+            }
+            total -= ret;
+            while (left > 0 && (size_t) ret >= cur->iov_len) {
+                ret -= cur->iov_len;
+                cur++;
+                left--;
+            }
+            if (left > 0) {
+                cur->iov_base = (char*) cur->iov_base + ret;
+                cur->iov_len -= ret;
+            }
+        }
+
+        // 写出之后才归还空间
+        for (size_t j = begin; j < i; j++)
+            rings[j]->tail.store(heads[j - begin], memory_order_release);
+    }
+    return lines;
+}
+
+void Log::rotate(const struct tm* p_tm, long long part) {
+    char name[NAME_SIZE];
+    if (!log_name(name, sizeof(name), p_tm, part))
+        return;
+    // 优先使用提前打开的文件
+    int fd = -1;
+    if (next_fd_ != -1 && strcmp(next_name_, name) == 0) {
+        fd = next_fd_;
+    } else {
+        if (next_fd_ != -1)
+            close(next_fd_);
+        fd = open(name, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    }
+    next_fd_ = -1;
+    if (fd == -1)
+        return;
+
+    int old = fd_.exchange(fd);
+    // 新文件需要重新写入所有调用点定义
+    written_sites_ = 0;
+    // 异步模式下只有写线程写文件，旧文件直接关闭
+    // 同步模式下其他线程可能刚取到旧文件描述符还没写，推迟到下一次切换时再关闭
+    if (isasync_) {
+        close(old);
+    } else {
+        if (retired_fd_ != -1)
+            close(retired_fd_);
+        retired_fd_ = old;
+    }
+}
+
+int Log::register_site(int level, const char* format) {
     mutex_.lock();
+    int site = sites_.size();
+    sites_.push_back(Site{ level, format });
+    mutex_.unlock();
+    return site;
+}
 
-    // 写入内容格式：时间 + 内容
-    // 时间格式化，snprintf成功返回写字符的总数，其中不包括结尾的空字符
-    int n = snprintf(buf_, 48, "%d-%02d-%02d %02d:%02d:%02d.%06ld %s ",
-        p_tm->tm_year + 1900, p_tm->tm_mon + 1, p_tm->tm_mday,
-        p_tm->tm_hour, p_tm->tm_min, p_tm->tm_sec, now.tv_usec, str);
-    // 内容格式化，用于向字符串中打印数据、数据格式用户自定义，返回写入到字符数组str中的字符个数，其中不包括结尾的空字符
-    int m = vsnprintf(buf_ + n, buf_size_ - 1, format, valist);
-    buf_[n + m] = '\n';
-    buf_[n + m + 1] = '\0';
-    temp = buf_;
+void Log::write_sites() {
+    string buf;
+    // 新文件先写文件头
+    if (written_sites_ == 0) {
+        struct stat st;
+        if (fstat(fd_, &st) == 0 && st.st_size == 0)
+            buf.append(LOG_MAGIC, sizeof(LOG_MAGIC));
+    }
 
+    mutex_.lock();
+    for (; written_sites_ < sites_.size(); written_sites_++) {
+        const Site& site = sites_[written_sites_];
+        uint32_t id = written_sites_;
+        uint32_t level = site.level;
+        size_t format_len = strlen(site.format) + 1;
+        LogRecordHeader header{ (uint32_t) (sizeof(header) + sizeof(id) + sizeof(level) + format_len), LOG_SITE_DEFINE, 0 };
+        buf.append((char*) &header, sizeof(header));
+        buf.append((char*) &id, sizeof(id));
+        buf.append((char*) &level, sizeof(level));
+        buf.append(site.format, format_len);
+    }
     mutex_.unlock();
 
-    // 若isasync_为true表示异步，默认为同步
-    // 若异步，则将日志信息加入阻塞队列，同步则加锁向文件中写
-    if (isasync_ && !log_queue_->full()) {
-        log_queue_->push(temp);
-    } else {
-        mutex_.lock();
-        fputs(temp.c_str(), fp_);
-        mutex_.unlock();
+    if (!buf.empty() && write(fd_, buf.data(), buf.size()) != (ssize_t) buf.size())
+        STDERR_FUNC_LINE();
+}
+
+void Log::write_log(int level, const char* format, ...) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    const char* str;
+
+    // 日志分级
+    if (level == 0) str = "[debug]:";
+    else if (level == 1) str = "[info]:";
+    else if (level == 2) str = "[warn]:";
+    else if (level == 3) str = "[error]:";
+    else str = "[info]:";
+
+    // 每个线程缓存精确到秒的时间前缀，每秒只做一次时区转换
+    thread_local time_t prefix_sec = -1;
+    thread_local char prefix[32];
+    thread_local int prefix_len = 0;
+    if (now.tv_sec != prefix_sec) {
+        struct tm tm;
+        localtime_r(&now.tv_sec, &tm);
+        prefix_len = snprintf(prefix, sizeof(prefix), "%d-%02d-%02d %02d:%02d:%02d.",
+            tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec);
+        prefix_sec = now.tv_sec;
     }
+
+    // 写入内容格式：时间 + 内容，格式化在线程栈上，不需要加锁
+    char buf[LINE_SIZE];
+    memcpy(buf, prefix, prefix_len);
+    int n = prefix_len;
+    // 微秒部分固定6位
+    long usec = now.tv_nsec / 1000;
+    for (int i = 5; i >= 0; i--, usec /= 10)
+        buf[n + i] = '0' + usec % 10;
+    n += 6;
+    buf[n++] = ' ';
+    int str_len = strlen(str);
+    memcpy(buf + n, str, str_len);
+    n += str_len;
+    buf[n++] = ' ';
+
+    va_list valist;
+    // 将传入的format参数赋值给valist，便于格式化输出
+    va_start(valist, format);
+    // 内容格式化，超过单行最大长度时截断
+    int m = vsnprintf(buf + n, buf_size_ - n - 1, format, valist);
     va_end(valist);
+    if (m < 0)
+        m = 0;
+    else if (m > buf_size_ - n - 2)
+        m = buf_size_ - n - 2;
+    buf[n + m] = '\n';
+    int len = n + m + 1;
+
+    // 若isasync_为true表示异步，默认为同步
+    if (isasync_) {
+        append(buf, len);
+        // 错误日志尽快写出
+        if (level >= 3)
+            wake_.post();
+        return;
+    }
+
+    // 同步模式下O_APPEND保证每行完整追加
+    if (write(fd_, buf, len) != len)
+        STDERR_FUNC_LINE();
+    // 写入的日志行数是最大行的倍数时通知写线程切换文件
+    if (++count_ % max_lines_ == 0)
+        wake_.post();
 }
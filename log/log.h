@@ -4,36 +4,125 @@
 #include "pch.h"
 
 #include "config.h"
-#include "blocking_queue.h"
+#include "lock.h"
+#include "log_record.h"
+
+// 日志级别
+enum LogLevel {
+    LOG_LEVEL_DEBUG = 0,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_WARN,
+    LOG_LEVEL_ERROR
+};
+
+// 编译期最低日志级别，低于它的日志宏展开为空语句，参数不会被编译进去
+// 由CMake的LOG_MIN_LEVEL选项设置
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL 0
+#endif
+
+// 写入一条日志，二进制模式下每个调用点第一次执行时登记格式串，之后只写入调用点编号和原始参数
+#define LOG_EMIT(level, format, ...)\
+    do {\
+        if (Log::binary_) {\
+            static const int log_site = Log::get_instance()->register_site(level, format);\
+            Log::get_instance()->write_binary(log_site, ##__VA_ARGS__);\
+        } else {\
+            Log::get_instance()->write_log(level, format, ##__VA_ARGS__);\
+        }\
+    } while (0)
+
+// 运行期再按Config::log_level_过滤，只有级别打开时才会求值参数和格式化
+#define LOG_BASE(level, format, ...)\
+    do {\
+        if (!Config::close_log_ && (level) >= Config::log_level_)\
+            LOG_EMIT(level, format, ##__VA_ARGS__);\
+    } while (0)
+
+// 单个调用点限速，每秒最多burst条，超出的只计数，下一秒输出第一条时一并报告
+#define LOG_LIMIT(level, burst, format, ...)\
+    do {\
+        if (!Config::close_log_ && (level) >= Config::log_level_ && (level) >= LOG_MIN_LEVEL) {\
+            static LogRateLimit log_rate_limit(burst);\
+            long long log_suppressed = 0;\
+            if (log_rate_limit.allow(&log_suppressed)) {\
+                if (log_suppressed > 0)\
+                    LOG_EMIT(level, "%lld similar lines suppressed.", log_suppressed);\
+                LOG_EMIT(level, format, ##__VA_ARGS__);\
+            }\
+        }\
+    } while (0)
 
 // 这四个宏定义在其他文件中使用，主要用于不同类型的日志输出
-#define LOG_DEBUG(format, ...)\
-    if (!Config::close_log_) {\
-        Log::get_instance()->write_log(0, format, ##__VA_ARGS__);\
-        Log::get_instance()->flush();\
-    }
-    
-#define LOG_INFO(format, ...)\
-    if (!Config::close_log_) {\
-        Log::get_instance()->write_log(1, format, ##__VA_ARGS__);\
-        Log::get_instance()->flush();\
-    }
+#if LOG_MIN_LEVEL <= 0
+#define LOG_DEBUG(format, ...) LOG_BASE(LOG_LEVEL_DEBUG, format, ##__VA_ARGS__)
+#else
+#define LOG_DEBUG(format, ...) do { } while (0)
+#endif
+
+#if LOG_MIN_LEVEL <= 1
+#define LOG_INFO(format, ...) LOG_BASE(LOG_LEVEL_INFO, format, ##__VA_ARGS__)
+#else
+#define LOG_INFO(format, ...) do { } while (0)
+#endif
+
+#if LOG_MIN_LEVEL <= 2
+#define LOG_WARN(format, ...) LOG_BASE(LOG_LEVEL_WARN, format, ##__VA_ARGS__)
+#else
+#define LOG_WARN(format, ...) do { } while (0)
+#endif
+
+#define LOG_ERROR(format, ...) LOG_BASE(LOG_LEVEL_ERROR, format, ##__VA_ARGS__)
 
-#define LOG_WARN(format, ...)\
-    if (!Config::close_log_) {\
-        Log::get_instance()->write_log(2, format, ##__VA_ARGS__);\
-        Log::get_instance()->flush();\
-    }
 
-#define LOG_ERROR(format, ...)\
-    if (!Config::close_log_) {\
-        Log::get_instance()->write_log(3, format, ##__VA_ARGS__);\
-        Log::get_instance()->flush();\
+/**
+ * @brief 单个调用点的日志限速
+ * 按秒计数，每秒最多burst条，多线程下计数可能略有偏差
+ */
+class LogRateLimit {
+public:
+    explicit LogRateLimit(int burst) : burst_(burst), second_(0), count_(0), suppressed_(0) { }
+
+    // 允许输出时返回true，suppressed返回之前被丢弃的条数
+    bool allow(long long* suppressed) {
+        long long now = time(nullptr);
+        long long second = second_.load(std::memory_order_relaxed);
+        // 进入新的一秒，只有一个线程负责重置计数
+        if (second != now && second_.compare_exchange_strong(second, now)) {
+            count_.store(0, std::memory_order_relaxed);
+            *suppressed = suppressed_.exchange(0);
+        }
+        if (count_.fetch_add(1, std::memory_order_relaxed) < burst_)
+            return true;
+        suppressed_.fetch_add(1, std::memory_order_relaxed);
+        return false;
     }
-    
 
+private:
+    int burst_;
+    std::atomic<long long> second_;
+    std::atomic<int> count_;
+    std::atomic<long long> suppressed_;
+};
+
+/**
+ * @brief 日志
+ * 同步模式下每行格式化在线程自己的栈缓冲区里，直接write(2)追加到文件，不加锁
+ * 时间前缀每个线程每秒只格式化一次，文件切换都在写线程上进行，调用线程不创建文件
+ * 异步模式下每个线程有自己的环形缓冲区，只有该线程写入、写线程读取，写入路径无锁、不分配内存
+ * 写线程定期或者被唤醒后，把所有线程缓冲区中的日志合并成一次writev写出
+ * 同一线程的日志保持顺序，不同线程之间按批次交错
+ * 二进制模式下调用线程不做时间转换和格式化，只把调用点编号、时间戳和原始参数写入缓冲区
+ * 由logdecode离线还原成文本格式，文件格式见log_record.h
+ */
 class Log {
 public:
+    static constexpr int RING_SIZE = 1 << 18;   // 每个线程的日志缓冲区大小
+    static constexpr int LINE_SIZE = 4096;      // 单行日志最大长度
+    static constexpr int FLUSH_INTERVAL = 1000; // 写线程最长等待时间，单位ms
+    static constexpr int PREPARE_AHEAD = 5;     // 距离跨天不到该时间时提前打开下一个文件，单位s
+    static constexpr int NAME_SIZE = 512;       // 日志文件名缓冲区大小，容得下目录、日期、文件名和后缀
+
     // C++11以后，使用局部变量懒汉不用加锁
     static Log* get_instance() {
         static Log instance;
@@ -44,37 +133,143 @@ public:
         return Log::get_instance()->async_write_log();
     }
 
-    // 可选择的参数有日志文件，日志缓冲区大小，最大行数以及最长日志条队列
-    bool init(const char* filename, bool close_log = false, int buf_size = 8192, int max_lines = 5000000, int max_queue_size = 0);
+    // 可选择的参数有日志文件，单行日志最大长度，最大行数，是否异步以及是否二进制，二进制模式总是异步
+    bool init(const char* filename, bool close_log = false, int buf_size = 8192, int max_lines = 5000000,
+        bool async = false, bool binary = false);
     // 将输出内容按照标准格式整理
     void write_log(int level, const char* format, ...);
-    // 强制刷新缓冲区
+
+    // 登记一个二进制日志调用点，返回调用点编号，format必须是字符串常量
+    int register_site(int level, const char* format);
+    // 写入一条二进制日志记录
+    template<typename... Args>
+    void write_binary(int site, Args... args) {
+        char buf[LINE_SIZE];
+        int len = sizeof(LogRecordHeader);
+        (encode(buf, &len, args), ...);
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        LogRecordHeader header{ (uint32_t) len, (uint32_t) site, (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec };
+        memcpy(buf, &header, sizeof(header));
+        append(buf, len);
+    }
+
+    static bool binary_;                    // 是否为二进制模式
+    // 异步模式下唤醒写线程，尽快写出缓冲区中的日志
     void flush() {
-        mutex_.lock();
-        // 强制刷新写入流缓冲区
-        fflush(fp_);
-        mutex_.unlock();
+        if (running_)
+            wake_.post();
     }
 
 private:
+    // 单个线程的日志环形缓冲区，head和tail只增不减，取模得到位置
+    struct Ring {
+        Ring() : head(0), tail(0), owned(true) { }
+
+        char data[RING_SIZE];
+        alignas(64) std::atomic<unsigned long long> head;   // 写入位置，只有所属线程修改
+        alignas(64) std::atomic<unsigned long long> tail;   // 读取位置，只有写线程修改
+        std::atomic<bool> owned;                            // 所属线程退出后置为false，可以被新线程复用
+    };
+
+    // 二进制模式下登记的调用点
+    struct Site {
+        int level;
+        const char* format;
+    };
+
+    // 按类型编码一个参数，缓冲区不够时字符串截断，其他类型丢弃
+    template<typename T>
+    static void encode(char* buf, int* len, T arg) {
+        if constexpr (std::is_same_v<T, const char*> || std::is_same_v<T, char*>) {
+            const char* str = arg != nullptr ? arg : "(null)";
+            int n = std::min((int) strnlen(str, LINE_SIZE), LINE_SIZE - *len - 3);
+            if (n < 0)
+                return;
+            uint16_t length = n;
+            buf[(*len)++] = LOG_ARG_STRING;
+            memcpy(buf + *len, &length, sizeof(length));
+            memcpy(buf + *len + sizeof(length), str, n);
+            *len += sizeof(length) + n;
+        } else {
+            char type;
+            uint64_t bits;
+            if constexpr (std::is_floating_point_v<T>) {
+                double value = arg;
+                type = LOG_ARG_DOUBLE;
+                memcpy(&bits, &value, sizeof(bits));
+            } else if constexpr (std::is_pointer_v<T>) {
+                type = LOG_ARG_POINTER;
+                bits = (uintptr_t) arg;
+            } else if constexpr (std::is_enum_v<T> || std::is_signed_v<T>) {
+                type = LOG_ARG_INT;
+                bits = (uint64_t) (int64_t) arg;
+            } else {
+                type = LOG_ARG_UINT;
+                bits = (uint64_t) arg;
+            }
+            if (*len + 1 + (int) sizeof(bits) > LINE_SIZE)
+                return;
+            buf[(*len)++] = type;
+            memcpy(buf + *len, &bits, sizeof(bits));
+            *len += sizeof(bits);
+        }
+    }
+
+    // 线程退出时归还缓冲区
+    struct RingHolder {
+        Ring* ring = nullptr;
+        ~RingHolder() {
+            if (ring != nullptr)
+                ring->owned.store(false, std::memory_order_release);
+        }
+    };
+
+    Log() : fd_(-1), retired_fd_(-1), next_fd_(-1), max_lines_(0), buf_size_(LINE_SIZE), count_(0), part_(0), date_(0),
+        isasync_(false), running_(false), stop_(false), written_sites_(0), close_log_(false) { }
     ~Log();
 
     // 异步写日志方法
     void* async_write_log();
+    // 获取当前线程的缓冲区，第一次使用时注册
+    Ring* local_ring();
+    // 把一行日志追加到当前线程的缓冲区，空间不足时唤醒写线程并等待
+    void append(const char* line, int len);
+    // 把所有缓冲区中的日志一次writev写出，返回写出的行数
+    long long drain();
+    // 写线程检查日期和行数，需要时切换日志文件，快到切换时提前打开下一个文件
+    void maintain();
+    // 生成日志文件名，part大于0时加上按行数切分的后缀，缓冲区放不下时返回false
+    bool log_name(char* name, size_t size, const struct tm* p_tm, long long part);
+    // 提前打开下一个日志文件
+    void prepare(const struct tm* p_tm, long long part);
+    // 切换到新的日志文件并关闭旧文件
+    void rotate(const struct tm* p_tm, long long part);
+    // 二进制模式下写出文件头和还没写入当前文件的调用点定义
+    void write_sites();
 
-    FILE* fp_;                              // 打开log的文件指针
+    std::atomic<int> fd_;                   // 当前日志文件
+    int retired_fd_;                        // 同步模式下上一次切换前的日志文件
+    int next_fd_;                           // 提前打开的下一个日志文件
+    char next_name_[NAME_SIZE];             // 提前打开的文件名
     char dir_[128];                         // 路径名
     char filename_[128];                    // log文件名
-    int max_lines_;                         // 日志最大行数        
-    char* buf_;                             // 日志缓冲区，要输出的内容
-    int buf_size_;                          // 日志缓冲区大小
-    long long count_;                       // 日志行数记录
-    int date_;                              // 按天分文件，记录当前时间是哪一天
-
-    bool isasync_;                          // 是否同步标志位
-    BlockingQueue<std::string>* log_queue_; // 阻塞队列
-    Mutex mutex_;                           // 互斥锁
-    bool close_log_;                         // 关闭日志
+    int max_lines_;                         // 日志最大行数
+    int buf_size_;                          // 单行日志最大长度
+    std::atomic<long long> count_;          // 日志行数记录
+    long long part_;                        // 当天已经按行数切换的次数
+    int date_;                              // 按天分文件，记录当前时间是哪一天，只有写线程访问
+
+    bool isasync_;                          // 是否异步标志位
+    bool running_;                          // 写线程是否已启动
+    std::atomic<bool> stop_;                // 通知写线程退出
+    pthread_t tid_;                         // 写线程
+    Sem wake_;                              // 唤醒写线程
+    Mutex mutex_;                           // 保护rings_和sites_，不在写入路径上
+    std::vector<Ring*> rings_;              // 所有线程的缓冲区
+    std::vector<Site> sites_;               // 二进制模式下登记的调用点，受mutex_保护
+    size_t written_sites_;                  // 已经写入当前文件的调用点数，只有写线程访问
+    bool close_log_;                        // 关闭日志
 };
 
 #endif
@@ -0,0 +1,33 @@
+#ifndef LOG_RECORD_H
+#define LOG_RECORD_H
+
+#include <stdint.h>
+
+/**
+ * 二进制日志的文件格式，日志模块和离线解码工具共用
+ * 文件以LOG_MAGIC开头，之后是连续的记录，每条记录以LogRecordHeader开头，size包括头部
+ * site为LOG_SITE_DEFINE的记录定义一个调用点：4字节调用点编号、4字节日志级别、以\0结尾的格式串
+ * 其他记录是一次日志调用：site为调用点编号，ns为CLOCK_REALTIME纳秒时间戳，之后是依次编码的参数
+ * 每个参数以1字节类型开头，整数、浮点和指针跟8字节原始值，字符串跟2字节长度和内容
+ * 同一进程写入的调用点定义总是出现在使用它的记录之前，切换文件后重新写一遍
+ */
+
+constexpr char LOG_MAGIC[8] = { 'T', 'W', 'S', 'L', 'O', 'G', '1', '\n' };
+constexpr uint32_t LOG_SITE_DEFINE = 0xFFFFFFFF;
+
+struct LogRecordHeader {
+    uint32_t size;
+    uint32_t site;
+    uint64_t ns;
+};
+
+// 参数类型
+enum LogArgType : char {
+    LOG_ARG_INT = 'i',
+    LOG_ARG_UINT = 'u',
+    LOG_ARG_DOUBLE = 'd',
+    LOG_ARG_POINTER = 'p',
+    LOG_ARG_STRING = 's'
+};
+
+#endif
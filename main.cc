@@ -16,9 +16,11 @@ int main(int argc, char* argv[]) {
 
     // 初始化
     Server server(Config::port_, Config::close_log_, Config::write_log_, 
-        Config::conn_pool_size_, Config::thread_pool_size_,
+        Config::conn_pool_size_, Config::conn_pool_min_, Config::thread_pool_size_,
         username, password, db_name,
-        Config::opt_linger_, Config::trig_mode_, Config::actor_pattern_);
+        Config::opt_linger_, Config::trig_mode_, Config::actor_pattern_, Config::warm_up_, Config::user_store_,
+        Config::access_log_, Config::slow_ms_, Config::capture_, Config::deadline_ms_, Config::overload_ms_,
+        Config::ip_rate_, Config::ip_conns_, Config::header_ms_, Config::body_ms_, Config::min_send_rate_);
 
     // 监听
     server.event_listen();
@@ -0,0 +1,156 @@
+#include "metrics.h"
+#include "pch.h"
+
+using namespace std;
+
+// 和Metrics::Counter的顺序一致，同一指标的不同标签相邻，第一次出现时输出说明
+static const char* const COUNTER_NAMES[][3] = {
+    { "tinyweb_accepts_total", "", "Accepted connections." },
+    { "tinyweb_responses_total", "{code=\"2xx\"}", "Completed responses by status class." },
+    { "tinyweb_responses_total", "{code=\"3xx\"}", nullptr },
+    { "tinyweb_responses_total", "{code=\"4xx\"}", nullptr },
+    { "tinyweb_responses_total", "{code=\"5xx\"}", nullptr },
+    { "tinyweb_response_bytes_total", "", "Bytes sent in completed responses." },
+    { "tinyweb_user_cache_lookups_total", "{result=\"hit\"}", "User cache lookups by result." },
+    { "tinyweb_user_cache_lookups_total", "{result=\"absent\"}", nullptr },
+    { "tinyweb_user_cache_lookups_total", "{result=\"miss\"}", nullptr },
+    { "tinyweb_shed_total", "{reason=\"connections\"}", "Requests rejected with 503 by admission control." },
+    { "tinyweb_shed_total", "{reason=\"queue\"}", nullptr },
+    { "tinyweb_shed_total", "{reason=\"database\"}", nullptr },
+    { "tinyweb_listen_pauses_total", "", "Times accepting was paused because the connection limit was reached." },
+    { "tinyweb_rate_limited_total", "{reason=\"connect_rate\"}", "Connections and requests rejected by the per-IP rate limiter." },
+    { "tinyweb_rate_limited_total", "{reason=\"connections\"}", nullptr },
+    { "tinyweb_rate_limited_total", "{reason=\"requests\"}", nullptr },
+    { "tinyweb_rate_limited_total", "{reason=\"auth\"}", nullptr },
+    { "tinyweb_rate_limited_total", "{reason=\"table_full\"}", nullptr },
+    { "tinyweb_slow_clients_total", "{reason=\"header\"}", "Connections reclaimed from clients that sent or received too slowly." },
+    { "tinyweb_slow_clients_total", "{reason=\"body\"}", nullptr },
+    { "tinyweb_slow_clients_total", "{reason=\"write\"}", nullptr },
+};
+
+// 和Metrics::Stage的顺序一致
+static const char* const STAGE_NAMES[] = { "read", "queue", "parse", "handler", "write" };
+
+// 直方图只输出到2^27us(约134s)，更大的值只计入+Inf
+static constexpr int RENDER_BUCKETS = 28;
+
+Metrics::~Metrics() {
+    for (Shard* shard : shards_)
+        delete shard;
+}
+
+Metrics::Shard* Metrics::local() {
+    thread_local Shard* shard = nullptr;
+    if (shard != nullptr)
+        return shard;
+    // 线程退出后分片保留，计数器单调递增
+    shard = new Shard();
+    mutex_.lock();
+    shards_.push_back(shard);
+    mutex_.unlock();
+    return shard;
+}
+
+void Metrics::add_gauge(const char* name, const char* help, const char* type, function<double()> value) {
+    mutex_.lock();
+    gauges_.push_back(Gauge{ name, help, type, value });
+    mutex_.unlock();
+}
+
+void Metrics::add_histogram(const char* name, const char* help, const Histogram* histogram) {
+    mutex_.lock();
+    histograms_.push_back(ExternalHistogram{ name, help, histogram });
+    mutex_.unlock();
+}
+
+void Metrics::render_histogram(string* out, const char* name, const char* label,
+    const uint64_t* buckets, uint64_t count, uint64_t sum) {
+    char line[256];
+    char prefix[64];
+    if (label != nullptr)
+        snprintf(prefix, sizeof(prefix), "stage=\"%s\",", label);
+    else
+        prefix[0] = '\0';
+
+    uint64_t seen = 0;
+    for (int i = 0; i < RENDER_BUCKETS; i++) {
+        seen += buckets[i];
+        // 第i个桶的值小于上界，按Prometheus的le语义用上界减1
+        snprintf(line, sizeof(line), "%s_bucket{%sle=\"%g\"} %llu\n", name, prefix,
+            (Histogram::upper_bound(i) - 1) / 1e6, (unsigned long long) seen);
+        out->append(line);
+    }
+    snprintf(line, sizeof(line), "%s_bucket{%sle=\"+Inf\"} %llu\n", name, prefix, (unsigned long long) count);
+    out->append(line);
+    if (label != nullptr)
+        snprintf(prefix, sizeof(prefix), "{stage=\"%s\"}", label);
+    snprintf(line, sizeof(line), "%s_sum%s %g\n%s_count%s %llu\n", name, prefix, sum / 1e6,
+        name, prefix, (unsigned long long) count);
+    out->append(line);
+}
+
+string Metrics::render() {
+    uint64_t counters[COUNTER_COUNT] = { 0 };
+    uint64_t buckets[STAGE_COUNT][Histogram::BUCKETS] = { { 0 } };
+    uint64_t counts[STAGE_COUNT] = { 0 };
+    uint64_t sums[STAGE_COUNT] = { 0 };
+
+    mutex_.lock();
+    vector<Shard*> shards(shards_);
+    vector<Gauge> gauges(gauges_);
+    vector<ExternalHistogram> histograms(histograms_);
+    mutex_.unlock();
+
+    // 各分片之间不是同一时刻的快照，对监控来说足够
+    for (Shard* shard : shards) {
+        for (int i = 0; i < COUNTER_COUNT; i++)
+            counters[i] += shard->counters[i].load(memory_order_relaxed);
+        for (int i = 0; i < STAGE_COUNT; i++) {
+            for (int j = 0; j < Histogram::BUCKETS; j++) {
+                uint64_t value = shard->stages[i].bucket(j);
+                buckets[i][j] += value;
+                // 总数取各桶之和，和桶的累计值保持一致
+                counts[i] += value;
+            }
+            sums[i] += shard->stages[i].sum();
+        }
+    }
+
+    string out;
+    out.reserve(16384);
+    char line[256];
+    for (int i = 0; i < COUNTER_COUNT; i++) {
+        const char* name = COUNTER_NAMES[i][0];
+        if (COUNTER_NAMES[i][2] != nullptr) {
+            snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s counter\n", name, COUNTER_NAMES[i][2], name);
+            out.append(line);
+        }
+        snprintf(line, sizeof(line), "%s%s %llu\n", name, COUNTER_NAMES[i][1], (unsigned long long) counters[i]);
+        out.append(line);
+    }
+
+    for (const Gauge& gauge : gauges) {
+        snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s %s\n%s %g\n",
+            gauge.name, gauge.help, gauge.name, gauge.type, gauge.name, gauge.value());
+        out.append(line);
+    }
+
+    const char* stage_name = "tinyweb_stage_duration_seconds";
+    snprintf(line, sizeof(line), "# HELP %s Request processing time by stage.\n# TYPE %s histogram\n", stage_name, stage_name);
+    out.append(line);
+    for (int i = 0; i < STAGE_COUNT; i++)
+        render_histogram(&out, stage_name, STAGE_NAMES[i], buckets[i], counts[i], sums[i]);
+
+    for (const ExternalHistogram& histogram : histograms) {
+        uint64_t external[Histogram::BUCKETS];
+        uint64_t count = 0;
+        for (int j = 0; j < Histogram::BUCKETS; j++) {
+            external[j] = histogram.histogram->bucket(j);
+            count += external[j];
+        }
+        snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s histogram\n", histogram.name, histogram.help, histogram.name);
+        out.append(line);
+        render_histogram(&out, histogram.name, nullptr, external, count, histogram.histogram->sum());
+    }
+    return out;
+}
@@ -0,0 +1,115 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include "pch.h"
+
+#include "histogram.h"
+#include "lock.h"
+
+/**
+ * @brief 进程内的指标注册表，以Prometheus文本格式输出
+ * 计数器和各阶段耗时直方图按线程分片，每个线程只写自己的分片，分片按cache line对齐
+ * 写入路径只有几次relaxed原子加，没有锁和共享cache line；读取时把所有分片相加
+ * 连接池、请求队列等已有状态通过回调在读取时取值
+ */
+class Metrics {
+public:
+    // 计数器
+    enum Counter {
+        ACCEPTS = 0,            // 接受的连接数
+        RESPONSES_2XX,          // 按状态码分类的响应数
+        RESPONSES_3XX,
+        RESPONSES_4XX,
+        RESPONSES_5XX,
+        RESPONSE_BYTES,         // 发送的字节数
+        CACHE_HITS,             // 用户缓存命中
+        CACHE_ABSENT,           // 用户缓存负缓存命中
+        CACHE_MISSES,           // 用户缓存未命中，需要查询后端
+        SHED_CONNECTIONS,       // 准入控制拒绝的请求，按原因分类：连接数达到上限
+        SHED_QUEUE,             // 请求队列排队过久或已满
+        SHED_DATABASE,          // 数据库已饱和
+        LISTEN_PAUSES,          // 暂停监听的次数
+        RATE_LIMITED_CONNECTS,  // 按IP限流拒绝的连接和请求，按原因分类：新建连接过快
+        RATE_LIMITED_CONNS,     // 并发连接数达到上限
+        RATE_LIMITED_REQUESTS,  // 请求过快
+        RATE_LIMITED_AUTH,      // 登录注册过快
+        RATE_LIMITED_TABLE_FULL, // 跟踪的IP用满且都还有连接
+        SLOW_HEADER,            // 回收的慢速客户端，按原因分类：请求头超过截止时间
+        SLOW_BODY,              // 请求体超过截止时间
+        SLOW_WRITE,             // 接收响应的速率过低
+        COUNTER_COUNT
+    };
+
+    // 请求处理的各个阶段，单位us
+    enum Stage {
+        STAGE_READ = 0,         // 从套接字读取请求
+        STAGE_QUEUE,            // 在请求队列中等待工作线程
+        STAGE_PARSE,            // 解析请求
+        STAGE_HANDLER,          // 生成响应，包括等待数据库
+        STAGE_WRITE,            // 发送响应
+        STAGE_COUNT
+    };
+
+    // 局部静态变量单例模式
+    static Metrics* get_instance() {
+        static Metrics metrics;
+        return &metrics;
+    }
+
+    void add(Counter counter, uint64_t value = 1) {
+        local()->counters[counter].fetch_add(value, std::memory_order_relaxed);
+    }
+
+    void observe(Stage stage, long long us) {
+        local()->stages[stage].record(us > 0 ? us : 0);
+    }
+
+    // 注册一个读取时取值的指标，type为gauge或counter，只在启动时调用
+    void add_gauge(const char* name, const char* help, const char* type, std::function<double()> value);
+    // 注册一个已有的直方图，单位us，只在启动时调用
+    void add_histogram(const char* name, const char* help, const Histogram* histogram);
+
+    // 合并所有分片，生成Prometheus文本格式
+    std::string render();
+
+private:
+    // 单个线程的分片
+    struct alignas(64) Shard {
+        Shard() {
+            for (int i = 0; i < COUNTER_COUNT; i++)
+                counters[i].store(0, std::memory_order_relaxed);
+        }
+
+        std::atomic<uint64_t> counters[COUNTER_COUNT];
+        Histogram stages[STAGE_COUNT];
+    };
+
+    struct Gauge {
+        const char* name;
+        const char* help;
+        const char* type;
+        std::function<double()> value;
+    };
+
+    struct ExternalHistogram {
+        const char* name;
+        const char* help;
+        const Histogram* histogram;
+    };
+
+    Metrics() { }
+    ~Metrics();
+
+    // 获取当前线程的分片，第一次使用时注册
+    Shard* local();
+    // 输出一个直方图，标签为空时不带stage标签
+    static void render_histogram(std::string* out, const char* name, const char* label,
+        const uint64_t* buckets, uint64_t count, uint64_t sum);
+
+    Mutex mutex_;                           // 保护shards_、gauges_和histograms_，不在写入路径上
+    std::vector<Shard*> shards_;
+    std::vector<Gauge> gauges_;
+    std::vector<ExternalHistogram> histograms_;
+};
+
+#endif
@@ -0,0 +1,54 @@
+#include "slow_log.h"
+#include "pch.h"
+
+using namespace std;
+
+// 和HttpConn::Method的顺序一致
+static const char* const METHOD_NAMES[] = { "GET", "POST", "HEAD", "PUT", "DELETE", "TRACE", "OPTIONS", "CONNECT", "PATH" };
+// 和SlowLog::Stage的顺序一致
+static const char* const STAGE_NAMES[] = { "dispatch", "read", "queue", "parse", "store", "handler", "write" };
+
+void SlowLog::record(const Request& request) {
+    mutex_.lock();
+    unsigned long long index = count_.load(memory_order_relaxed);
+    ring_[index % CAPACITY] = request;
+    count_.store(index + 1, memory_order_relaxed);
+    mutex_.unlock();
+}
+
+int SlowLog::dump(const char* path) {
+    // 先复制出来，写文件时不持有锁
+    vector<Request> requests;
+    mutex_.lock();
+    unsigned long long count = count_.load(memory_order_relaxed);
+    unsigned long long first = count > CAPACITY ? count - CAPACITY : 0;
+    for (unsigned long long i = first; i < count; i++)
+        requests.push_back(ring_[i % CAPACITY]);
+    mutex_.unlock();
+
+    FILE* fp = fopen(path, "a");
+    if (fp == nullptr)
+        return -1;
+    time_t now = time(nullptr);
+    struct tm tm;
+    localtime_r(&now, &tm);
+    fprintf(fp, "# %d-%02d-%02d %02d:%02d:%02d dump %zu of %llu slow requests, threshold %lldus\n",
+        tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec,
+        requests.size(), count, threshold_us_);
+
+    for (const Request& request : requests) {
+        time_t t = request.time_us / 1000000;
+        const char* method = request.method >= 0 && request.method < (int) (sizeof(METHOD_NAMES) / sizeof(METHOD_NAMES[0])) ?
+            METHOD_NAMES[request.method] : "-";
+        localtime_r(&t, &tm);
+        fprintf(fp, "%d-%02d-%02d %02d:%02d:%02d.%06lld %s:%d %s %s %d %dB total %lldus:",
+            tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec,
+            request.time_us % 1000000, request.ip, request.port, method, request.path,
+            request.status, request.bytes, request.total_us);
+        for (int i = 0; i < STAGE_COUNT; i++)
+            fprintf(fp, " %s %lld", STAGE_NAMES[i], request.stages[i]);
+        fputc('\n', fp);
+    }
+    fclose(fp);
+    return requests.size();
+}
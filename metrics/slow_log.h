@@ -0,0 +1,74 @@
+#ifndef SLOW_LOG_H
+#define SLOW_LOG_H
+
+#include "pch.h"
+
+#include "lock.h"
+
+/**
+ * @brief 慢请求记录
+ * 总耗时超过阈值的请求把各阶段耗时写入固定大小的环形缓冲区，满了覆盖最旧的
+ * 慢请求很少，写入时加锁；收到SIGUSR1时由主线程追加写到文件，缓冲区内容保留
+ */
+class SlowLog {
+public:
+    static constexpr int CAPACITY = 256;            // 保留最近的慢请求数
+    static constexpr int PATH_LEN = 64;             // 记录中路径的最大长度，超出截断
+
+    // 请求处理的各个阶段，单位us
+    enum Stage {
+        STAGE_DISPATCH = 0,     // epoll_wait返回到放入请求队列，Proactor模式下包括读取
+        STAGE_READ,             // 从套接字读取请求
+        STAGE_QUEUE,            // 在请求队列中等待工作线程
+        STAGE_PARSE,            // 解析请求
+        STAGE_STORE,            // 等待用户存储后端，包括获取数据库连接
+        STAGE_HANDLER,          // 生成响应，不包括等待用户存储
+        STAGE_WRITE,            // 生成响应到发送完成
+        STAGE_COUNT
+    };
+
+    struct Request {
+        long long time_us;                          // 完成时的墙上时间
+        char ip[INET_ADDRSTRLEN];
+        int port;
+        int method;                                 // HttpConn::Method
+        char path[PATH_LEN];
+        int status;
+        int bytes;
+        long long total_us;
+        long long stages[STAGE_COUNT];
+    };
+
+    // 局部静态变量单例模式
+    static SlowLog* get_instance() {
+        static SlowLog slow_log;
+        return &slow_log;
+    }
+
+    // 总耗时不少于threshold_ms的请求被记录，0表示关闭
+    void init(int threshold_ms) {
+        threshold_us_ = threshold_ms * 1000LL;
+    }
+    // 是否需要记录，调用者先判断，避免没必要的复制
+    bool is_slow(long long total_us) const {
+        return threshold_us_ > 0 && total_us >= threshold_us_;
+    }
+    void record(const Request& request);
+    // 把缓冲区中的慢请求按时间顺序追加到文件，返回写出的条数，失败返回-1
+    int dump(const char* path);
+
+    // 记录过的慢请求总数
+    unsigned long long get_count() const {
+        return count_.load(std::memory_order_relaxed);
+    }
+
+private:
+    SlowLog() : threshold_us_(0), count_(0) { }
+
+    long long threshold_us_;
+    std::atomic<unsigned long long> count_;
+    Mutex mutex_;                                   // 保护ring_
+    Request ring_[CAPACITY];
+};
+
+#endif
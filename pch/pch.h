@@ -24,9 +24,25 @@
 #include <unordered_map>
 #include <fstream>
 #include <mysql/mysql.h>
+#include <mysql/errmsg.h>
 #include <sys/time.h>
 #include <iostream>
 #include <string>
+#include <string_view>
+#include <cstddef>
+#include <vector>
+#include <algorithm>
+#include <queue>
+#include <atomic>
+#include <functional>
+#include <type_traits>
+#include <coroutine>
+#include <sys/eventfd.h>
+#include <zlib.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
 
 #define STDERR_FUNC_LINE() fprintf(stderr, "func: %s, line: %d\n", __func__, __LINE__);
 #define DEBUG_FUNC_LINE() fprintf(stderr, "func: %s, line: %d\n", __func__, __LINE__);
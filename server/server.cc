@@ -1,18 +1,38 @@
 #include "server.h"
+#include "async_db.h"
 #include "http_conn.h"
+#include "metrics.h"
+#include "rate_limiter.h"
+#include "register_batcher.h"
+#include "slow_log.h"
+#include "user_store.h"
+#include "usdt.h"
 #include "pch.h"
 #include <mysql/my_command.h>
 
 
 using namespace std;
 
-Server::Server(int port, bool close_log, bool write_log, 
-    int conn_pool_size, int thread_pool_size,
+// 用户缓存快照文件
+constexpr char USER_SNAPSHOT[] = "./UserCache.snapshot";
+// 本地用户存储的数据文件
+constexpr char USER_STORE_FILE[] = "./UserStore.log";
+// 收到SIGUSR1时慢请求记录追加到的文件
+constexpr char SLOW_LOG_FILE[] = "./SlowRequest.log";
+// 流量捕获文件，用tinyreplay回放
+constexpr char CAPTURE_FILE[] = "./Capture.bin";
+
+Server::Server(int port, bool close_log, int write_log, 
+    int conn_pool_size, int conn_pool_min, int thread_pool_size,
     string username, string password, string db_name,
-    bool opt_linger, int trig_mode, bool actor_pattern)
-        : port_(port), close_log_(close_log), write_log_(write_log),
-        conn_pool_size_(conn_pool_size), thread_pool_size_(thread_pool_size),
-        username_(username), password_(password), db_name_(db_name),
+    bool opt_linger, int trig_mode, bool actor_pattern, bool warm_up, int user_store, bool access_log,
+    int slow_ms, bool capture, int deadline_ms, int overload_ms, int ip_rate, int ip_conns,
+    int header_ms, int body_ms, int min_send_rate)
+        : port_(port), close_log_(close_log), write_log_(write_log), access_log_(access_log), slow_ms_(slow_ms),
+        capture_(capture), deadline_ms_(deadline_ms), overload_ms_(overload_ms), max_conn_(MAX_FD),
+        listen_paused_(false), overloaded_(false), ip_rate_(ip_rate), ip_conns_(ip_conns),
+        conn_pool_size_(conn_pool_size), conn_pool_min_(conn_pool_min), thread_pool_size_(thread_pool_size),
+        username_(username), password_(password), db_name_(db_name), warm_up_(warm_up), user_store_(user_store),
         opt_linger_(opt_linger), trig_mode_(trig_mode), actor_pattern_(actor_pattern) {
     // http_conn类对象
     users_ = new HttpConn[MAX_FD];
@@ -25,6 +45,11 @@ Server::Server(int port, bool close_log, bool write_log,
     // 定时器
     users_timer_ = new ClientData[MAX_FD];
 
+    // 慢速客户端的限制
+    HttpConn::header_ms_ = header_ms;
+    HttpConn::body_ms_ = body_ms;
+    HttpConn::min_send_rate_ = min_send_rate;
+
     // 日志
     init_log();
 
@@ -34,11 +59,19 @@ Server::Server(int port, bool close_log, bool write_log,
     // 线程池
     init_thread_pool();
 
+    // 按IP限流
+    init_rate_limit();
+
+    // 监控指标
+    init_metrics();
+
     // 触发模式
     init_trig_mode();
 }
 
 Server::~Server() {
+    // 保存命中过的用户名，下次启动时预热
+    UserCache::get_instance()->save_snapshot(USER_SNAPSHOT);
     close(epollfd_);
     close(listenfd_);
     close(pipefd_[1]);
@@ -49,27 +82,114 @@ Server::~Server() {
 }
 
 void Server::init_conn_pool() {
+    // 本地用户存储不依赖数据库，不初始化连接池
+    if (user_store_ == UserStore::BACKEND_LOCAL) {
+        conn_pool_ = nullptr;
+        if (!UserStore::init(UserStore::BACKEND_LOCAL, USER_STORE_FILE)) {
+            LOG_ERROR("UserStore: local store unavailable!");
+            exit(1);
+        }
+    } else {
+        init_mysql();
+        UserStore::init(UserStore::BACKEND_MYSQL, nullptr);
+    }
+
+    // 用户缓存按需加载，启动时不再读取整张用户表
+    UserCache::get_instance()->init();
+    // 后台线程按上次退出时的快照预热热点用户，不阻塞启动
+    if (warm_up_) {
+        pthread_t tid;
+        if (pthread_create(&tid, nullptr, warm_up_thread, nullptr) == 0)
+            pthread_detach(tid);
+    }
+}
+
+void Server::init_mysql() {
     // 初始化数据库连接池
     conn_pool_ = ConnPool::get_instance();
-    conn_pool_->init("localhost", username_, password_, db_name_, 3306, conn_pool_size_, close_log_);
+    // 启动时只建立最小连接数，数据库不可用时不退出，由后台线程重连
+    conn_pool_->init("localhost", username_, password_, db_name_, 3306, conn_pool_min_, conn_pool_size_, close_log_, DB_TIMEOUT);
+
+    // 异步数据库层从连接池借出共享连接
+    if (!AsyncDb::get_instance()->init(conn_pool_, 2, 8, DB_TIMEOUT))
+        LOG_WARN("AsyncDb: database unavailable, connect later!");
+    // 注册请求攒批写入，每批最多等待5ms、64条
+    RegisterBatcher::get_instance()->init(conn_pool_, 5, 64);
+}
 
-    // 初始化数据库读取表
-    users_->init_mysql_result(conn_pool_);
+void* Server::warm_up_thread(void*) {
+    int count = UserCache::get_instance()->warm_up(USER_SNAPSHOT, UserStore::load_user);
+    LOG_INFO("Warm up %d users.", count);
+    return nullptr;
 }
 
 // 初始化线程池
 void Server::init_thread_pool() {
-    thread_pool_ = new ThreadPool<HttpConn>(conn_pool_, actor_pattern_, thread_pool_size_);
+    // 工作线程在event_loop选定模式后启动
+    thread_pool_ = new ThreadPool<HttpConn>(conn_pool_, thread_pool_size_, 10000, deadline_ms_);
+}
+
+void Server::init_rate_limit() {
+    RateLimiter* limiter = RateLimiter::get_instance();
+    limiter->init(ip_rate_, ip_conns_);
+    if (limiter->enabled())
+        LOG_INFO("Rate limit per IP: %d requests/s, %d connections.", ip_rate_, ip_conns_);
+}
+
+// 注册读取时取值的指标，计数器和耗时由各模块直接写入
+void Server::init_metrics() {
+    Metrics* metrics = Metrics::get_instance();
+    metrics->add_gauge("tinyweb_active_connections", "Open client connections.", "gauge",
+        [] { return (double) HttpConn::user_count_.load(); });
+    ThreadPool<HttpConn>* pool = thread_pool_;
+    metrics->add_gauge("tinyweb_workqueue_depth", "Requests and coroutines waiting for a worker thread.", "gauge",
+        [pool] { return (double) pool->get_queue_size(); });
+    metrics->add_gauge("tinyweb_workqueue_delay_seconds", "Time the oldest queued request has been waiting.", "gauge",
+        [pool] { return pool->get_queue_delay() / 1e6; });
+    metrics->add_gauge("tinyweb_workqueue_expired_total", "Queued requests dropped after their deadline passed.", "counter",
+        [pool] { return (double) pool->get_expired(); });
+    metrics->add_gauge("tinyweb_workqueue_recycled_total", "Queued requests dropped because their connection was closed.", "counter",
+        [pool] { return (double) pool->get_recycled(); });
+    metrics->add_gauge("tinyweb_access_log_dropped_total", "Access log records dropped because the ring was full.", "counter",
+        [] { return (double) AccessLog::get_instance()->get_dropped(); });
+    metrics->add_gauge("tinyweb_slow_requests_total", "Requests slower than the slow request threshold.", "counter",
+        [] { return (double) SlowLog::get_instance()->get_count(); });
+    metrics->add_gauge("tinyweb_capture_dropped_total", "Capture records dropped because the buffer was full.", "counter",
+        [] { return (double) Capture::get_instance()->get_dropped(); });
+    RateLimiter* limiter = RateLimiter::get_instance();
+    if (limiter->enabled()) {
+        metrics->add_gauge("tinyweb_rate_limit_sources", "Client IPs tracked by the rate limiter.", "gauge",
+            [limiter] { return (double) limiter->get_size(); });
+        metrics->add_gauge("tinyweb_rate_limit_evictions_total", "Client IPs evicted from the rate limiter.", "counter",
+            [limiter] { return (double) limiter->get_evictions(); });
+    }
+    if (conn_pool_ != nullptr) {
+        ConnPool* conn_pool = conn_pool_;
+        metrics->add_gauge("tinyweb_conn_pool_free", "Idle database connections.", "gauge",
+            [conn_pool] { return (double) conn_pool->get_free_conn(); });
+        metrics->add_gauge("tinyweb_conn_pool_used", "Database connections in use.", "gauge",
+            [conn_pool] { return (double) conn_pool->get_curr_conn(); });
+        metrics->add_histogram("tinyweb_conn_pool_wait_seconds", "Time spent waiting for a database connection.",
+            &conn_pool_->get_wait_histogram());
+    }
 }
 
 // 初始化日志
 void Server::init_log() {
     if (!close_log_) {
-        if (write_log_)
-            Log::get_instance()->init("./ServerLog", close_log_, 2000, 800000, 800);
+        if (write_log_ == 2)
+            Log::get_instance()->init("./ServerLog.bin", close_log_, 2000, 800000, true, true);
+        else if (write_log_ == 1)
+            Log::get_instance()->init("./ServerLog", close_log_, 2000, 800000, true);
         else
-            Log::get_instance()->init("./ServerLog", close_log_, 2000, 800000, 0);
+            Log::get_instance()->init("./ServerLog", close_log_, 2000, 800000, false);
     }
+    // 访问日志不受close_log_影响，单独开关
+    if (access_log_ && !AccessLog::get_instance()->init("./AccessLog"))
+        LOG_ERROR("AccessLog: cannot open ./AccessLog.ring!");
+    SlowLog::get_instance()->init(slow_ms_);
+    if (capture_ && !Capture::get_instance()->init(CAPTURE_FILE))
+        LOG_ERROR("Capture: cannot open %s!", CAPTURE_FILE);
 }
 
 // 初始化触发模式
@@ -120,12 +240,18 @@ void Server::event_listen()
         STDERR_FUNC_LINE();
         exit(EXIT_FAILURE);
     }
-    ret = listen(listenfd_, 5);
+    // 积压队列足够长，突发的新连接不会因为SYN被丢弃而等待重传
+    ret = listen(listenfd_, SOMAXCONN);
     if (ret < 0) {
         STDERR_FUNC_LINE();
         exit(EXIT_FAILURE);
     }
 
+    // 连接数上限，accept在描述符用完之前暂停
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY)
+        max_conn_ = min<long>(MAX_FD, limit.rlim_cur) - FD_RESERVE;
+
     Utils::timeslot_ = TIMESLOT;
 
     // epoll创建内核事件表
@@ -150,21 +276,50 @@ void Server::event_listen()
     Utils::add_sig(SIGPIPE, SIG_IGN);
     Utils::add_sig(SIGALRM, Utils::sig_handler, false);
     Utils::add_sig(SIGTERM, Utils::sig_handler, false);
+    Utils::add_sig(SIGUSR1, Utils::sig_handler, false);
 
     alarm(TIMESLOT);
 
     // 工具类,信号和描述符基础操作
     Utils::pipefd_ = pipefd_;
     Utils::epollfd_ = epollfd_;
+
+    // 协程执行器，挂起的请求协程就绪后交回线程池恢复
+    Executor::get_instance()->init(epollfd_, [this](coroutine_handle<> handle) {
+        thread_pool_->append(handle);
+    });
 }
 
 void Server::event_loop()
 {
+    // listenfd的触发模式只影响accept，仍在运行时判断
+    if (connfd_trig_mode_) {
+        if (actor_pattern_)
+            run_loop<EdgeTrigger, Reactor>();
+        else
+            run_loop<EdgeTrigger, Proactor>();
+    } else {
+        if (actor_pattern_)
+            run_loop<LevelTrigger, Reactor>();
+        else
+            run_loop<LevelTrigger, Proactor>();
+    }
+}
+
+template <typename Trigger, typename Actor>
+void Server::run_loop()
+{
+    thread_pool_->start<Trigger, Actor>();
+
     bool timeout = false;
     bool stop_server = false;
+    Executor* executor = Executor::get_instance();
 
     while (!stop_server) {
-        int number = epoll_wait(epollfd_, events_, MAX_EVENT_NUMBER, -1);
+        // 有协程在等待定时器时，epoll_wait最多阻塞到最近的定时器到期
+        int number = epoll_wait(epollfd_, events_, MAX_EVENT_NUMBER, executor->next_timeout());
+        // 这一批事件共用一个时间戳，作为慢请求总耗时的起点
+        long long dispatch_us = AccessLog::now_us();
         if (number < 0 && errno != EINTR) {
             LOG_ERROR("Epoll failure!");
             break;
@@ -173,11 +328,19 @@ void Server::event_loop()
         for (int i = 0; i < number; i++) {
             int sockfd = events_[i].data.fd;
 
+            // 协程等待的fd就绪，交给执行器恢复对应的协程
+            if (executor->dispatch(sockfd)) {
+                continue;
+
             // 处理新到的客户连接
-            if (sockfd == listenfd_) {
+            } else if (sockfd == listenfd_) {
                 if (!accept_client_data())
                     continue;
 
+            // 已经要求关闭、等待工作线程释放的连接，定时器已经移除，不再处理它的事件
+            } else if (users_[sockfd].closing()) {
+                continue;
+
             // 服务器端关闭连接，移除对应的定时器
             } else if (events_[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
                 TimerUtil* timer = users_timer_[sockfd].timer;
@@ -190,28 +353,34 @@ void Server::event_loop()
 
             // 处理客户连接上接收到的数据
             } else if (events_[i].events & EPOLLIN) {
-                read_actor(sockfd);
+                users_[sockfd].mark_dispatch(dispatch_us);
+                read_actor<Trigger, Actor>(sockfd);
 
             } else if (events_[i].events & EPOLLOUT) {
-                write_actor(sockfd);
+                write_actor<Trigger, Actor>(sockfd);
             }
         }
 
+        executor->run_timers();
+        check_overload();
+
         if (timeout) {
             Utils::timer_handler();
-            LOG_INFO("Timer tick.");
+            LOG_DEBUG("Timer tick.");
             timeout = false;
         }
     }
 }
 
 void Server::init_timer(int connfd, struct sockaddr_in client_address) {
+    Metrics::get_instance()->add(Metrics::ACCEPTS);
     users_[connfd].init(connfd, client_address, root_dir_.c_str(), connfd_trig_mode_, close_log_, username_, password_, db_name_);
 
     // 初始化client_data数据
     // 创建定时器，设置回调函数和超时时间，绑定用户数据，将定时器添加到链表中
     users_timer_[connfd].address = client_address;
     users_timer_[connfd].sockfd = connfd;
+    users_timer_[connfd].conn = &users_[connfd];
     TimerUtil* timer = new TimerUtil;
     timer->user_data = &users_timer_[connfd];
     timer->callback = Utils::cb_func;
@@ -225,10 +394,18 @@ void Server::init_timer(int connfd, struct sockaddr_in client_address) {
 // 并对新的定时器在链表上的位置进行调整
 void Server::delay_timer(TimerUtil* timer) {
     time_t cur = time(nullptr);
-    timer->expire = cur + 3 * TIMESLOT;
+    time_t expire = cur + 3 * TIMESLOT;
+    // 请求头或请求体还没收完时不延后到截止时间之后，逐字节发送的慢速客户端不能一直续期
+    long long deadline = timer->user_data->conn->get_read_deadline();
+    if (deadline > 0)
+        expire = min(expire, cur + (time_t) ((deadline - AccessLog::now_us()) / 1000000) + 1);
+    // 链表只支持向后调整
+    if (expire <= timer->expire)
+        return;
+    timer->expire = expire;
     Utils::timer_list_.modify_timer(timer);
 
-    LOG_INFO("Delay timer once.");
+    LOG_DEBUG("Delay timer once.");
 }
 
 // 服务器端关闭连接，移除对应的定时器
@@ -237,7 +414,7 @@ void Server::close_conn(TimerUtil* timer, int sockfd) {
     if (timer)
         Utils::timer_list_.del_timer(timer);
 
-    LOG_INFO("Close fd %d.", users_timer_[sockfd].sockfd);
+    LOG_DEBUG("Close fd %d.", users_timer_[sockfd].sockfd);
 }
 
 bool Server::accept_client_data() {
@@ -250,31 +427,88 @@ bool Server::accept_client_data() {
             LOG_ERROR("Accept error: errno is: %d!", errno);
             return false;
         }
-        if (HttpConn::user_count_ >= MAX_FD) {
-            Utils::show_error(connfd, "Internal server busy!");
-            LOG_ERROR("Internal server busy!");
+        if (HttpConn::user_count_ >= max_conn_) {
+            Utils::show_error(connfd, HttpConn::overload_response().data());
+            Metrics::get_instance()->add(Metrics::SHED_CONNECTIONS);
+            pause_listen(true);
             return false;
         }
+        if (rate_limited(connfd, client_address))
+            return false;
         init_timer(connfd, client_address);
+        USDT(accept, connfd, users_[connfd].get_ip());
     } else {
         while (true) {
             int connfd = accept(listenfd_, (struct sockaddr*) &client_address, &client_addrlength);
             if (connfd < 0) {
-                LOG_ERROR("Accept error: errno is: %d!", errno);
+                if (errno != EAGAIN && errno != EWOULDBLOCK)
+                    LOG_ERROR("Accept error: errno is: %d!", errno);
                 break;
             }
-            if (HttpConn::user_count_ >= MAX_FD) {
-                Utils::show_error(connfd, "Internal server busy!");
-                LOG_ERROR("Internal server busy!");
+            if (HttpConn::user_count_ >= max_conn_) {
+                Utils::show_error(connfd, HttpConn::overload_response().data());
+                Metrics::get_instance()->add(Metrics::SHED_CONNECTIONS);
+                pause_listen(true);
                 break;
             }
+            if (rate_limited(connfd, client_address))
+                continue;
             init_timer(connfd, client_address);
+            USDT(accept, connfd, users_[connfd].get_ip());
         }
         return false;
     }
     return true;
 }
 
+bool Server::rate_limited(int connfd, const sockaddr_in& client_address) {
+    RateLimiter::Verdict verdict = RateLimiter::get_instance()->acquire(client_address.sin_addr.s_addr, AccessLog::now_us());
+    if (verdict == RateLimiter::ALLOW)
+        return false;
+    Metrics::Counter counter = Metrics::RATE_LIMITED_CONNECTS;
+    if (verdict == RateLimiter::CONN_LIMITED)
+        counter = Metrics::RATE_LIMITED_CONNS;
+    else if (verdict == RateLimiter::TABLE_FULL)
+        counter = Metrics::RATE_LIMITED_TABLE_FULL;
+    Metrics::get_instance()->add(counter);
+    // 不读请求也不发送响应，直接RST关闭
+    Utils::set_reset(connfd);
+    close(connfd);
+    return true;
+}
+
+void Server::check_overload() {
+    overloaded_ = overload_ms_ > 0 && thread_pool_->get_queue_delay() > overload_ms_ * 1000LL;
+    // 连接数降到上限的九成以下再恢复监听，避免在上限附近反复切换
+    if (listen_paused_ && HttpConn::user_count_ < max_conn_ / 10 * 9)
+        pause_listen(false);
+}
+
+void Server::pause_listen(bool pause) {
+    if (pause == listen_paused_)
+        return;
+    listen_paused_ = pause;
+    // 新连接留在内核的积压队列中，恢复后重新注册时epoll会报告
+    if (pause) {
+        epoll_ctl(epollfd_, EPOLL_CTL_DEL, listenfd_, 0);
+        Metrics::get_instance()->add(Metrics::LISTEN_PAUSES);
+        LOG_WARN("Connection limit %d reached, pause accepting.", max_conn_);
+    } else {
+        Utils::add_fd(epollfd_, listenfd_, false, listenfd_trig_mode_);
+        LOG_INFO("Resume accepting with %d connections.", HttpConn::user_count_.load());
+    }
+}
+
+void Server::shed(int sockfd, Metrics::Counter reason) {
+    // 先读掉未读的请求数据，否则关闭时内核会发送RST，客户端可能收不到503
+    char buf[1024];
+    while (recv(sockfd, buf, sizeof(buf), MSG_DONTWAIT) > 0) { }
+    string_view response = HttpConn::overload_response();
+    send(sockfd, response.data(), response.size(), MSG_DONTWAIT);
+    Metrics::get_instance()->add(reason);
+    close_conn(users_timer_[sockfd].timer, sockfd);
+}
+
 bool Server::recv_signal(bool &timeout, bool &stop_server) {
     int ret = 0;
     char signals[1024];
@@ -288,20 +522,38 @@ bool Server::recv_signal(bool &timeout, bool &stop_server) {
             timeout = true;
         if (signals[i] == SIGTERM) 
             stop_server = true;
+        // 把慢请求记录追加到文件
+        if (signals[i] == SIGUSR1) {
+            int count = SlowLog::get_instance()->dump(SLOW_LOG_FILE);
+            if (count < 0)
+                LOG_ERROR("SlowLog: cannot open %s!", SLOW_LOG_FILE);
+            else
+                LOG_INFO("SlowLog: dumped %d slow requests to %s.", count, SLOW_LOG_FILE);
+        }
     }
 
     return true;
 }
 
+template <typename Trigger, typename Actor>
 void Server::read_actor(int sockfd) {
     TimerUtil* timer = users_timer_[sockfd].timer;
 
     // reactor
-    if (actor_pattern_) {
+    if constexpr (Actor::REACTOR) {
+        // 过载时不再排队，立即返回503
+        if (overloaded_) {
+            shed(sockfd, Metrics::SHED_QUEUE);
+            return;
+        }
         if (timer) 
             delay_timer(timer);
         // 若监测到读事件，将该事件放入请求队列
-        thread_pool_->append(&users_[sockfd], false);
+        users_[sockfd].mark_enqueue();
+        if (!thread_pool_->append(&users_[sockfd], false)) {
+            shed(sockfd, Metrics::SHED_QUEUE);
+            return;
+        }
         while (true) {
             if (users_[sockfd].improve_) {
                 if (users_[sockfd].timer_flag_) {
@@ -311,13 +563,24 @@ void Server::read_actor(int sockfd) {
                 users_[sockfd].improve_ = false;
                 break;
             }
+            // 工作线程可能和主线程在同一个CPU上，让出时间片
+            sched_yield();
         }
     // proactor
     } else {
-        if (users_[sockfd].read_once()) {
-            LOG_INFO("Deal with the client(%s).", inet_ntoa(users_[sockfd].get_address()->sin_addr));
+        if (users_[sockfd].read_once<Trigger>()) {
+            LOG_DEBUG("Deal with the client(%s).", users_[sockfd].get_ip());
+            // 过载或请求队列已满时不再排队，立即返回503
+            if (overloaded_) {
+                shed(sockfd, Metrics::SHED_QUEUE);
+                return;
+            }
             // 若监测到读事件，将该事件放入请求队列
-            thread_pool_->append(&users_[sockfd]);
+            users_[sockfd].mark_enqueue();
+            if (!thread_pool_->append(&users_[sockfd])) {
+                shed(sockfd, Metrics::SHED_QUEUE);
+                return;
+            }
             if (timer) 
                 delay_timer(timer);
         } else {
@@ -326,15 +589,19 @@ void Server::read_actor(int sockfd) {
     }
 }
 
+template <typename Trigger, typename Actor>
 void Server::write_actor(int sockfd) {
     TimerUtil* timer = users_timer_[sockfd].timer;
 
     // reactor
-    if (actor_pattern_) {
+    if constexpr (Actor::REACTOR) {
         if (timer) 
             delay_timer(timer);
-        // 若监测到写事件，将该事件放入请求队列
-        thread_pool_->append(&users_[sockfd], true);
+        // 若监测到写事件，将该事件放入请求队列，队列已满时响应已经无法完整发送，关闭连接
+        if (!thread_pool_->append(&users_[sockfd], true)) {
+            close_conn(timer, sockfd);
+            return;
+        }
         while (true) {
             if (users_[sockfd].improve_) {
                 if (users_[sockfd].timer_flag_) {
@@ -344,11 +611,13 @@ void Server::write_actor(int sockfd) {
                 users_[sockfd].improve_ = false;
                 break;
             }
+            // 工作线程可能和主线程在同一个CPU上，让出时间片
+            sched_yield();
         }
     // proactor
     } else {
-        if (users_[sockfd].write()) {
-            LOG_INFO("Send data to the client(%s).", inet_ntoa(users_[sockfd].get_address()->sin_addr));
+        if (users_[sockfd].write<Trigger>()) {
+            LOG_DEBUG("Send data to the client(%s).", users_[sockfd].get_ip());
             if (timer) 
                 delay_timer(timer);
         } else {
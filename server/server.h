@@ -14,16 +14,21 @@ public:
     enum {
         MAX_FD = 65536,             //最大文件描述符
         MAX_EVENT_NUMBER = 10000,   //最大事件数
-        TIMESLOT = 5                //最小超时单位
+        TIMESLOT = 5,               //最小超时单位
+        DB_TIMEOUT = 500,           //获取数据库连接的最长等待时间，单位ms
+        FD_RESERVE = 64             //留给日志、数据库连接和管道等的描述符数
     };
 
-    Server(int port, bool close_log, bool write_log, 
-        int conn_pool_size, int thread_pool_size,
+    Server(int port, bool close_log, int write_log, 
+        int conn_pool_size, int conn_pool_min, int thread_pool_size,
         std::string username, std::string password, std::string db_name,
-        bool opt_linger, int trig_mode, bool actor_pattern);
+        bool opt_linger, int trig_mode, bool actor_pattern, bool warm_up, int user_store, bool access_log,
+        int slow_ms, bool capture, int deadline_ms, int overload_ms, int ip_rate, int ip_conns,
+        int header_ms, int body_ms, int min_send_rate);
     ~Server();
 
     void event_listen();
+    // 按触发模式和并发模型选择一次事件循环的特化版本
     void event_loop();
 
     void init_timer(int connfd, struct sockaddr_in client_address);
@@ -31,23 +36,51 @@ public:
     void close_conn(TimerUtil* timer, int sockfd);
 
     bool accept_client_data();
+    // 按IP限流，超过时不发送响应，直接RST关闭，返回是否被拒绝
+    bool rate_limited(int connfd, const sockaddr_in& client_address);
+    // 准入控制，每轮事件循环结束时更新：连接数达到上限时暂停监听，请求队列排队过久时拒绝新请求
+    void check_overload();
+    void pause_listen(bool pause);
+    // 读掉请求数据，发送预先格式化的503后关闭连接，reason为计入的指标
+    void shed(int sockfd, Metrics::Counter reason);
     bool recv_signal(bool& timeout, bool& stop_server);
     
+    // 以下三个函数按连接的触发模式Trigger和并发模型Actor实例化，热路径上没有模式判断
+    template <typename Trigger, typename Actor>
+    void run_loop();
+    template <typename Trigger, typename Actor>
     void read_actor(int sockfd);
+    template <typename Trigger, typename Actor>
     void write_actor(int sockfd);
 
 
 public:
     void init_thread_pool();
     void init_conn_pool();
+    // 初始化MySQL连接池和在它之上的异步层
+    void init_mysql();
     void init_log();
+    void init_metrics();
+    void init_rate_limit();
     void init_trig_mode();
+    // 后台预热用户缓存
+    static void* warm_up_thread(void* arg);
 
     //基础
     int port_;
     std::string root_dir_;
     bool close_log_;
-    bool write_log_;
+    int write_log_;         // 0同步，1异步，2异步二进制
+    bool access_log_;       // 是否记录访问日志
+    int slow_ms_;           // 慢请求阈值，单位ms，0表示不记录
+    bool capture_;          // 是否捕获原始请求
+    int deadline_ms_;       // 请求在请求队列中等待的上限，单位ms，0表示不限
+    int overload_ms_;       // 请求队列排队延迟的上限，单位ms，0表示不拒绝
+    int max_conn_;          // 连接数上限，按RLIMIT_NOFILE计算
+    bool listen_paused_;    // listenfd是否已从epoll中移除
+    bool overloaded_;       // 请求队列排队延迟是否超过上限
+    int ip_rate_;           // 每个IP每秒的请求数和新建连接数，0表示不限
+    int ip_conns_;          // 每个IP的并发连接数，0表示不限
 
     int pipefd_[2];
     int epollfd_;
@@ -55,10 +88,13 @@ public:
 
     //数据库连接池相关
     ConnPool* conn_pool_;
-    int conn_pool_size_;
+    int conn_pool_size_;    // 最大连接数
+    int conn_pool_min_;     // 最小连接数
     std::string username_;  // 登陆数据库用户名
     std::string password_;  // 登陆数据库密码
     std::string db_name_;   // 使用数据库名
+    bool warm_up_;          // 启动时是否按快照预热用户缓存
+    int user_store_;        // 用户存储后端，见UserStore::Backend
 
     //线程池相关
     ThreadPool<HttpConn>* thread_pool_;
@@ -0,0 +1,184 @@
+#include "async_db.h"
+#include "log.h"
+#include "mysql_conn.h"
+#include "register_batcher.h"
+
+#include "user_store.h"
+
+using namespace std;
+
+// 按用户名查询密码
+constexpr char SQL_SELECT_PASSWD[] = "SELECT passwd FROM user WHERE username = ?";
+
+UserStore* UserStore::instance_ = nullptr;
+
+bool UserStore::init(Backend backend, const char* path) {
+    if (backend == BACKEND_LOCAL) {
+        LocalUserStore* store = new LocalUserStore();
+        if (!store->open(path)) {
+            delete store;
+            return false;
+        }
+        instance_ = store;
+    } else {
+        instance_ = new MysqlUserStore();
+    }
+    return true;
+}
+
+Task<UserStore::Status> MysqlUserStore::find(const char* name, char* password, int size) {
+    const char* params[1] = { name };
+    // 只读查询，可以和其他连接的登录查询合并发送
+    AsyncDb::Result result = co_await AsyncDb::get_instance()->query(SQL_SELECT_PASSWD, params, 1, true);
+    // 没有可用的数据库连接
+    if (result.unavailable)
+        co_return UNAVAILABLE;
+    if (!result.ok)
+        co_return FAILED;
+
+    Status status = NOT_FOUND;
+    MYSQL_ROW row = result.res != nullptr ? mysql_fetch_row(result.res) : nullptr;
+    if (row != nullptr && row[0] != nullptr && size > 0) {
+        int length = min((int) mysql_fetch_lengths(result.res)[0], size - 1);
+        memcpy(password, row[0], length);
+        password[length] = '\0';
+        status = OK;
+    }
+    if (result.res != nullptr)
+        mysql_free_result(result.res);
+    co_return status;
+}
+
+Task<UserStore::Status> MysqlUserStore::add(const char* name, const char* password) {
+    // 交给批量写入器，和同一时间窗口内的其他注册合并成一个事务
+    RegisterBatcher::Status status = co_await RegisterBatcher::get_instance()->submit(name, password);
+    if (status == RegisterBatcher::REGISTERED)
+        co_return OK;
+    if (status == RegisterBatcher::DUPLICATE)
+        co_return DUPLICATE;
+    if (status == RegisterBatcher::UNAVAILABLE)
+        co_return UNAVAILABLE;
+    co_return FAILED;
+}
+
+bool MysqlUserStore::saturated() {
+    return AsyncDb::get_instance()->saturated();
+}
+
+bool MysqlUserStore::load(const char* name, char* password, int size) {
+    ConnPool* conn_pool = ConnPool::get_instance();
+    MYSQL* mysql = nullptr;
+    ConnRaii mysql_conn(&mysql, conn_pool);
+    if (mysql == nullptr)
+        return false;
+    const char* params[1] = { name };
+    unsigned long long rows = 0;
+    return conn_pool->execute(mysql, SQL_SELECT_PASSWD, params, 1, password, size, &rows) == 0 && rows > 0;
+}
+
+LocalUserStore::~LocalUserStore() {
+    if (fd_ != -1)
+        close(fd_);
+}
+
+bool LocalUserStore::open(const char* path) {
+    fd_ = ::open(path, O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (fd_ == -1) {
+        LOG_ERROR("UserStore: open %s failed: %s!", path, strerror(errno));
+        return false;
+    }
+
+    // 顺序回放整个文件建立索引，同名的以后写入的为准
+    struct stat st;
+    int copy = fstat(fd_, &st) == 0 ? dup(fd_) : -1;
+    FILE* fp = copy != -1 ? fdopen(copy, "r") : nullptr;
+    if (fp == nullptr) {
+        LOG_ERROR("UserStore: read %s failed: %s!", path, strerror(errno));
+        // fdopen失败时不接管描述符，需要自己关闭
+        if (copy != -1)
+            close(copy);
+        return false;
+    }
+    char name[UINT16_MAX + 1];
+    Header header;
+    off_t offset = 0;
+    off_t size = st.st_size;
+    while (fread(&header, sizeof(header), 1, fp) == 1) {
+        if (fread(name, 1, header.name_len, fp) != header.name_len
+            || fseek(fp, header.password_len, SEEK_CUR) != 0)
+            break;
+        off_t next = offset + sizeof(header) + header.name_len + header.password_len;
+        // fseek可以越过文件末尾，需要确认记录完整
+        if (next > size)
+            break;
+        index_[string(name, header.name_len)] = Entry{ offset + (off_t) sizeof(header) + header.name_len, header.password_len };
+        offset = next;
+    }
+    fclose(fp);
+
+    // 截掉上次崩溃时写了一半的记录
+    if (offset < size && ftruncate(fd_, offset) != 0) {
+        LOG_ERROR("UserStore: truncate %s failed: %s!", path, strerror(errno));
+        return false;
+    }
+    end_ = offset;
+    LOG_INFO("UserStore: load %d users from %s.", (int) index_.size(), path);
+    return true;
+}
+
+Task<UserStore::Status> LocalUserStore::find(const char* name, char* password, int size) {
+    // 本地文件读取很快，不需要挂起
+    co_return load(name, password, size) ? OK : NOT_FOUND;
+}
+
+Task<UserStore::Status> LocalUserStore::add(const char* name, const char* password) {
+    size_t name_len = strlen(name);
+    size_t password_len = strlen(password);
+    if (name_len == 0 || name_len > UINT16_MAX || password_len > UINT16_MAX)
+        co_return FAILED;
+
+    Header header{ (uint16_t) name_len, (uint16_t) password_len };
+    struct iovec iv[3];
+    iv[0].iov_base = &header;
+    iv[0].iov_len = sizeof(header);
+    iv[1].iov_base = (void*) name;
+    iv[1].iov_len = name_len;
+    iv[2].iov_base = (void*) password;
+    iv[2].iov_len = password_len;
+    ssize_t total = sizeof(header) + name_len + password_len;
+
+    // 检查重名和追加在同一把锁内，保证同名只有一条能写入
+    Status status = OK;
+    mutex_.lock();
+    if (index_.find(name) != index_.end()) {
+        status = DUPLICATE;
+    } else if (writev(fd_, iv, 3) != total) {
+        LOG_ERROR("UserStore: append failed: %s!", strerror(errno));
+        // 写了一半的记录截掉，保持文件可以回放
+        if (ftruncate(fd_, end_) != 0)
+            LOG_ERROR("UserStore: truncate failed: %s!", strerror(errno));
+        status = FAILED;
+    } else {
+        index_[name] = Entry{ end_ + (off_t) sizeof(header) + (off_t) name_len, (uint16_t) password_len };
+        end_ += total;
+    }
+    mutex_.unlock();
+    co_return status;
+}
+
+bool LocalUserStore::load(const char* name, char* password, int size) {
+    mutex_.lock();
+    auto iter = index_.find(name);
+    bool found = iter != index_.end();
+    Entry entry = found ? iter->second : Entry{ 0, 0 };
+    mutex_.unlock();
+    if (!found || size <= 0)
+        return false;
+
+    // 记录追加后不再修改，可以在锁外读取
+    int length = min((int) entry.length, size - 1);
+    if (pread(fd_, password, length, entry.offset) != length)
+        return false;
+    password[length] = '\0';
+    return true;
+}
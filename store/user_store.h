@@ -0,0 +1,114 @@
+#ifndef USER_STORE_H
+#define USER_STORE_H
+
+#include "pch.h"
+
+#include "lock.h"
+#include "task.h"
+
+/**
+ * @brief 用户存储后端接口，登录注册只通过它访问用户数据
+ * 启动时选择MySQL或者本地文件实现，UserCache仍然挡在它前面
+ */
+class UserStore {
+public:
+    enum Backend {
+        BACKEND_MYSQL = 0,  // MySQL，经过AsyncDb和RegisterBatcher
+        BACKEND_LOCAL       // 本地日志结构文件，不依赖数据库
+    };
+
+    enum Status {
+        OK,             // 查询到用户或者注册成功
+        NOT_FOUND,      // 用户不存在
+        DUPLICATE,      // 注册时用户名已存在
+        UNAVAILABLE,    // 后端暂时不可用，调用者应返回503
+        FAILED          // 其他错误
+    };
+
+    // 按启动参数创建后端，path为本地实现的数据文件
+    static bool init(Backend backend, const char* path);
+    static UserStore* get_instance() {
+        return instance_;
+    }
+
+    virtual ~UserStore() = default;
+
+    // 查询用户密码，找到时写入password并返回OK
+    virtual Task<Status> find(const char* name, char* password, int size) = 0;
+    // 注册用户，name和password在协程恢复之前必须有效
+    virtual Task<Status> add(const char* name, const char* password) = 0;
+    // 同步查询，供缓存预热线程使用
+    virtual bool load(const char* name, char* password, int size) = 0;
+    // 后端是否已经排满，新的查询应直接返回503
+    virtual bool saturated() {
+        return false;
+    }
+
+    // 转发给当前后端的load，可以作为函数指针传给UserCache::warm_up
+    static bool load_user(const char* name, char* password, int size) {
+        return instance_ != nullptr && instance_->load(name, password, size);
+    }
+
+private:
+    static UserStore* instance_;
+};
+
+/**
+ * @brief MySQL实现
+ * 查询交给AsyncDb在共享连接上执行，注册交给RegisterBatcher攒批提交
+ */
+class MysqlUserStore : public UserStore {
+public:
+    Task<Status> find(const char* name, char* password, int size) override;
+    Task<Status> add(const char* name, const char* password) override;
+    bool load(const char* name, char* password, int size) override;
+    bool saturated() override;
+};
+
+/**
+ * @brief 本地日志结构文件实现
+ * 数据文件只追加，每条记录为2字节用户名长度、2字节密码长度，再接用户名和密码
+ * 启动时顺序回放整个文件，在内存里建立用户名到记录偏移的索引，截掉末尾写了一半的记录
+ * 查询在索引里找到偏移后pread读出密码，注册在锁内检查重名并追加一条记录
+ * 只用write(2)追加，不做fsync，进程崩溃不丢数据，掉电可能丢失最后几条
+ */
+class LocalUserStore : public UserStore {
+public:
+    LocalUserStore() : fd_(-1), end_(0) { }
+    ~LocalUserStore();
+
+    // 打开数据文件并回放，失败返回false
+    bool open(const char* path);
+
+    Task<Status> find(const char* name, char* password, int size) override;
+    Task<Status> add(const char* name, const char* password) override;
+    bool load(const char* name, char* password, int size) override;
+
+private:
+    // 记录头
+    struct Header {
+        uint16_t name_len;
+        uint16_t password_len;
+    };
+
+    // 索引项，指向记录中的密码
+    struct Entry {
+        off_t offset;
+        uint16_t length;
+    };
+
+    // 透明哈希，用const char*查找时不构造std::string
+    struct NameHash {
+        using is_transparent = void;
+        size_t operator()(std::string_view name) const {
+            return std::hash<std::string_view>()(name);
+        }
+    };
+
+    int fd_;
+    off_t end_;                                 // 文件末尾，下一条记录的偏移
+    Mutex mutex_;                               // 保护index_和end_
+    std::unordered_map<std::string, Entry, NameHash, std::equal_to<>> index_;
+};
+
+#endif
@@ -0,0 +1,489 @@
+#include "pch.h"
+#include <thread>
+
+#include "async_db.h"
+#include "config.h"
+#include "executor.h"
+#include "mysql_conn.h"
+
+using namespace std;
+
+/**
+ * async_db_test：AsyncDb对接本地模拟MySQL服务端的测试
+ * 模拟服务端实现握手、COM_QUERY、COM_PING、COM_SET_OPTION和COM_QUIT，每个连接一个线程
+ * 每条语句按其中第一个字符串字面量决定行为：
+ *   stall     不回复，等待客户端断开
+ *   close     直接关闭连接
+ *   error     返回ERR，多语句中后面的语句不再执行
+ *   sleep...  等待SLEEP_MS后正常回复
+ *   其他      SELECT返回一行一列，值为该字面量；其他语句返回OK
+ * 测试在主线程上运行事件循环，覆盖正常查询、合并发送、出错后重发、排队超时、在途超时和连接断开
+ * 失败时返回1
+ */
+
+static int failures = 0;
+
+#define CHECK(cond)                                                             \
+    do {                                                                        \
+        if (!(cond)) {                                                          \
+            fprintf(stderr, "%s:%d: CHECK failed: %s\n", __FILE__, __LINE__, #cond); \
+            failures++;                                                         \
+        }                                                                       \
+    } while (0)
+
+static const int TIMEOUT_MS = 200;
+// 两条写操作依次执行，第二条在超时之内发出，第三条排队超过超时
+static const int SLEEP_MS = TIMEOUT_MS * 3 / 5;
+
+// 能力位，不支持SSL，不使用DEPRECATE_EOF，结果集以EOF包结束
+static const uint32_t SERVER_CAPABILITIES = 0x00000001 | 0x00000002 | 0x00000004 | 0x00000008 // LONG_PASSWORD, FOUND_ROWS, LONG_FLAG, CONNECT_WITH_DB
+    | 0x00000200 | 0x00002000 | 0x00008000                                                      // PROTOCOL_41, TRANSACTIONS, SECURE_CONNECTION
+    | 0x00010000 | 0x00020000 | 0x00040000 | 0x00080000;                                        // MULTI_STATEMENTS, MULTI_RESULTS, PS_MULTI_RESULTS, PLUGIN_AUTH
+static const uint16_t STATUS_AUTOCOMMIT = 0x0002;
+static const uint16_t STATUS_MORE_RESULTS = 0x0008;
+
+static void put_int(string* buf, uint64_t value, int bytes) {
+    for (int i = 0; i < bytes; i++)
+        *buf += (char) ((value >> (8 * i)) & 0xff);
+}
+
+// 测试中的字符串都短于251字节，长度编码只占一个字节
+static void put_str(string* buf, const string& value) {
+    *buf += (char) value.size();
+    *buf += value;
+}
+
+static bool read_full(int fd, char* buf, size_t size) {
+    while (size > 0) {
+        ssize_t n = recv(fd, buf, size, 0);
+        if (n <= 0)
+            return false;
+        buf += n;
+        size -= n;
+    }
+    return true;
+}
+
+class FakeServer {
+public:
+    // 监听127.0.0.1上的随机端口，ConnPool用localhost会走unix socket
+    bool start() {
+        listenfd_ = socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in address;
+        memset(&address, 0, sizeof(address));
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        address.sin_port = 0;
+        socklen_t length = sizeof(address);
+        if (bind(listenfd_, (sockaddr*) &address, sizeof(address)) != 0 || listen(listenfd_, 16) != 0
+            || getsockname(listenfd_, (sockaddr*) &address, &length) != 0)
+            return false;
+        port_ = ntohs(address.sin_port);
+        thread(&FakeServer::accept_loop, this).detach();
+        return true;
+    }
+
+    int port() const {
+        return port_;
+    }
+
+    atomic<int> connections{ 0 };       // 接受的连接数
+    atomic<int> queries{ 0 };           // 收到的COM_QUERY数
+    atomic<int> statements{ 0 };        // 执行的语句数
+
+private:
+    struct Statement {
+        bool select;
+        string literal;
+    };
+
+    void accept_loop() {
+        while (true) {
+            int fd = accept(listenfd_, nullptr, nullptr);
+            if (fd < 0)
+                continue;
+            connections++;
+            thread(&FakeServer::serve, this, fd).detach();
+        }
+    }
+
+    static bool send_packet(int fd, uint8_t* seq, const string& payload) {
+        string buf;
+        put_int(&buf, payload.size(), 3);
+        buf += (char) (*seq)++;
+        buf += payload;
+        return send(fd, buf.data(), buf.size(), MSG_NOSIGNAL) == (ssize_t) buf.size();
+    }
+
+    static bool recv_packet(int fd, uint8_t* seq, string* payload) {
+        unsigned char header[4];
+        if (!read_full(fd, (char*) header, sizeof(header)))
+            return false;
+        size_t length = header[0] | (header[1] << 8) | (header[2] << 16);
+        *seq = header[3] + 1;
+        payload->resize(length);
+        return length == 0 || read_full(fd, &(*payload)[0], length);
+    }
+
+    static string ok_packet(uint64_t affected_rows, uint16_t status) {
+        string buf(1, '\0');
+        put_int(&buf, affected_rows, 1);
+        put_int(&buf, 0, 1);
+        put_int(&buf, status, 2);
+        put_int(&buf, 0, 2);
+        return buf;
+    }
+
+    static string eof_packet(uint16_t status) {
+        string buf(1, '\xfe');
+        put_int(&buf, 0, 2);
+        put_int(&buf, status, 2);
+        return buf;
+    }
+
+    static string err_packet(uint16_t code, const char* message) {
+        string buf(1, '\xff');
+        put_int(&buf, code, 2);
+        buf += "#42000";
+        buf += message;
+        return buf;
+    }
+
+    // 按字面量之外的;切分语句，取出每条语句的第一个字面量并还原转义
+    static vector<Statement> parse(const string& sql) {
+        vector<Statement> statements(1, Statement{ false, "" });
+        size_t start = 0;
+        bool in_literal = false;
+        bool has_literal = false;
+        for (size_t i = 0; i < sql.size(); i++) {
+            char c = sql[i];
+            if (in_literal) {
+                if (c == '\'') {
+                    in_literal = false;
+                    has_literal = true;
+                    continue;
+                }
+                if (c == '\\' && i + 1 < sql.size()) {
+                    c = sql[++i];
+                    c = c == '0' ? '\0' : c == 'n' ? '\n' : c == 'r' ? '\r' : c == 'Z' ? '\032' : c;
+                }
+                if (!has_literal)
+                    statements.back().literal += c;
+            } else if (c == '\'') {
+                in_literal = true;
+            } else if (c == ';') {
+                statements.back().select = strncasecmp(sql.c_str() + start, "SELECT", 6) == 0;
+                statements.push_back(Statement{ false, "" });
+                start = i + 1;
+                has_literal = false;
+            }
+        }
+        statements.back().select = strncasecmp(sql.c_str() + start, "SELECT", 6) == 0;
+        return statements;
+    }
+
+    // 握手声明caching_sha2_password，客户端发来散列后回复快速认证成功，不校验密码
+    bool handshake(int fd) {
+        uint8_t seq = 0;
+        string buf(1, '\x0a');
+        buf += "8.0.0-fake";
+        buf += '\0';
+        put_int(&buf, connections.load(), 4);
+        buf += "abcdefgh";
+        buf += '\0';
+        put_int(&buf, SERVER_CAPABILITIES & 0xffff, 2);
+        put_int(&buf, 255, 1);
+        put_int(&buf, STATUS_AUTOCOMMIT, 2);
+        put_int(&buf, SERVER_CAPABILITIES >> 16, 2);
+        put_int(&buf, 21, 1);
+        buf += string(10, '\0');
+        buf += "ijklmnopqrst";
+        buf += '\0';
+        buf += "caching_sha2_password";
+        buf += '\0';
+        if (!send_packet(fd, &seq, buf))
+            return false;
+
+        string response;
+        if (!recv_packet(fd, &seq, &response))
+            return false;
+        return send_packet(fd, &seq, string("\x01\x03", 2)) && send_packet(fd, &seq, ok_packet(0, STATUS_AUTOCOMMIT));
+    }
+
+    // 依次回复每条语句，返回false表示关闭连接
+    bool query(int fd, uint8_t* seq, const string& sql) {
+        queries++;
+        vector<Statement> parsed = parse(sql);
+        for (size_t i = 0; i < parsed.size(); i++) {
+            const Statement& statement = parsed[i];
+            uint16_t status = STATUS_AUTOCOMMIT | (i + 1 < parsed.size() ? STATUS_MORE_RESULTS : 0);
+            if (statement.literal == "stall")
+                return true;
+            if (statement.literal == "close")
+                return false;
+            statements++;
+            if (statement.literal == "error")
+                return send_packet(fd, seq, err_packet(1064, "fake syntax error"));
+            if (statement.literal.compare(0, 5, "sleep") == 0)
+                this_thread::sleep_for(chrono::milliseconds(SLEEP_MS));
+
+            if (!statement.select) {
+                if (!send_packet(fd, seq, ok_packet(1, status)))
+                    return false;
+                continue;
+            }
+            // 列数、列定义、EOF、一行数据、EOF
+            string column;
+            put_str(&column, "def");
+            put_str(&column, "");
+            put_str(&column, "");
+            put_str(&column, "");
+            put_str(&column, "value");
+            put_str(&column, "");
+            put_int(&column, 0x0c, 1);
+            put_int(&column, 255, 2);
+            put_int(&column, 1024, 4);
+            put_int(&column, 0xfd, 1);
+            put_int(&column, 0, 2);
+            put_int(&column, 0, 1);
+            put_int(&column, 0, 2);
+            string row;
+            put_str(&row, statement.literal);
+            if (!send_packet(fd, seq, string(1, '\x01')) || !send_packet(fd, seq, column)
+                || !send_packet(fd, seq, eof_packet(STATUS_AUTOCOMMIT)) || !send_packet(fd, seq, row)
+                || !send_packet(fd, seq, eof_packet(status)))
+                return false;
+        }
+        return true;
+    }
+
+    void serve(int fd) {
+        if (handshake(fd)) {
+            string payload;
+            uint8_t seq;
+            while (recv_packet(fd, &seq, &payload) && !payload.empty()) {
+                char command = payload[0];
+                bool alive = true;
+                if (command == 0x03)                // COM_QUERY
+                    alive = query(fd, &seq, payload.substr(1));
+                else if (command == 0x1b)           // COM_SET_OPTION
+                    alive = send_packet(fd, &seq, eof_packet(STATUS_AUTOCOMMIT));
+                else if (command == 0x01)           // COM_QUIT
+                    alive = false;
+                else
+                    alive = send_packet(fd, &seq, ok_packet(0, STATUS_AUTOCOMMIT));
+                if (!alive)
+                    break;
+            }
+        }
+        close(fd);
+    }
+
+    int listenfd_ = -1;
+    int port_ = 0;
+};
+
+static FakeServer server;
+static int epollfd = -1;
+// 就绪的协程，事件循环每轮依次恢复，模拟线程池的排队
+static deque<coroutine_handle<>> ready;
+
+// 一次查询，结果集的第一行第一列存入value
+struct Call {
+    const char* sql;
+    const char* param;
+    bool read_only;
+    AsyncDb::Result result;
+    string value;
+    long long elapsed_ms;
+    Task<> task;
+};
+
+static Call make_call(const char* sql, const char* param, bool read_only) {
+    Call call;
+    call.sql = sql;
+    call.param = param;
+    call.read_only = read_only;
+    call.result = AsyncDb::Result{ false, 0, nullptr, false };
+    call.elapsed_ms = 0;
+    return call;
+}
+
+static Task<> run_call(Call* call) {
+    long long start = Executor::now_ms();
+    const char* params[1] = { call->param };
+    call->result = co_await AsyncDb::get_instance()->query(call->sql, params, 1, call->read_only);
+    call->elapsed_ms = Executor::now_ms() - start;
+    if (call->result.res != nullptr) {
+        MYSQL_ROW row = mysql_fetch_row(call->result.res);
+        if (row != nullptr && row[0] != nullptr)
+            call->value = row[0];
+        mysql_free_result(call->result.res);
+    }
+}
+
+// 同时提交所有查询，运行事件循环直到全部完成，超过5秒认为卡住
+static bool run(vector<Call>& calls) {
+    for (Call& call : calls) {
+        call.task = run_call(&call);
+        call.task.resume();
+    }
+    Executor* executor = Executor::get_instance();
+    long long deadline = Executor::now_ms() + 5000;
+    epoll_event events[16];
+    while (true) {
+        while (!ready.empty()) {
+            coroutine_handle<> handle = ready.front();
+            ready.pop_front();
+            handle.resume();
+        }
+        bool done = true;
+        for (Call& call : calls)
+            done = done && call.task.done();
+        if (done)
+            return true;
+        long long remain = deadline - Executor::now_ms();
+        if (remain <= 0)
+            return false;
+        int timeout = executor->next_timeout();
+        if (timeout < 0 || timeout > remain)
+            timeout = (int) remain;
+        int number = epoll_wait(epollfd, events, 16, timeout);
+        for (int i = 0; i < number; i++)
+            executor->dispatch(events[i].data.fd);
+        executor->run_timers();
+    }
+}
+
+static const char SQL_SELECT[] = "SELECT ?";
+static const char SQL_INSERT[] = "INSERT INTO t VALUES(?)";
+
+static void report(const char* name, int failed) {
+    printf("%s: %s\n", name, failures == failed ? "ok" : "FAILED");
+}
+
+// 参数中的引号、反斜杠和分号经过转义后原样返回
+static void test_query() {
+    int failed = failures;
+    vector<Call> calls(2);
+    calls[0] = make_call(SQL_SELECT, "a'b;c\\d", true);
+    calls[1] = make_call(SQL_INSERT, "x", false);
+    CHECK(run(calls));
+    CHECK(calls[0].result.ok && calls[0].value == "a'b;c\\d");
+    CHECK(calls[1].result.ok && calls[1].result.res == nullptr);
+    report("async_db.query", failed);
+}
+
+// 驱动协程空闲时同时提交的只读查询合并成一次多语句请求
+static void test_pipeline() {
+    int failed = failures;
+    const char* params[] = { "p0", "p1", "p2", "p3", "p4", "p5", "p6", "p7" };
+    vector<Call> calls(8);
+    for (int i = 0; i < 8; i++)
+        calls[i] = make_call(SQL_SELECT, params[i], true);
+    int queries = server.queries;
+    int statements = server.statements;
+    CHECK(run(calls));
+    for (int i = 0; i < 8; i++)
+        CHECK(calls[i].result.ok && calls[i].value == params[i]);
+    CHECK(server.queries - queries == 1);
+    CHECK(server.statements - statements == 8);
+    report("async_db.pipeline", failed);
+}
+
+// 出错的语句返回错误，连接保留，之后的只读查询重新发送
+static void test_error() {
+    int failed = failures;
+    vector<Call> calls(3);
+    calls[0] = make_call(SQL_SELECT, "before", true);
+    calls[1] = make_call(SQL_SELECT, "error", true);
+    calls[2] = make_call(SQL_SELECT, "after", true);
+    int connections = server.connections;
+    int queries = server.queries;
+    CHECK(run(calls));
+    CHECK(calls[0].result.ok && calls[0].value == "before");
+    CHECK(!calls[1].result.ok && calls[1].result.error == 1064 && !calls[1].result.unavailable);
+    CHECK(calls[2].result.ok && calls[2].value == "after");
+    CHECK(server.queries - queries == 2);
+    CHECK(server.connections == connections);
+    report("async_db.error", failed);
+}
+
+// 写操作逐条发送，排在两条慢写入之后的第三条排队超时，不再发送
+static void test_queue_timeout() {
+    int failed = failures;
+    vector<Call> calls(3);
+    calls[0] = make_call(SQL_INSERT, "sleep0", false);
+    calls[1] = make_call(SQL_INSERT, "sleep1", false);
+    calls[2] = make_call(SQL_INSERT, "sleep2", false);
+    int statements = server.statements;
+    CHECK(run(calls));
+    CHECK(calls[0].result.ok && calls[1].result.ok);
+    CHECK(!calls[2].result.ok && calls[2].result.unavailable && calls[2].result.error == 0);
+    CHECK(server.statements - statements == 2);
+    report("async_db.queue_timeout", failed);
+}
+
+// 数据库不回复，看门狗在超时后断开连接，查询返回不可用，之后的查询换一条连接
+static void test_inflight_timeout() {
+    int failed = failures;
+    vector<Call> calls(1);
+    calls[0] = make_call(SQL_SELECT, "stall", true);
+    CHECK(run(calls));
+    CHECK(!calls[0].result.ok && calls[0].result.unavailable && calls[0].result.error >= CR_MIN_ERROR);
+    // 看门狗每半个超时检查一次
+    CHECK(calls[0].elapsed_ms >= TIMEOUT_MS && calls[0].elapsed_ms < TIMEOUT_MS * 3);
+
+    calls[0] = make_call(SQL_SELECT, "recovered", true);
+    CHECK(run(calls));
+    CHECK(calls[0].result.ok && calls[0].value == "recovered");
+    report("async_db.inflight_timeout", failed);
+}
+
+// 数据库断开连接，查询返回不可用，连接交还连接池重连
+static void test_disconnect() {
+    int failed = failures;
+    vector<Call> calls(1);
+    calls[0] = make_call(SQL_SELECT, "close", true);
+    CHECK(run(calls));
+    CHECK(!calls[0].result.ok && calls[0].result.unavailable && calls[0].result.error >= CR_MIN_ERROR);
+
+    int connections = server.connections;
+    calls[0] = make_call(SQL_SELECT, "reconnected", true);
+    CHECK(run(calls));
+    CHECK(calls[0].result.ok && calls[0].value == "reconnected");
+    // 连接池后台线程补足最少连接数
+    for (int i = 0; i < 200 && server.connections == connections; i++)
+        this_thread::sleep_for(chrono::milliseconds(10));
+    CHECK(server.connections > connections);
+    report("async_db.disconnect", failed);
+}
+
+int main() {
+    signal(SIGPIPE, SIG_IGN);
+    Config::close_log_ = true;
+    if (!server.start()) {
+        fprintf(stderr, "async_db_test: cannot listen\n");
+        return 1;
+    }
+
+    epollfd = epoll_create(5);
+    Executor::get_instance()->init(epollfd, [](coroutine_handle<> handle) {
+        ready.push_back(handle);
+    });
+    ConnPool* conn_pool = ConnPool::get_instance();
+    conn_pool->init("127.0.0.1", "test", "test", "test", server.port(), 2, 4, true, TIMEOUT_MS);
+    // 只有一条共享连接，合并和排队的行为是确定的
+    if (!AsyncDb::get_instance()->init(conn_pool, 1, 8, TIMEOUT_MS)) {
+        fprintf(stderr, "async_db_test: cannot connect to the fake server\n");
+        return 1;
+    }
+
+    test_query();
+    test_pipeline();
+    test_error();
+    test_queue_timeout();
+    test_inflight_timeout();
+    test_disconnect();
+    return failures == 0 ? 0 : 1;
+}
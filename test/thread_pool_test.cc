@@ -0,0 +1,123 @@
+#include "pch.h"
+#include <thread>
+
+#include "policy.h"
+#include "thread_pool.h"
+
+using namespace std;
+
+/**
+ * thread_pool_test：线程池出队检查的测试
+ * 唯一的工作线程被第一个任务阻塞，期间入队的任务一个连接要求了关闭，一个超过截止时间
+ * 放行后检查前者作为复用丢弃、后者作为超时交给请求关闭，之后新入队的任务正常处理，所有持有都已释放
+ * Proactor和Reactor各跑一遍，失败时返回1
+ */
+
+static int failures = 0;
+
+#define CHECK(cond)                                                             \
+    do {                                                                        \
+        if (!(cond)) {                                                          \
+            fprintf(stderr, "%s:%d: CHECK failed: %s\n", __FILE__, __LINE__, #cond); \
+            failures++;                                                         \
+        }                                                                       \
+    } while (0)
+
+// 模拟HttpConn中线程池用到的部分，记录各个入口被调用的次数
+struct FakeRequest {
+    template <typename Trigger>
+    void process() {
+        processed++;
+        while (block.load(memory_order_acquire))
+            sched_yield();
+        // 真实的请求在协程结束时释放持有
+        unpin();
+    }
+    template <typename Trigger>
+    bool read_once() {
+        return true;
+    }
+    template <typename Trigger>
+    bool write() {
+        return true;
+    }
+    template <typename Trigger>
+    void expire() {
+        expired++;
+    }
+    uint32_t get_generation() const {
+        return generation.load(memory_order_acquire);
+    }
+    void retire() {
+        generation.fetch_add(1, memory_order_release);
+    }
+    void pin() {
+        pins++;
+    }
+    void unpin() {
+        pins--;
+    }
+
+    bool state_ = false;
+    bool improve_ = false;
+    bool timer_flag_ = false;
+    atomic<uint32_t> generation{ 0 };
+    atomic<int> pins{ 0 };
+    atomic<int> processed{ 0 };
+    atomic<int> expired{ 0 };
+    atomic<bool> block{ false };
+};
+
+static const int DEADLINE_MS = 20;
+
+static bool wait_for(const atomic<int>& value, int expected) {
+    for (int i = 0; i < 2000 && value.load() != expected; i++)
+        this_thread::sleep_for(chrono::milliseconds(1));
+    return value.load() == expected;
+}
+
+template <typename Actor>
+static void test_dequeue(const char* name) {
+    int failed = failures;
+    // 工作线程是分离的，不会退出，线程池不释放
+    ThreadPool<FakeRequest>* pool = new ThreadPool<FakeRequest>(nullptr, 1, 16, DEADLINE_MS);
+    pool->start<LevelTrigger, Actor>();
+
+    FakeRequest blocker, recycled, expired, fresh;
+    blocker.block = true;
+    CHECK(pool->append(&blocker));
+    CHECK(wait_for(blocker.processed, 1));
+
+    // 工作线程阻塞期间入队，一个随后要求关闭，两个都排到截止时间之后
+    CHECK(pool->append(&recycled));
+    CHECK(pool->append(&expired));
+    recycled.retire();
+    this_thread::sleep_for(chrono::milliseconds(DEADLINE_MS * 3));
+    blocker.block = false;
+    CHECK(wait_for(blocker.pins, 0));
+    CHECK(wait_for(recycled.pins, 0));
+    CHECK(wait_for(expired.pins, 0));
+
+    CHECK(pool->append(&fresh));
+    CHECK(wait_for(fresh.processed, 1));
+    CHECK(wait_for(fresh.pins, 0));
+
+    CHECK(pool->get_recycled() == 1);
+    CHECK(pool->get_expired() == 1);
+    CHECK(recycled.processed == 0 && recycled.expired == 0 && !recycled.timer_flag_);
+    CHECK(expired.processed == 0);
+    if constexpr (Actor::REACTOR) {
+        CHECK(expired.timer_flag_ && expired.improve_);
+        CHECK(fresh.improve_ && !fresh.timer_flag_);
+    } else {
+        CHECK(expired.expired == 1);
+        CHECK(fresh.expired == 0);
+    }
+    printf("%s: %s\n", name, failures == failed ? "ok" : "FAILED");
+}
+
+int main() {
+    test_dequeue<Proactor>("thread_pool.dequeue.proactor");
+    test_dequeue<Reactor>("thread_pool.dequeue.reactor");
+    return failures == 0 ? 0 : 1;
+}
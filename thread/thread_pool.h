@@ -3,37 +3,87 @@
 
 #include "pch.h"
 
+#include "access_log.h"
 #include "lock.h"
 #include "log.h"
 #include "mysql_conn.h"
+#include "policy.h"
 
+/**
+ * @brief 工作线程池
+ * 请求队列中的任务记录入队时间、截止时间和连接的代数，工作线程出队后先检查
+ * 连接已要求关闭的任务直接丢弃；超过截止时间的任务不再处理，交给请求关闭连接
+ * 入队时调用请求的pin，任务处理完或者请求协程结束时unpin，期间连接的关闭被推迟
+ */
 template <typename T>
 class ThreadPool {
 public:
-    ThreadPool(ConnPool* conn_pool, bool actor_pattern, int thread_pool_size = 8, int max_request = 10000);
+    // deadline_ms为请求在队列中等待的上限，0表示不限
+    ThreadPool(ConnPool* conn_pool, int thread_pool_size = 8, int max_request = 10000, int deadline_ms = 0);
     ~ThreadPool();
+    // 创建工作线程，触发模式Trigger和并发模型Actor在编译期确定，工作线程里没有模式判断
+    template <typename Trigger, typename Actor>
+    void start();
     bool append(T* request);
     bool append(T* request, bool state);
+    // 恢复一个在fd或定时器上挂起的请求协程
+    bool append(std::coroutine_handle<> handle);
+    // 请求队列和协程恢复队列中等待的任务数，只用于监控
+    int get_queue_size() {
+        queue_mutex_.lock();
+        int size = workqueue_.size() + resume_queue_.size();
+        queue_mutex_.unlock();
+        return size;
+    }
+    // 请求队列头部的任务已经排队的时间，单位us，队列为空时为0，用于准入控制
+    long long get_queue_delay() {
+        queue_mutex_.lock();
+        long long enqueue_us = workqueue_.empty() ? 0 : workqueue_.front().enqueue_us;
+        queue_mutex_.unlock();
+        return enqueue_us == 0 ? 0 : AccessLog::now_us() - enqueue_us;
+    }
+    // 超过截止时间丢弃的任务数
+    unsigned long long get_expired() const {
+        return expired_.load(std::memory_order_relaxed);
+    }
+    // 排队期间连接已要求关闭而丢弃的任务数
+    unsigned long long get_recycled() const {
+        return recycled_.load(std::memory_order_relaxed);
+    }
 
 private:
+    // 请求队列中的任务
+    struct Job {
+        T* request;
+        uint32_t generation;        // 入队时连接的代数
+        long long enqueue_us;       // 入队时间，单调时钟
+        long long deadline_us;      // 截止时间，0表示不限
+    };
+
     // 工作线程运行的函数，它不断从工作队列中取出任务并执行之
+    template <typename Trigger, typename Actor>
     static void* worker(void* arg);
+    template <typename Trigger, typename Actor>
     void run();
 
-    int thread_pool_size_;             // 线程池中的线程数
+    int thread_pool_size_;          // 线程池中的线程数
     int max_requests_;              // 请求队列中允许的最大请求数
     pthread_t* threads_;            // 描述线程池的数组，其大小为thread_pool_size_
-    std::list<T*> workqueue_;       // 请求队列
+    std::list<Job> workqueue_;      // 请求队列
+    std::list<std::coroutine_handle<>> resume_queue_;  // 等待恢复的协程队列
     Mutex queue_mutex_;             // 保护请求队列的互斥锁
     Sem queue_sem_;                 // 是否有请求队列的互斥锁
     ConnPool* conn_pool_;           // 数据库连接池
-    bool actor_pattern_;   // 模型切换
+    long long deadline_us_;         // 请求在队列中等待的上限，0表示不限
+    std::atomic<unsigned long long> expired_;
+    std::atomic<unsigned long long> recycled_;
 };
 
 
 template <typename T>
-ThreadPool<T>::ThreadPool(ConnPool* conn_pool, bool actor_pattern, int thread_pool_size, int max_requests)
-    : conn_pool_(conn_pool), actor_pattern_(actor_pattern), thread_pool_size_(thread_pool_size), max_requests_(max_requests), threads_(nullptr) {
+ThreadPool<T>::ThreadPool(ConnPool* conn_pool, int thread_pool_size, int max_requests, int deadline_ms)
+    : thread_pool_size_(thread_pool_size), max_requests_(max_requests), threads_(nullptr), conn_pool_(conn_pool),
+    deadline_us_(deadline_ms * 1000LL), expired_(0), recycled_(0) {
     if (thread_pool_size <= 0 || max_requests <= 0) {
         STDERR_FUNC_LINE();
         exit(EXIT_FAILURE);
@@ -43,9 +93,13 @@ ThreadPool<T>::ThreadPool(ConnPool* conn_pool, bool actor_pattern, int thread_po
         STDERR_FUNC_LINE();
         exit(EXIT_FAILURE);
     }
+}
 
-    for (int i = 0; i < thread_pool_size; i++) {
-        if (pthread_create(&threads_[i], NULL, worker, this) != 0) {
+template <typename T>
+template <typename Trigger, typename Actor>
+void ThreadPool<T>::start() {
+    for (int i = 0; i < thread_pool_size_; i++) {
+        if (pthread_create(&threads_[i], NULL, worker<Trigger, Actor>, this) != 0) {
             delete[] threads_;
             STDERR_FUNC_LINE();
             exit(EXIT_FAILURE);
@@ -65,12 +119,17 @@ ThreadPool<T>::~ThreadPool() {
 
 template <typename T>
 bool ThreadPool<T>::append(T* request) {
+    long long now = AccessLog::now_us();
+    Job job{ request, request->get_generation(), now, deadline_us_ > 0 ? now + deadline_us_ : 0 };
+    // 入队前持有连接，工作线程出队后可能立即释放
+    request->pin();
     queue_mutex_.lock();
     if (workqueue_.size() > max_requests_) {
         queue_mutex_.unlock();
+        request->unpin();
         return false;
     }
-    workqueue_.push_back(request);
+    workqueue_.push_back(job);
     queue_mutex_.unlock();
     queue_sem_.post();
     return true;
@@ -78,57 +137,104 @@ bool ThreadPool<T>::append(T* request) {
 
 template <typename T>
 bool ThreadPool<T>::append(T* request, bool state) {
+    long long now = AccessLog::now_us();
+    Job job{ request, request->get_generation(), now, deadline_us_ > 0 ? now + deadline_us_ : 0 };
+    // 入队前持有连接，工作线程出队后可能立即释放
+    request->pin();
     queue_mutex_.lock();
     if (workqueue_.size() > max_requests_) {
         queue_mutex_.unlock();
+        request->unpin();
         return false;
     }
     request->state_ = state;
-    workqueue_.push_back(request);
+    workqueue_.push_back(job);
+    queue_mutex_.unlock();
+    queue_sem_.post();
+    return true;
+}
+
+template <typename T>
+bool ThreadPool<T>::append(std::coroutine_handle<> handle) {
+    queue_mutex_.lock();
+    resume_queue_.push_back(handle);
     queue_mutex_.unlock();
     queue_sem_.post();
     return true;
 }
 
 template <typename T>
+template <typename Trigger, typename Actor>
 void* ThreadPool<T>::worker(void* arg) {
     ThreadPool* pool = (ThreadPool*) arg;
-    pool->run();
+    pool->template run<Trigger, Actor>();
     return pool;
 }
 
 template <typename T>
+template <typename Trigger, typename Actor>
 void ThreadPool<T>::run() {
     while (true) {
         queue_sem_.wait();
         queue_mutex_.lock();
+        // 优先恢复挂起的协程，让已经在处理中的请求尽快完成
+        if (!resume_queue_.empty()) {
+            std::coroutine_handle<> handle = resume_queue_.front();
+            resume_queue_.pop_front();
+            queue_mutex_.unlock();
+            handle.resume();
+            continue;
+        }
         if (workqueue_.empty()) {
             queue_mutex_.unlock();
             continue;
         }
-        T* request = workqueue_.front();
+        Job job = workqueue_.front();
         workqueue_.pop_front();
         queue_mutex_.unlock();
+        T* request = job.request;
         if (request == nullptr)
             continue;
-        if (actor_pattern_) {
+        // 任务持有连接，fd不会被关闭复用；主线程在排队期间要求了关闭，释放持有后由本线程关闭
+        // reactor模式下主线程等待任务完成，排队期间连接不会被关闭
+        if (job.generation != request->get_generation()) {
+            recycled_.fetch_add(1, std::memory_order_relaxed);
+            request->unpin();
+            continue;
+        }
+        // 客户端多半已经放弃，不再解析请求、获取数据库连接和生成响应
+        if (job.deadline_us > 0 && AccessLog::now_us() > job.deadline_us) {
+            expired_.fetch_add(1, std::memory_order_relaxed);
+            if constexpr (Actor::REACTOR) {
+                request->timer_flag_ = true;
+                request->unpin();
+                request->improve_ = true;
+            } else {
+                request->template expire<Trigger>();
+                request->unpin();
+            }
+            continue;
+        }
+        // 启动了请求协程时，持有交给协程，协程结束时释放
+        if constexpr (Actor::REACTOR) {
             if (!request->state_) {
-                if (request->read_once()) {
+                if (request->template read_once<Trigger>()) {
                     request->improve_ = true;
-                    ConnRaii mysql_conn(&request->mysql_, conn_pool_);
-                    request->process();
+                    request->template process<Trigger>();
                 } else {
-                    request->improve_ = true;
                     request->timer_flag_ = true;
+                    request->unpin();
+                    request->improve_ = true;
                 }
             } else {
-                if (!request->write())
+                if (!request->template write<Trigger>())
                     request->timer_flag_ = true;
+                request->unpin();
                 request->improve_ = true;
             }
         } else {
-            ConnRaii mysql_conn(&request->mysql_, conn_pool_);
-            request->process();
+            // 请求处理是协程，只有登录注册才会在协程内部获取数据库连接
+            request->template process<Trigger>();
         }
     }
 }
@@ -1,4 +1,5 @@
 #include "timer.h"
+#include "usdt.h"
 #include <cstdio>
 
 // 常规销毁链表
@@ -41,7 +42,7 @@ void TimerList::modify_timer(TimerUtil* timer) {
     if (temp == nullptr || (timer->expire < temp->expire))
         return;
     // 被调整定时器是链表头节点，将定时器取出，重新插入
-    if (temp == head_) {
+    if (timer == head_) {
         head_ = head_->next;
         head_->pre = nullptr;
         timer->next = nullptr;
@@ -99,6 +100,7 @@ void TimerList::tick() {
         if (curr < temp->expire)
             break;
         // 当前定时器到期，则调用回调函数，执行定时事件
+        USDT(timer_expire, temp->user_data->sockfd, (long long) temp->expire);
         temp->callback(temp->user_data);
         // 将处理后的定时器从链表容器中删除，并重置头节点
         head_ = temp->next;
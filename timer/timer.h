@@ -8,15 +8,17 @@
 // 连接结构体成员需要用到定时器类
 // 需要前向声明
 class TimerUtil;
+class HttpConn;
 
 // 连接资源
 struct ClientData
 {
-    ClientData() : sockfd(-1), timer(nullptr) { }
+    ClientData() : sockfd(-1), timer(nullptr), conn(nullptr) { }
 
     sockaddr_in address;                // 客户端socket地址
     int sockfd;                         // socket文件描述符
     TimerUtil* timer;                   // 定时器
+    HttpConn* conn;                     // 连接对象，定时器到期时通过它关闭连接
 };
 
 // 定时器类
@@ -0,0 +1,36 @@
+#!/bin/sh
+# 列出二进制中编译进去的tinyweb USDT探针，并和utils/usdt.h中登记的探针核对
+# 缺少登记的探针时返回1，用-DENABLE_USDT=ON编译后由ctest调用，也可以手动运行
+# sh tools/list_probes.sh ./TinyWebServer [utils/usdt.h]
+
+BIN=${1:-./TinyWebServer}
+HEADER=${2:-$(dirname "$0")/../utils/usdt.h}
+
+if [ ! -f "$BIN" ] || [ ! -f "$HEADER" ]; then
+    echo "usage: $0 <binary> [usdt.h]" >&2
+    exit 2
+fi
+
+# readelf按Provider、Name、Location、Arguments的顺序输出每个探针
+FOUND=$(readelf -n "$BIN" | awk '
+    $1 == "Provider:" { provider = $2 }
+    $1 == "Name:" { name = $2 }
+    $1 == "Arguments:" && provider == "tinyweb" { $1 = ""; print name "\t" $0 }
+' | sort -u)
+
+if [ -z "$FOUND" ]; then
+    echo "$BIN: no tinyweb probes, build with -DENABLE_USDT=ON" >&2
+    exit 1
+fi
+echo "$FOUND"
+
+# usdt.h注释中登记的探针，每行形如" *   name(args)   说明"
+EXPECTED=$(sed -n 's/^ \*   \([a-z_]*\)(.*/\1/p' "$HEADER" | sort -u)
+rc=0
+for name in $EXPECTED; do
+    if ! echo "$FOUND" | cut -f1 | grep -qx "$name"; then
+        echo "missing probe: $name" >&2
+        rc=1
+    fi
+done
+exit $rc
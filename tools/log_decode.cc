@@ -0,0 +1,143 @@
+#include "pch.h"
+
+#include "log_record.h"
+
+using namespace std;
+
+// 和Log::write_log的日志分级一致
+static const char* level_str(int level) {
+    if (level == 0) return "[debug]:";
+    if (level == 2) return "[warn]:";
+    if (level == 3) return "[error]:";
+    return "[info]:";
+}
+
+// 按格式串依次展开记录中的参数，长度修饰符按实际记录的类型重新生成
+static string expand(const char* format, const char* args, const char* end) {
+    string out;
+    char buf[4096];
+    const char* p = format;
+    while (*p != '\0') {
+        if (*p != '%') {
+            out += *p++;
+            continue;
+        }
+        if (p[1] == '%') {
+            out += '%';
+            p += 2;
+            continue;
+        }
+
+        // 保留标志、宽度和精度，去掉长度修饰符
+        string spec = "%";
+        p++;
+        while (*p != '\0' && strchr("-+ #0123456789.", *p) != nullptr)
+            spec += *p++;
+        while (*p != '\0' && strchr("hlLqjzt", *p) != nullptr)
+            p++;
+        char conv = *p != '\0' ? *p++ : 's';
+
+        if (args >= end) {
+            out += "<missing>";
+            continue;
+        }
+        char type = *args++;
+        if (type == LOG_ARG_STRING) {
+            uint16_t length;
+            memcpy(&length, args, sizeof(length));
+            args += sizeof(length);
+            string str(args, min((long) length, (long) (end - args)));
+            args += length;
+            snprintf(buf, sizeof(buf), (spec + 's').c_str(), str.c_str());
+        } else {
+            uint64_t bits;
+            memcpy(&bits, args, sizeof(bits));
+            args += sizeof(bits);
+            if (type == LOG_ARG_DOUBLE) {
+                double value;
+                memcpy(&value, &bits, sizeof(value));
+                if (strchr("fFeEgGaA", conv) == nullptr)
+                    conv = 'f';
+                snprintf(buf, sizeof(buf), (spec + conv).c_str(), value);
+            } else if (type == LOG_ARG_POINTER || conv == 'p') {
+                snprintf(buf, sizeof(buf), (spec + 'p').c_str(), (void*) (uintptr_t) bits);
+            } else if (conv == 'c') {
+                snprintf(buf, sizeof(buf), (spec + 'c').c_str(), (int) bits);
+            } else if (strchr("uxXo", conv) != nullptr) {
+                snprintf(buf, sizeof(buf), (spec + "ll" + conv).c_str(), (unsigned long long) bits);
+            } else if (type == LOG_ARG_UINT) {
+                snprintf(buf, sizeof(buf), (spec + "llu").c_str(), (unsigned long long) bits);
+            } else {
+                snprintf(buf, sizeof(buf), (spec + "lld").c_str(), (long long) bits);
+            }
+        }
+        out += buf;
+    }
+    return out;
+}
+
+// 解码一个二进制日志文件，按Log的文本格式输出到stdout
+static bool decode(const char* path) {
+    ifstream in(path, ios::binary);
+    if (!in) {
+        fprintf(stderr, "logdecode: cannot open %s\n", path);
+        return false;
+    }
+    string data((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+    if (data.size() < sizeof(LOG_MAGIC) || memcmp(data.data(), LOG_MAGIC, sizeof(LOG_MAGIC)) != 0) {
+        fprintf(stderr, "logdecode: %s is not a binary log\n", path);
+        return false;
+    }
+
+    // 调用点编号到日志级别和格式串，同一文件中后写入的定义覆盖先前的
+    unordered_map<uint32_t, pair<int, string>> sites;
+    size_t pos = sizeof(LOG_MAGIC);
+    while (pos + sizeof(LogRecordHeader) <= data.size()) {
+        LogRecordHeader header;
+        memcpy(&header, data.data() + pos, sizeof(header));
+        if (header.size < sizeof(header) || pos + header.size > data.size()) {
+            fprintf(stderr, "logdecode: %s truncated at offset %zu\n", path, pos);
+            break;
+        }
+        const char* body = data.data() + pos + sizeof(header);
+        const char* end = data.data() + pos + header.size;
+        pos += header.size;
+
+        if (header.site == LOG_SITE_DEFINE) {
+            uint32_t id;
+            uint32_t level;
+            memcpy(&id, body, sizeof(id));
+            memcpy(&level, body + sizeof(id), sizeof(level));
+            const char* format = body + sizeof(id) + sizeof(level);
+            sites[id] = make_pair((int) level, string(format, strnlen(format, end - format)));
+            continue;
+        }
+
+        auto iter = sites.find(header.site);
+        if (iter == sites.end()) {
+            fprintf(stderr, "logdecode: unknown call site %u\n", header.site);
+            continue;
+        }
+        time_t t = header.ns / 1000000000;
+        struct tm tm;
+        localtime_r(&t, &tm);
+        printf("%d-%02d-%02d %02d:%02d:%02d.%06ld %s %s\n",
+            tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec,
+            (long) (header.ns % 1000000000 / 1000), level_str(iter->second.first),
+            expand(iter->second.second.c_str(), body, end).c_str());
+    }
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s ServerLog.bin...\n", argv[0]);
+        return 1;
+    }
+    int ret = 0;
+    for (int i = 1; i < argc; i++) {
+        if (!decode(argv[i]))
+            ret = 1;
+    }
+    return ret;
+}
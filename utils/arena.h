@@ -0,0 +1,40 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include "pch.h"
+
+/**
+ * @brief 单个请求内的临时内存，指针递增分配，不单独释放，请求之间整体重置
+ * 内存是对象内的定长数组，剩余空间不够时alloc返回nullptr，调用者回落到堆
+ */
+template <size_t SIZE>
+class Arena {
+public:
+    Arena() : used_(0) { }
+
+    void* alloc(size_t size) {
+        size = (size + ALIGN - 1) & ~(ALIGN - 1);
+        if (size > SIZE - used_)
+            return nullptr;
+        void* p = buffer_ + used_;
+        used_ += size;
+        return p;
+    }
+
+    // 之前分配的内存全部作废，调用者保证其中的对象都已析构
+    void reset() {
+        used_ = 0;
+    }
+
+    size_t get_used() const {
+        return used_;
+    }
+
+private:
+    static constexpr size_t ALIGN = alignof(std::max_align_t);
+
+    alignas(std::max_align_t) char buffer_[SIZE];
+    size_t used_;
+};
+
+#endif
@@ -0,0 +1,71 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include "pch.h"
+
+/**
+ * @brief 按2的幂分桶的延迟直方图，单位us
+ * 第0个桶记录0，第i个桶记录[2^(i-1), 2^i)，最后一个桶兜底
+ * 线程安全，每次记录只有几次relaxed原子加，读取时各个桶之间不保证是同一时刻的快照
+ */
+class Histogram {
+public:
+    static constexpr int BUCKETS = 40;
+
+    Histogram() {
+        for (int i = 0; i < BUCKETS; i++)
+            buckets_[i].store(0, std::memory_order_relaxed);
+        count_.store(0, std::memory_order_relaxed);
+        sum_.store(0, std::memory_order_relaxed);
+    }
+
+    static int bucket_of(uint64_t value) {
+        int index = value == 0 ? 0 : 64 - __builtin_clzll(value);
+        return index < BUCKETS ? index : BUCKETS - 1;
+    }
+
+    // 第i个桶的上界(不含)
+    static uint64_t upper_bound(int index) {
+        return index == 0 ? 1 : 1ULL << index;
+    }
+
+    void record(uint64_t value) {
+        buckets_[bucket_of(value)].fetch_add(1, std::memory_order_relaxed);
+        count_.fetch_add(1, std::memory_order_relaxed);
+        sum_.fetch_add(value, std::memory_order_relaxed);
+    }
+
+    uint64_t count() const {
+        return count_.load(std::memory_order_relaxed);
+    }
+
+    uint64_t sum() const {
+        return sum_.load(std::memory_order_relaxed);
+    }
+
+    uint64_t bucket(int index) const {
+        return buckets_[index].load(std::memory_order_relaxed);
+    }
+
+    // 估算分位数，返回所在桶的上界，p取值0~1
+    uint64_t percentile(double p) const {
+        uint64_t total = count();
+        if (total == 0)
+            return 0;
+        uint64_t target = (uint64_t) (p * total);
+        uint64_t seen = 0;
+        for (int i = 0; i < BUCKETS; i++) {
+            seen += bucket(i);
+            if (seen > target)
+                return upper_bound(i);
+        }
+        return upper_bound(BUCKETS - 1);
+    }
+
+private:
+    std::atomic<uint64_t> buckets_[BUCKETS];
+    std::atomic<uint64_t> count_;
+    std::atomic<uint64_t> sum_;
+};
+
+#endif
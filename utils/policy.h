@@ -0,0 +1,33 @@
+#ifndef POLICY_H
+#define POLICY_H
+
+#include "pch.h"
+
+/**
+ * @brief 连接的触发模式和并发模型，作为模板参数在编译期确定
+ * 事件循环、连接读写和工作线程按四种组合各实例化一份，启动时选择一次，热路径上没有模式判断
+ */
+
+// 连接LT触发，每次只recv一次，没读完的数据下次epoll_wait还会通知
+struct LevelTrigger {
+    static constexpr bool EDGE = false;
+    static constexpr uint32_t EPOLL_FLAGS = 0;
+};
+
+// 连接ET触发，需要一次读到EAGAIN为止
+struct EdgeTrigger {
+    static constexpr bool EDGE = true;
+    static constexpr uint32_t EPOLL_FLAGS = EPOLLET;
+};
+
+// 主线程读写套接字，工作线程只处理请求
+struct Proactor {
+    static constexpr bool REACTOR = false;
+};
+
+// 主线程只分发事件，工作线程读写套接字并处理请求
+struct Reactor {
+    static constexpr bool REACTOR = true;
+};
+
+#endif
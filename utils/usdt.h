@@ -0,0 +1,27 @@
+#ifndef USDT_H
+#define USDT_H
+
+/**
+ * @brief USDT静态探针，provider为tinyweb
+ * 用cmake -DENABLE_USDT=ON编译时展开为sys/sdt.h的探针，每个探针是一条nop，
+ * 参数位置记在ELF的.note.stapsdt节中，没有挂载perf/bpftrace时几乎没有开销
+ * 默认关闭，宏展开为空，参数表达式也不会求值
+ * 参数只能是整数或指针，字符串传指针，由bpftrace用str()读取
+ *
+ * 探针及参数：
+ *   accept(fd, ip)                         接受新连接
+ *   read(fd, bytes, us, ok)                读取套接字完成，bytes为缓冲区中的总字节数
+ *   parse(fd, method, url)                 请求解析完成，即将生成响应
+ *   conn_acquire(conn, wait_us, used)      从数据库连接池取得连接，失败时conn为0
+ *   conn_release(conn, broken, used)       归还数据库连接
+ *   timer_expire(fd, expire)               连接的超时定时器到期
+ *   response(fd, status, bytes, total_us)  响应发送完成
+ */
+#ifdef ENABLE_USDT
+#include <sys/sdt.h>
+#define USDT(name, ...) STAP_PROBEV(tinyweb, name, __VA_ARGS__)
+#else
+#define USDT(name, ...) do { } while (0)
+#endif
+
+#endif
@@ -38,18 +38,17 @@ void Utils::add_sig(int sig, void (*handler)(int), bool restart) {
     }
 }
 
-// 定时器回调函数，删除非活动连接在socket上的注册时间，并关闭
+// 定时器回调函数，主线程关闭连接时也经过这里，由HttpConn::close_conn完成关闭
 void Utils::cb_func(ClientData* user_data) {
-    // 删除非活动连接在socket上的注册时间
-    epoll_ctl(epollfd_, EPOLL_CTL_DEL, user_data->sockfd, 0);
     if (user_data == nullptr) {
         STDERR_FUNC_LINE();
         exit(EXIT_FAILURE);
     }
-    // 关闭文件描述符
-    close(user_data->sockfd);
-    // 减少连接数
-    HttpConn::user_count_--;
+    // 请求头或请求体超过截止时间的连接，无论是读取时发现还是定时器到期，都在这里计数
+    Metrics::Counter reason;
+    if (user_data->conn->read_overdue(AccessLog::now_us(), &reason))
+        Metrics::get_instance()->add(reason);
+    user_data->conn->close_conn();
 }
 
 // 定时处理任务，重新定时以不断触发SIGALRM信号
@@ -63,6 +62,11 @@ void Utils::show_error(int connfd, const char* info) {
     close(connfd);
 }
 
+void Utils::set_reset(int fd) {
+    struct linger tmp = {1, 0};
+    setsockopt(fd, SOL_SOCKET, SO_LINGER, &tmp, sizeof(tmp));
+}
+
 // 对文件描述符设置非阻塞
 int Utils::set_nonblock(int fd) {
     int old_flags = fcntl(fd, F_GETFL);
@@ -92,16 +96,3 @@ void Utils::remove_fd(int epollfd, int fd) {
     epoll_ctl(epollfd, EPOLL_CTL_DEL, fd, 0);
     close(fd);
 }
-
-// 将事件重置为EPOLLONESHOT
-void Utils::modify_fd(int epollfd, int fd, int events, int trig_mode) {
-    epoll_event event;
-    event.data.fd = fd;
-
-    if (trig_mode == 1)
-        event.events = events | EPOLLONESHOT | EPOLLET | EPOLLRDHUP;
-    else
-        event.events = events | EPOLLONESHOT | EPOLLRDHUP;
-
-    epoll_ctl(epollfd_, EPOLL_CTL_MOD, fd, &event);
-}
@@ -3,6 +3,7 @@
 
 #include "pch.h"
 
+#include "policy.h"
 #include "timer.h"
 
 
@@ -19,6 +20,8 @@ public:
     // 定时处理任务，重新定时以不断触发SIGALRM信号
     static void timer_handler();
     static void show_error(int connfd, const char* info);
+    // 关闭时直接发送RST，丢弃未发送的数据，不留TIME_WAIT
+    static void set_reset(int fd);
 
     // 对文件描述符设置非阻塞
     static int set_nonblock(int fd);
@@ -26,8 +29,14 @@ public:
     static void add_fd(int epollfd, int fd, bool oneshot, bool trig_mode);
     // 从内核时间表删除描述符
     static void remove_fd(int epollfd, int fd);
-    // 将事件重置为EPOLLONESHOT
-    static void modify_fd(int epollfd, int fd, int events, int trig_mode);
+    // 将事件重置为EPOLLONESHOT，触发模式由模板参数确定
+    template <typename Trigger>
+    static void modify_fd(int epollfd, int fd, int events) {
+        epoll_event event;
+        event.data.fd = fd;
+        event.events = events | EPOLLONESHOT | EPOLLRDHUP | Trigger::EPOLL_FLAGS;
+        epoll_ctl(epollfd, EPOLL_CTL_MOD, fd, &event);
+    }
 
     static int* pipefd_;
     static TimerList timer_list_;